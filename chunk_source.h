@@ -0,0 +1,256 @@
+#pragma once
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <unordered_map>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dgram.h"
+#include "codec.h"
+
+// Read-only view of a WAV file's sample data, cut into fixed size chunks.
+// The file is mapped once and every session serving it shares the mapping, so
+// memory use does not grow with the number of clients; chunk() hands out
+// pointers straight into the page cache.
+class ChunkSource {
+public:
+    // shared instance for path, mapped on first use and unmapped once the last
+    // session lets go of it
+    static std::shared_ptr<const ChunkSource> open(const std::string &path, size_t chunk_bytes = CHUNK_BYTES) {
+        static std::mutex registry_mtx;
+        static std::unordered_map<std::string, std::weak_ptr<const ChunkSource>> registry;
+
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        std::shared_ptr<const ChunkSource> source = registry[path].lock();
+        if (source) {
+            return source;
+        }
+        std::shared_ptr<ChunkSource> fresh(new ChunkSource(chunk_bytes));
+        if (!fresh->map(path)) {
+            registry.erase(path);
+            return nullptr;
+        }
+        registry[path] = fresh;
+        return fresh;
+    }
+
+    ~ChunkSource() {
+        if (base != nullptr) {
+            munmap(base, map_len);
+        }
+    }
+
+    ChunkSource(const ChunkSource &) = delete;
+    ChunkSource &operator=(const ChunkSource &) = delete;
+
+    const WavHeader &header() const {
+        return wav_header;
+    }
+
+    size_t chunkBytes() const {
+        return chunk_bytes;
+    }
+
+    size_t chunkCount() const {
+        return (data_len + chunk_bytes - 1) / chunk_bytes;
+    }
+
+    size_t dataSize() const {
+        return data_len;
+    }
+
+    // chunk i and its length; only the last chunk may be short
+    const uint8_t *chunk(size_t i, size_t &len) const {
+        size_t offset = i * chunk_bytes;
+        len = std::min(chunk_bytes, data_len - offset);
+        return data + offset;
+    }
+
+    // the sample data as a whole, for other chunkings of it
+    const uint8_t *samples() const {
+        return data;
+    }
+
+private:
+    explicit ChunkSource(size_t chunk_bytes) : chunk_bytes(chunk_bytes) {}
+
+    bool map(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Error opening WAV file " << path << std::endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(WavHeader)) {
+            std::cerr << "WAV file is empty or unreadable." << std::endl;
+            ::close(fd);
+            return false;
+        }
+        map_len = st.st_size;
+        void *mapped = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "Error mapping WAV file " << path << std::endl;
+            return false;
+        }
+        base = static_cast<uint8_t *>(mapped);
+        if (!parse()) {
+            return false;
+        }
+        // whole frames per chunk, so every chunk converts and plays on its own
+        size_t frame = std::max<size_t>(1, wav_header.block_align);
+        chunk_bytes = std::max(frame, chunk_bytes / frame * frame);
+        // chunks are read front to back, start the readahead now
+        madvise(base, map_len, MADV_SEQUENTIAL);
+        madvise(base, map_len, MADV_WILLNEED);
+        return true;
+    }
+
+    // walk the RIFF chunks for "fmt " and "data" rather than assuming the
+    // canonical 44 byte layout, and present the result as a WavHeader
+    bool parse() {
+        if (memcmp(base, "RIFF", 4) != 0 || memcmp(base + 8, "WAVE", 4) != 0) {
+            std::cerr << "Invalid WAV file format." << std::endl;
+            return false;
+        }
+        memcpy(&wav_header, base, sizeof(WavHeader));
+        bool have_fmt = false;
+        size_t pos = 12;
+        while (pos + 8 <= map_len) {
+            uint32_t size;
+            memcpy(&size, base + pos + 4, 4);
+            size = le32toh(size);
+            const uint8_t *body = base + pos + 8;
+            if (memcmp(base + pos, "fmt ", 4) == 0 && size >= 16 && pos + 8 + 16 <= map_len) {
+                memcpy(wav_header.fmt, base + pos, 4);
+                wav_header.fmt_size = 16;
+                memcpy(&wav_header.audio_format, body, 16);
+                // WAVE_FORMAT_EXTENSIBLE carries the real format in its subformat GUID
+                if (le16toh(wav_header.audio_format) == 0xFFFE && size >= 40 && pos + 8 + 40 <= map_len) {
+                    memcpy(&wav_header.audio_format, body + 24, 2);
+                }
+                have_fmt = true;
+            } else if (memcmp(base + pos, "data", 4) == 0) {
+                data = body;
+                data_len = std::min<size_t>(size, map_len - (pos + 8));
+                memcpy(wav_header.data, "data", 4);
+                wav_header.data_size = data_len;
+                wav_header.overall_size = sizeof(WavHeader) - 8 + data_len;
+                return have_fmt;
+            }
+            pos += 8 + size + (size & 1);
+        }
+        std::cerr << "WAV file has no data chunk." << std::endl;
+        return false;
+    }
+
+    size_t chunk_bytes;
+    uint8_t *base = nullptr;
+    size_t map_len = 0;
+    const uint8_t *data = nullptr;
+    size_t data_len = 0;
+    WavHeader wav_header;
+};
+
+// A ChunkSource as CODEC_LPC blocks (codec.h). The file is coded once, on the
+// first request that negotiates the codec, and the blocks are shared the same
+// way the mapping is. The chunk size is the largest whole number of frames up
+// to max_chunk_bytes, halving, whose every block fits one packet, so well
+// compressed audio also takes proportionally fewer packets.
+class CodedChunks {
+public:
+    static std::shared_ptr<const CodedChunks> open(std::shared_ptr<const ChunkSource> pcm, size_t max_chunk_bytes) {
+        static std::mutex registry_mtx;
+        static std::map<std::pair<const ChunkSource *, size_t>, std::weak_ptr<const CodedChunks>> registry;
+
+        // an entry keeps its ChunkSource alive, so the address cannot be reused under it
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        auto key = std::make_pair(pcm.get(), max_chunk_bytes);
+        std::shared_ptr<const CodedChunks> coded = registry[key].lock();
+        if (coded) {
+            return coded;
+        }
+        std::shared_ptr<CodedChunks> fresh(new CodedChunks(std::move(pcm)));
+        fresh->encodeAll(max_chunk_bytes);
+        registry[key] = fresh;
+        return fresh;
+    }
+
+    CodedChunks(const CodedChunks &) = delete;
+    CodedChunks &operator=(const CodedChunks &) = delete;
+
+    size_t chunkBytes() const {
+        return chunk_bytes;
+    }
+
+    size_t chunkCount() const {
+        return offsets.size() - 1;
+    }
+
+    size_t codedSize() const {
+        return blocks.size();
+    }
+
+    // coded block i, what goes on the wire
+    const uint8_t *block(size_t i, size_t &len) const {
+        len = offsets[i + 1] - offsets[i];
+        return blocks.data() + offsets[i];
+    }
+
+    // the PCM block i decodes to
+    const uint8_t *raw(size_t i, size_t &len) const {
+        size_t offset = i * chunk_bytes;
+        len = std::min(chunk_bytes, pcm->dataSize() - offset);
+        return pcm->samples() + offset;
+    }
+
+private:
+    explicit CodedChunks(std::shared_ptr<const ChunkSource> pcm) : pcm(std::move(pcm)) {}
+
+    void encodeAll(size_t max_chunk_bytes) {
+        const WavHeader &header = pcm->header();
+        size_t frame = std::max<size_t>(1, header.block_align);
+        auto start = std::chrono::steady_clock::now();
+        CodecEncoder encoder;
+        uint8_t out[MAX_PAYLOAD_SIZE];
+        for (size_t target = max_chunk_bytes;; target /= 2) {
+            chunk_bytes = std::max(frame, target / frame * frame);
+            // a verbatim block always fits at this size, stop here at the latest
+            bool last = chunk_bytes + 1 <= MAX_PAYLOAD_SIZE || chunk_bytes == frame;
+            blocks.clear();
+            offsets.assign(1, 0);
+            bool fits = true;
+            size_t count = (pcm->dataSize() + chunk_bytes - 1) / chunk_bytes;
+            for (size_t i = 0; i < count; i++) {
+                size_t len;
+                const uint8_t *pcm_block = raw(i, len);
+                size_t n = encoder.encode(pcm_block, len, header, out, sizeof(out));
+                if (n == 0) {
+                    fits = false;
+                    break;
+                }
+                blocks.insert(blocks.end(), out, out + n);
+                offsets.push_back(blocks.size());
+            }
+            if (fits || last) {
+                break;
+            }
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Coded " << pcm->dataSize() << " bytes of PCM into " << chunkCount() << " blocks of "
+                  << chunk_bytes << " bytes, " << (pcm->dataSize() > 0 ? 100.0 * blocks.size() / pcm->dataSize() : 0)
+                  << "% of raw, in " << ms << " ms" << std::endl;
+    }
+
+    std::shared_ptr<const ChunkSource> pcm;
+    size_t chunk_bytes = 0;
+    std::vector<uint8_t> blocks;
+    std::vector<size_t> offsets;   // block i is [offsets[i], offsets[i + 1])
+};
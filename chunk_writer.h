@@ -0,0 +1,100 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "dgram.h"
+#include "codec.h"
+
+// Receiving end of a ChunkSource: the output WAV is sized from the stream info
+// up front and every chunk is written to its final offset the moment it
+// arrives, in whatever order that is. Nothing is buffered, so memory stays at
+// one bit per chunk and the file is complete once the last hole is filled.
+class ChunkWriter {
+public:
+    ChunkWriter() = default;
+    ChunkWriter(const ChunkWriter &) = delete;
+    ChunkWriter &operator=(const ChunkWriter &) = delete;
+
+    ~ChunkWriter() {
+        close();
+    }
+
+    bool open(const std::string &path, const StreamInfo &info) {
+        // coded chunks are bigger than a packet before compression
+        size_t max_chunk = info.codec != CODEC_NONE ? CODEC_MAX_BLOCK_BYTES : MAX_PAYLOAD_SIZE;
+        if (info.chunk_bytes == 0 || info.chunk_bytes > max_chunk || info.header.data_size < 0 ||
+            info.chunk_count != ((uint64_t)info.header.data_size + info.chunk_bytes - 1) / info.chunk_bytes) {
+            std::cerr << "Stream info does not describe a usable transfer." << std::endl;
+            return false;
+        }
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Error opening output file " << path << std::endl;
+            return false;
+        }
+        header = info.header;
+        chunk_bytes = info.chunk_bytes;
+        data_size = info.header.data_size;
+        if (ftruncate(fd, sizeof(WavHeader) + data_size) < 0 ||
+            pwrite(fd, &header, sizeof(WavHeader), 0) != (ssize_t)sizeof(WavHeader)) {
+            std::cerr << "Error preallocating output file " << path << std::endl;
+            close();
+            return false;
+        }
+        received.resize(info.chunk_count);
+        return true;
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    // store chunk id; false if it was a duplicate or does not belong here
+    bool write(int64_t id, const uint8_t *payload, size_t len) {
+        if (fd < 0 || received.test(id) || id < 0 || id >= received.bits) {
+            return false;
+        }
+        size_t offset = (size_t)id * chunk_bytes;
+        len = std::min(len, chunkLength(id));
+        if (pwrite(fd, payload, len, sizeof(WavHeader) + offset) != (ssize_t)len) {
+            std::cerr << "Error writing chunk " << id << std::endl;
+            return false;
+        }
+        received.set(id);
+        return true;
+    }
+
+    size_t chunkLength(int64_t id) const {
+        return std::min(chunk_bytes, data_size - (size_t)id * chunk_bytes);
+    }
+
+    // read back a chunk already written (FEC needs the survivors of a group)
+    size_t read(int64_t id, uint8_t *buf) const {
+        size_t len = chunkLength(id);
+        if (pread(fd, buf, len, sizeof(WavHeader) + (size_t)id * chunk_bytes) != (ssize_t)len) {
+            std::cerr << "Error reading back chunk " << id << std::endl;
+        }
+        return len;
+    }
+
+    bool complete() const {
+        return fd >= 0 && received.count == received.bits;
+    }
+
+    void close() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    WavHeader header;
+    ChunkBitmap received;
+
+private:
+    int fd = -1;
+    size_t chunk_bytes = 0;
+    size_t data_size = 0;
+};
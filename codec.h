@@ -0,0 +1,554 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <endian.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "dgram.h"
+
+// Lossless compression of integer PCM, one block at a time, in the spirit of
+// FLAC: every channel is predicted with the best of the fixed polynomial
+// predictors of order 0-4 and the residual is Rice coded in partitions of
+// CODEC_PARTITION samples, each with its own parameter. Stereo additionally
+// tries left/side, side/right and mid/side. Blocks stand alone, so a lost or
+// reordered packet never holds up the decoding of another.
+//
+// Block layout: mode u8, then for CODEC_BLOCK_CODED the stereo mode u8 and a
+// bitstream (MSB first) holding per channel
+//   order u3 | wasted bits u6 | per partition: rice k u6, residuals
+// padded to a byte, then whatever trailing bytes do not make a whole frame.
+// A block that does not get smaller is sent as CODEC_BLOCK_VERBATIM.
+
+#define CODEC_NONE 0
+#define CODEC_LPC 1
+
+#define CODEC_BLOCK_VERBATIM 0
+#define CODEC_BLOCK_CODED 1
+
+#define CODEC_STEREO_INDEPENDENT 0
+#define CODEC_STEREO_LEFT_SIDE 1
+#define CODEC_STEREO_SIDE_RIGHT 2
+#define CODEC_STEREO_MID_SIDE 3
+
+#define CODEC_MAX_ORDER 4
+#define CODEC_PARTITION 64       // samples per Rice partition
+#define CODEC_MAX_CHANNELS 8
+#define CODEC_MAX_FRAMES 4096    // per block
+#define CODEC_MAX_BLOCK_BYTES 4096  // PCM bytes per block, i.e. chunk_bytes of a coded stream
+#define CODEC_MAX_UNARY 65536    // longer runs only come from corrupt input
+
+// integer PCM with a block_align that matches its channels; anything else
+// (float, extensible headers) travels raw
+inline bool codecSupports(const WavHeader &header) {
+    int width = header.bits_per_sample / 8;
+    return header.audio_format == 1 && header.bits_per_sample % 8 == 0 && width >= 1 && width <= 4 &&
+           header.num_channels >= 1 && header.num_channels <= CODEC_MAX_CHANNELS &&
+           header.block_align == header.num_channels * width;
+}
+
+struct BitWriter {
+    uint8_t *out;
+    size_t cap;
+    size_t pos = 0;
+    uint64_t acc = 0;
+    int bits = 0;
+    bool overflow = false;
+
+    BitWriter(uint8_t *out, size_t cap) : out(out), cap(cap) {}
+
+    // n <= 32; written out 32 bits at a time
+    void put(uint64_t value, int n) {
+        acc = (acc << n) | (value & ((1ULL << n) - 1));
+        bits += n;
+        if (bits >= 32) {
+            bits -= 32;
+            if (pos + 4 > cap) {
+                overflow = true;
+                return;
+            }
+            uint32_t be = htobe32((uint32_t)(acc >> bits));
+            memcpy(out + pos, &be, 4);
+            pos += 4;
+        }
+    }
+
+    void putUnary(uint64_t q) {
+        while (q >= 32 && !overflow) {
+            put(0, 32);
+            q -= 32;
+        }
+        put(1, (int)q + 1);
+    }
+
+    void putRice(uint64_t u, int k) {
+        uint64_t q = u >> k;
+        if (q + 1 + k <= 32) {
+            // the common case: stop bit and low bits in one go
+            put((1ULL << k) | (u & ((1ULL << k) - 1)), (int)q + 1 + k);
+            return;
+        }
+        putUnary(q);
+        if (k > 32) {
+            put(u >> 32, k - 32);
+            put(u, 32);
+        } else if (k > 0) {
+            put(u, k);
+        }
+    }
+
+    // flush, padding the last byte with zeros
+    size_t finish() {
+        while (bits > 0 && !overflow) {
+            if (pos >= cap) {
+                overflow = true;
+                break;
+            }
+            int n = std::min(bits, 8);
+            out[pos++] = (uint8_t)(acc >> (bits - n) << (8 - n));
+            bits -= n;
+        }
+        return pos;
+    }
+};
+
+struct BitReader {
+    const uint8_t *in;
+    size_t len;
+    size_t pos = 0;
+    uint64_t acc = 0;   // left aligned
+    int bits = 0;
+    bool error = false;
+
+    BitReader(const uint8_t *in, size_t len) : in(in), len(len) {}
+
+    void refill() {
+        while (bits <= 56 && pos < len) {
+            acc |= (uint64_t)in[pos++] << (56 - bits);
+            bits += 8;
+        }
+    }
+
+    // n <= 32
+    uint64_t get(int n) {
+        if (n == 0) {
+            return 0;
+        }
+        refill();
+        if (bits < n) {
+            error = true;
+            return 0;
+        }
+        uint64_t value = acc >> (64 - n);
+        acc <<= n;
+        bits -= n;
+        return value;
+    }
+
+    uint64_t getUnary() {
+        uint64_t q = 0;
+        for (;;) {
+            refill();
+            if (acc != 0) {
+                int zeros = __builtin_clzll(acc);
+                q += zeros;
+                acc = zeros == 63 ? 0 : acc << (zeros + 1);
+                bits -= zeros + 1;
+                return q;
+            }
+            q += bits;
+            acc = 0;
+            bits = 0;
+            if (pos >= len || q > CODEC_MAX_UNARY) {
+                error = true;
+                return 0;
+            }
+        }
+    }
+
+    uint64_t getRice(int k) {
+        uint64_t q = getUnary();
+        uint64_t low = k > 32 ? get(k - 32) << 32 | get(32) : get(k);
+        return q << k | low;
+    }
+
+    // bytes consumed once the padding of the last byte is skipped
+    size_t bytesUsed() const {
+        return pos - bits / 8;
+    }
+};
+
+inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t u) {
+    return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+// One step up in predictor order: out[i] = in[i] - in[i - 1] from i = order
+// on, the first order samples (the warm-up of the lower orders) are copied;
+// order 0 is a plain copy.
+// Returns the sum of |out|, the cost estimate used to pick the order.
+inline uint64_t fixedResidualScalar(const int64_t *in, int64_t *out, size_t n, int order) {
+    uint64_t sum = 0;
+    size_t i = 0;
+    for (; i < (size_t)std::max(order, 1) && i < n; i++) {
+        out[i] = in[i];
+        sum += (uint64_t)std::abs(in[i]);
+    }
+    for (; i < n; i++) {
+        out[i] = order == 0 ? in[i] : in[i] - in[i - 1];
+        sum += (uint64_t)std::abs(out[i]);
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+inline uint64_t fixedResidualAvx2(const int64_t *in, int64_t *out, size_t n, int order) {
+    if (n < (size_t)order + 8) {
+        return fixedResidualScalar(in, out, n, order);
+    }
+    uint64_t sum = 0;
+    for (int i = 0; i < order; i++) {
+        out[i] = in[i];
+        sum += (uint64_t)std::abs(in[i]);
+    }
+    size_t i = std::max(order, 1);
+    if (order == 0) {
+        out[0] = in[0];
+        sum += (uint64_t)std::abs(in[0]);
+    }
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (; i + 4 <= n; i += 4) {
+        __m256i cur = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i prev = _mm256_loadu_si256((const __m256i *)(in + i - 1));
+        __m256i d = order == 0 ? cur : _mm256_sub_epi64(cur, prev);
+        _mm256_storeu_si256((__m256i *)(out + i), d);
+        // no 64 bit abs before AVX-512: flip by the sign mask
+        __m256i sign = _mm256_cmpgt_epi64(zero, d);
+        acc = _mm256_add_epi64(acc, _mm256_sub_epi64(_mm256_xor_si256(d, sign), sign));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; i++) {
+        out[i] = order == 0 ? in[i] : in[i] - in[i - 1];
+        sum += (uint64_t)std::abs(out[i]);
+    }
+    return sum;
+}
+#endif
+
+// picked once per process from what the CPU supports
+inline uint64_t fixedResidual(const int64_t *in, int64_t *out, size_t n, int order) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) {
+        return fixedResidualAvx2(in, out, n, order);
+    }
+#endif
+    return fixedResidualScalar(in, out, n, order);
+}
+
+inline int64_t loadSample(const uint8_t *p, int width) {
+    switch (width) {
+    case 1:
+        return (int64_t)p[0] - 128;
+    case 2: {
+        int16_t v;
+        memcpy(&v, p, 2);
+        return (int16_t)le16toh(v);
+    }
+    case 3:
+        return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+    default: {
+        int32_t v;
+        memcpy(&v, p, 4);
+        return (int32_t)le32toh(v);
+    }
+    }
+}
+
+inline void storeSample(uint8_t *p, int width, int64_t v) {
+    switch (width) {
+    case 1:
+        p[0] = (uint8_t)(v + 128);
+        break;
+    case 2: {
+        uint16_t le = htole16((uint16_t)v);
+        memcpy(p, &le, 2);
+        break;
+    }
+    case 3:
+        p[0] = v & 0xff;
+        p[1] = (v >> 8) & 0xff;
+        p[2] = (v >> 16) & 0xff;
+        break;
+    default: {
+        uint32_t le = htole32((uint32_t)v);
+        memcpy(p, &le, 4);
+        break;
+    }
+    }
+}
+
+// Scratch space is kept between blocks; one encoder per thread.
+class CodecEncoder {
+public:
+    // code len bytes of raw PCM into out (at most cap bytes); returns the
+    // block size, 0 if not even the verbatim block fits
+    size_t encode(const uint8_t *raw, size_t len, const WavHeader &header, uint8_t *out, size_t cap) {
+        size_t frames = header.block_align > 0 ? len / header.block_align : 0;
+        // only worth it if it comes out smaller than the raw block
+        size_t limit = std::min(cap, len);
+        if (codecSupports(header) && frames > 0 && frames <= CODEC_MAX_FRAMES && limit > 2) {
+            size_t coded = encodeCoded(raw, len, frames, header, out, limit);
+            if (coded > 0) {
+                return coded;
+            }
+        }
+        if (len + 1 > cap) {
+            return 0;
+        }
+        out[0] = CODEC_BLOCK_VERBATIM;
+        memcpy(out + 1, raw, len);
+        return len + 1;
+    }
+
+private:
+    size_t encodeCoded(const uint8_t *raw, size_t len, size_t frames, const WavHeader &header, uint8_t *out, size_t cap) {
+        int channels = header.num_channels;
+        int width = header.bits_per_sample / 8;
+        size_t tail = len - frames * header.block_align;
+        int lanes = channels == 2 ? 4 : channels;
+        samples.resize(lanes);
+        for (int c = 0; c < lanes; c++) {
+            samples[c].resize(frames);
+        }
+        for (int c = 0; c < channels; c++) {
+            const uint8_t *p = raw + c * width;
+            int64_t *x = samples[c].data();
+            for (size_t i = 0; i < frames; i++, p += header.block_align) {
+                x[i] = loadSample(p, width);
+            }
+        }
+
+        int stereo = CODEC_STEREO_INDEPENDENT;
+        int order[CODEC_MAX_CHANNELS + 2];
+        int chosen[2] = {0, 1};
+        if (channels == 2) {
+            int64_t *l = samples[0].data();
+            int64_t *r = samples[1].data();
+            int64_t *mid = samples[2].data();
+            int64_t *side = samples[3].data();
+            for (size_t i = 0; i < frames; i++) {
+                mid[i] = (l[i] + r[i]) >> 1;
+                side[i] = l[i] - r[i];
+            }
+            uint64_t cost[4];
+            for (int c = 0; c < 4; c++) {
+                order[c] = bestOrder(samples[c].data(), frames, cost[c]);
+            }
+            uint64_t pairs[4] = {cost[0] + cost[1], cost[0] + cost[3], cost[3] + cost[1], cost[2] + cost[3]};
+            static const int lanes_of[4][2] = {{0, 1}, {0, 3}, {3, 1}, {2, 3}};
+            stereo = (int)(std::min_element(pairs, pairs + 4) - pairs);
+            chosen[0] = lanes_of[stereo][0];
+            chosen[1] = lanes_of[stereo][1];
+        }
+
+        out[0] = CODEC_BLOCK_CODED;
+        out[1] = stereo;
+        BitWriter bw(out + 2, cap - 2);
+        for (int c = 0; c < channels; c++) {
+            int lane = channels == 2 ? chosen[c] : c;
+            if (channels == 2) {
+                encodeChannel(bw, samples[lane].data(), frames, order[lane]);
+            } else {
+                uint64_t cost;
+                encodeChannel(bw, samples[lane].data(), frames, bestOrder(samples[lane].data(), frames, cost));
+            }
+            if (bw.overflow) {
+                return 0;
+            }
+        }
+        size_t size = 2 + bw.finish();
+        if (bw.overflow || size + tail >= cap) {
+            return 0;
+        }
+        memcpy(out + size, raw + frames * header.block_align, tail);
+        return size + tail;
+    }
+
+    // lowest total |residual| over the fixed orders
+    int bestOrder(const int64_t *x, size_t n, uint64_t &cost) {
+        for (int p = 0; p <= CODEC_MAX_ORDER; p++) {
+            diff[p].resize(n);
+        }
+        int best = 0;
+        cost = fixedResidual(x, diff[0].data(), n, 0);
+        for (int p = 1; p <= CODEC_MAX_ORDER; p++) {
+            uint64_t c = fixedResidual(diff[p - 1].data(), diff[p].data(), n, p);
+            if (c < cost) {
+                cost = c;
+                best = p;
+            }
+        }
+        return best;
+    }
+
+    void encodeChannel(BitWriter &bw, int64_t *x, size_t n, int order) {
+        // low bits that are zero throughout (e.g. 16 bit audio in a 32 bit
+        // container) are not worth sending
+        uint64_t any = 0;
+        for (size_t i = 0; i < n; i++) {
+            any |= (uint64_t)x[i];
+        }
+        int wasted = any == 0 ? 0 : std::min(__builtin_ctzll(any), 63);
+        if (wasted > 0) {
+            for (size_t i = 0; i < n; i++) {
+                x[i] >>= wasted;
+            }
+        }
+        for (int p = 0; p <= CODEC_MAX_ORDER; p++) {
+            diff[p].resize(n);
+        }
+        fixedResidual(x, diff[0].data(), n, 0);
+        for (int p = 1; p <= order; p++) {
+            fixedResidual(diff[p - 1].data(), diff[p].data(), n, p);
+        }
+        const int64_t *res = diff[order].data();
+        bw.put(order, 3);
+        bw.put(wasted, 6);
+        for (size_t start = 0; start < n && !bw.overflow; start += CODEC_PARTITION) {
+            size_t count = std::min<size_t>(CODEC_PARTITION, n - start);
+            uint64_t sum = 0;
+            for (size_t i = 0; i < count; i++) {
+                sum += zigzag(res[start + i]);
+            }
+            // k ~ log2 of the mean, the usual estimate
+            int k = 0;
+            while (k < 62 && ((uint64_t)count << (k + 1)) < sum) {
+                k++;
+            }
+            bw.put(k, 6);
+            for (size_t i = 0; i < count && !bw.overflow; i++) {
+                bw.putRice(zigzag(res[start + i]), k);
+            }
+        }
+    }
+
+    std::vector<std::vector<int64_t>> samples;
+    std::vector<int64_t> diff[CODEC_MAX_ORDER + 1];
+};
+
+class CodecDecoder {
+public:
+    // rebuild the len raw bytes block was made from; false if it is corrupt
+    bool decode(const uint8_t *block, size_t block_len, const WavHeader &header, uint8_t *raw, size_t len) {
+        if (block_len < 1) {
+            return false;
+        }
+        if (block[0] == CODEC_BLOCK_VERBATIM) {
+            if (block_len != len + 1) {
+                return false;
+            }
+            memcpy(raw, block + 1, len);
+            return true;
+        }
+        if (block[0] != CODEC_BLOCK_CODED || block_len < 2 || !codecSupports(header)) {
+            return false;
+        }
+        int channels = header.num_channels;
+        int width = header.bits_per_sample / 8;
+        size_t frames = len / header.block_align;
+        size_t tail = len - frames * header.block_align;
+        int stereo = block[1];
+        if (frames == 0 || frames > CODEC_MAX_FRAMES || (stereo != CODEC_STEREO_INDEPENDENT && channels != 2) ||
+            stereo > CODEC_STEREO_MID_SIDE) {
+            return false;
+        }
+        samples.resize(channels);
+        BitReader br(block + 2, block_len - 2);
+        for (int c = 0; c < channels; c++) {
+            samples[c].resize(frames);
+            if (!decodeChannel(br, samples[c].data(), frames)) {
+                return false;
+            }
+        }
+        size_t used = 2 + br.bytesUsed();
+        if (used + tail != block_len) {
+            return false;
+        }
+
+        if (channels == 2 && stereo != CODEC_STEREO_INDEPENDENT) {
+            int64_t *a = samples[0].data();
+            int64_t *b = samples[1].data();
+            for (size_t i = 0; i < frames; i++) {
+                int64_t l, r;
+                // wrapping arithmetic: a corrupt block may overflow, it must not be UB
+                if (stereo == CODEC_STEREO_LEFT_SIDE) {
+                    l = a[i];
+                    r = (int64_t)((uint64_t)a[i] - (uint64_t)b[i]);
+                } else if (stereo == CODEC_STEREO_SIDE_RIGHT) {
+                    r = b[i];
+                    l = (int64_t)((uint64_t)a[i] + (uint64_t)r);
+                } else {
+                    int64_t mid = (int64_t)((uint64_t)a[i] << 1 | (b[i] & 1));
+                    l = (int64_t)((uint64_t)mid + (uint64_t)b[i]) >> 1;
+                    r = (int64_t)((uint64_t)mid - (uint64_t)b[i]) >> 1;
+                }
+                a[i] = l;
+                b[i] = r;
+            }
+        }
+        for (int c = 0; c < channels; c++) {
+            uint8_t *p = raw + c * width;
+            const int64_t *x = samples[c].data();
+            for (size_t i = 0; i < frames; i++, p += header.block_align) {
+                storeSample(p, width, x[i]);
+            }
+        }
+        memcpy(raw + frames * header.block_align, block + used, tail);
+        return true;
+    }
+
+private:
+    bool decodeChannel(BitReader &br, int64_t *x, size_t n) {
+        int order = (int)br.get(3);
+        int wasted = (int)br.get(6);
+        if (br.error || order > CODEC_MAX_ORDER) {
+            return false;
+        }
+        for (size_t start = 0; start < n; start += CODEC_PARTITION) {
+            size_t count = std::min<size_t>(CODEC_PARTITION, n - start);
+            int k = (int)br.get(6);
+            for (size_t i = 0; i < count; i++) {
+                x[start + i] = unzigzag(br.getRice(k));
+            }
+            if (br.error) {
+                return false;
+            }
+        }
+        // undo the differences one order at a time
+        for (int p = order; p >= 1; p--) {
+            for (size_t i = p; i < n; i++) {
+                x[i] = (int64_t)((uint64_t)x[i] + (uint64_t)x[i - 1]);
+            }
+        }
+        if (wasted > 0) {
+            for (size_t i = 0; i < n; i++) {
+                x[i] = (int64_t)((uint64_t)x[i] << wasted);
+            }
+        }
+        return true;
+    }
+
+    std::vector<std::vector<int64_t>> samples;
+};
@@ -0,0 +1,88 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include "chunk_source.h"
+#include "codec.h"
+
+// Throughput of the lossless codec on one core: codes a WAV file block by
+// block for a few seconds each way and reports the ratio, MB/s and how many
+// real time streams of this file one core could keep coded.
+
+#define BENCH_SECONDS 2.0
+
+int main(int argc, char *argv[]){
+    std::string path = "SampleWav.wav";
+    size_t chunk_bytes = 2048;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc) {
+            chunk_bytes = std::min<size_t>(atoi(argv[++i]), CODEC_MAX_BLOCK_BYTES);
+        } else if (argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            std::cerr << "usage: " << argv[0] << " [FILE.wav] [--chunk BYTES]" << std::endl;
+            return 1;
+        }
+    }
+    std::shared_ptr<const ChunkSource> source = ChunkSource::open(path);
+    if (!source) {
+        return 1;
+    }
+    const WavHeader &header = source->header();
+    if (!codecSupports(header)) {
+        std::cerr << "Only integer PCM is coded, this file would travel raw." << std::endl;
+        return 1;
+    }
+    chunk_bytes = std::max<size_t>(header.block_align, chunk_bytes / header.block_align * header.block_align);
+    size_t data_size = source->dataSize();
+    size_t count = (data_size + chunk_bytes - 1) / chunk_bytes;
+    const uint8_t *pcm = source->samples();
+
+    CodecEncoder encoder;
+    CodecDecoder decoder;
+    std::vector<uint8_t> coded(count * (chunk_bytes + 1));
+    std::vector<size_t> sizes(count);
+    std::vector<uint8_t> decoded(chunk_bytes);
+
+    typedef std::chrono::steady_clock Clock;
+    size_t coded_total = 0;
+    long passes = 0;
+    auto start = Clock::now();
+    double elapsed;
+    do {
+        coded_total = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t len = std::min(chunk_bytes, data_size - i * chunk_bytes);
+            sizes[i] = encoder.encode(pcm + i * chunk_bytes, len, header, &coded[i * (chunk_bytes + 1)], chunk_bytes + 1);
+            coded_total += sizes[i];
+        }
+        passes++;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < BENCH_SECONDS);
+    double encode_rate = (double)data_size * passes / elapsed;
+
+    long decode_passes = 0;
+    start = Clock::now();
+    do {
+        for (size_t i = 0; i < count; i++) {
+            size_t len = std::min(chunk_bytes, data_size - i * chunk_bytes);
+            if (!decoder.decode(&coded[i * (chunk_bytes + 1)], sizes[i], header, decoded.data(), len) ||
+                (decode_passes == 0 && memcmp(decoded.data(), pcm + i * chunk_bytes, len) != 0)) {
+                std::cerr << "Block " << i << " does not round trip!" << std::endl;
+                return 1;
+            }
+        }
+        decode_passes++;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < BENCH_SECONDS);
+    double decode_rate = (double)data_size * decode_passes / elapsed;
+
+    std::cout << path << ": " << header.num_channels << " channels, " << header.bits_per_sample << " bit, "
+              << count << " blocks of " << chunk_bytes << " bytes" << std::endl;
+    std::cout << "  coded size: " << 100.0 * coded_total / data_size << "% of raw" << std::endl;
+    std::cout << "  encode: " << encode_rate / 1e6 << " MB/s, " << encode_rate / header.byte_rate
+              << " real time streams per core" << std::endl;
+    std::cout << "  decode: " << decode_rate / 1e6 << " MB/s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+// Sender side rate control for the UDP file transfer.
+// The receiver's selective ACKs (see SackScoreboard in sack.h) tell the
+// sender which packets arrived and which are lost. From that the sender
+// keeps an RTT estimate and an AIMD window over the packets in flight, and
+// paces the window out over one smoothed RTT. The controller never sleeps:
+// callers ask whether the next slot is due and arm a timer for next_send
+// otherwise.
+
+#define CC_INITIAL_WINDOW 10
+#define CC_MIN_WINDOW 2
+#define CC_MAX_WINDOW 8192
+#define CC_MIN_RTO_US 5000
+#define CC_MAX_RTO_US 1000000
+#define CC_INITIAL_RTO_US 200000
+
+typedef std::chrono::steady_clock::time_point cc_time;
+
+inline cc_time ccNow() {
+    return std::chrono::steady_clock::now();
+}
+
+struct CongestionController {
+    double cwnd = CC_INITIAL_WINDOW;   // packets
+    double ssthresh = CC_MAX_WINDOW;
+    double srtt_us = 0;
+    double rttvar_us = 0;
+    double rto_us = CC_INITIAL_RTO_US;
+    bool have_rtt = false;
+
+    int recovery_id = -1;     // losses below this id belong to an event we already reacted to
+    cc_time next_send = ccNow();
+    cc_time last_ack = ccNow();
+
+    long loss_events = 0;
+    long timeouts = 0;
+
+    // RFC 6298 smoothing
+    void onRttSample(double sample_us) {
+        if (!have_rtt) {
+            srtt_us = sample_us;
+            rttvar_us = sample_us / 2;
+            have_rtt = true;
+        } else {
+            rttvar_us = 0.75 * rttvar_us + 0.25 * std::fabs(srtt_us - sample_us);
+            srtt_us = 0.875 * srtt_us + 0.125 * sample_us;
+        }
+        rto_us = std::clamp(srtt_us + 4 * rttvar_us, (double)CC_MIN_RTO_US, (double)CC_MAX_RTO_US);
+    }
+
+    void onAck(int newly_acked) {
+        // only progress restarts the RTO: a receiver repeating the same
+        // holes while the whole tail of the window is gone must not hold it off
+        if (newly_acked <= 0) {
+            return;
+        }
+        last_ack = ccNow();
+        if (cwnd < ssthresh) {
+            cwnd += newly_acked;
+        } else {
+            cwnd += (double)newly_acked / cwnd;
+        }
+        cwnd = std::min(cwnd, (double)CC_MAX_WINDOW);
+    }
+
+    // multiplicative decrease, once per window of data: lost_id is the
+    // highest id declared lost, next_id the next fresh id to be sent
+    void onLoss(int lost_id, int next_id) {
+        if (lost_id < recovery_id) {
+            return;
+        }
+        loss_events++;
+        ssthresh = std::max(cwnd / 2, (double)CC_MIN_WINDOW);
+        cwnd = ssthresh;
+        recovery_id = next_id;
+    }
+
+    // no feedback for a full RTO: the caller declares everything in flight
+    // lost and we restart from a small window
+    void onTimeout(int next_id) {
+        timeouts++;
+        ssthresh = std::max(cwnd / 2, (double)CC_MIN_WINDOW);
+        cwnd = CC_MIN_WINDOW;
+        recovery_id = next_id;
+        rto_us = std::min(rto_us * 2, (double)CC_MAX_RTO_US);
+        last_ack = ccNow();
+    }
+
+    bool canSend(int inflight) const {
+        return inflight < (int)cwnd;
+    }
+
+    bool timedOut(cc_time now) const {
+        return now > rtoDeadline();
+    }
+
+    // spread the window over one RTT; slightly faster than cwnd/srtt so the
+    // window (not the pacer) stays the limiting factor
+    std::chrono::nanoseconds interval() const {
+        if (!have_rtt) {
+            return std::chrono::nanoseconds(0);
+        }
+        double gain = cwnd < ssthresh ? 2.0 : 1.2;
+        return std::chrono::nanoseconds((long)(srtt_us * 1000 / (cwnd * gain)));
+    }
+
+    // the pacer lets a packet go once its slot is reached; slots closer than
+    // this are released together rather than arming a timer for each
+    bool due(cc_time now) const {
+        return next_send <= now + std::chrono::microseconds(20);
+    }
+
+    // book the slot for the packet just released
+    void onPaced(cc_time now) {
+        next_send = std::max(next_send, now - std::chrono::milliseconds(1)) + interval();
+    }
+
+    cc_time rtoDeadline() const {
+        return last_ack + std::chrono::microseconds((long)rto_us);
+    }
+};
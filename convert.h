@@ -0,0 +1,324 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <endian.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "dgram.h"
+
+// Sample format conversion. Every WAV layout we take is read into one
+// canonical form, interleaved int32 at full scale (a 16 bit sample s becomes
+// s << 16, float 1.0 becomes 2^31 clamped), and written back out of it, so
+// code that works on samples only has to know that one. Kernels have AVX2 and
+// SSSE3 paths picked at runtime and a scalar fallback; all assume a
+// little-endian host, like the wire format does.
+
+#define SAMPLE_UNSUPPORTED 0
+#define SAMPLE_U8 1
+#define SAMPLE_S16 2
+#define SAMPLE_S24 3
+#define SAMPLE_S32 4
+#define SAMPLE_F32 5
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+
+// the sample format a header describes, SAMPLE_UNSUPPORTED if we cannot read it
+inline int sampleFormat(const WavHeader &header) {
+    if (header.num_channels < 1 || header.block_align != header.num_channels * (header.bits_per_sample / 8)) {
+        return SAMPLE_UNSUPPORTED;
+    }
+    if (header.audio_format == WAVE_FORMAT_PCM) {
+        switch (header.bits_per_sample) {
+        case 8:
+            return SAMPLE_U8;
+        case 16:
+            return SAMPLE_S16;
+        case 24:
+            return SAMPLE_S24;
+        case 32:
+            return SAMPLE_S32;
+        }
+    } else if (header.audio_format == WAVE_FORMAT_IEEE_FLOAT && header.bits_per_sample == 32) {
+        return SAMPLE_F32;
+    }
+    return SAMPLE_UNSUPPORTED;
+}
+
+inline int sampleWidth(int format) {
+    static const int widths[] = {0, 1, 2, 3, 4, 4};
+    return widths[format];
+}
+
+inline const char *sampleFormatName(int format) {
+    static const char *names[] = {"unsupported", "u8", "s16le", "s24le", "s32le", "f32le"};
+    return names[format];
+}
+
+inline void toCanonicalScalar(const uint8_t *src, int format, size_t count, int32_t *dst) {
+    for (size_t i = 0; i < count; i++) {
+        switch (format) {
+        case SAMPLE_U8:
+            dst[i] = (int32_t)((uint32_t)(src[i] - 128) << 24);
+            break;
+        case SAMPLE_S16: {
+            int16_t v;
+            memcpy(&v, src + 2 * i, 2);
+            dst[i] = (int32_t)((uint32_t)v << 16);
+            break;
+        }
+        case SAMPLE_S24: {
+            const uint8_t *p = src + 3 * i;
+            dst[i] = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+            break;
+        }
+        case SAMPLE_S32:
+            memcpy(dst + i, src + 4 * i, 4);
+            break;
+        case SAMPLE_F32: {
+            float v;
+            memcpy(&v, src + 4 * i, 4);
+            // the largest float below 2^31; NaN ends up at the bottom like on x86
+            double scaled = std::min((double)v * 2147483648.0, 2147483520.0);
+            dst[i] = scaled >= -2147483648.0 ? (int32_t)std::nearbyint(scaled) : INT32_MIN;
+            break;
+        }
+        }
+    }
+}
+
+inline void fromCanonicalScalar(const int32_t *src, int format, size_t count, uint8_t *dst) {
+    for (size_t i = 0; i < count; i++) {
+        int32_t v = src[i];
+        switch (format) {
+        case SAMPLE_U8:
+            dst[i] = (uint8_t)((v >> 24) + 128);
+            break;
+        case SAMPLE_S16: {
+            int16_t s = (int16_t)(v >> 16);
+            memcpy(dst + 2 * i, &s, 2);
+            break;
+        }
+        case SAMPLE_S24: {
+            uint8_t *p = dst + 3 * i;
+            p[0] = (v >> 8) & 0xff;
+            p[1] = (v >> 16) & 0xff;
+            p[2] = (v >> 24) & 0xff;
+            break;
+        }
+        case SAMPLE_S32:
+            memcpy(dst + 4 * i, &v, 4);
+            break;
+        case SAMPLE_F32: {
+            float f = (float)v * (1.0f / 2147483648.0f);
+            memcpy(dst + 4 * i, &f, 4);
+            break;
+        }
+        }
+    }
+}
+
+inline void deinterleaveScalar(const int32_t *src, size_t frames, int channels, int32_t *const *planes) {
+    for (size_t i = 0; i < frames; i++) {
+        for (int c = 0; c < channels; c++) {
+            planes[c][i] = src[i * channels + c];
+        }
+    }
+}
+
+inline void interleaveScalar(const int32_t *const *planes, size_t frames, int channels, int32_t *dst) {
+    for (size_t i = 0; i < frames; i++) {
+        for (int c = 0; c < channels; c++) {
+            dst[i * channels + c] = planes[c][i];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 24 bit: four packed samples per 12 bytes, shuffled into the top three bytes
+// of each int32 lane and back
+__attribute__((target("ssse3")))
+inline size_t s24ToCanonicalSsse3(const uint8_t *src, size_t count, int32_t *dst) {
+    const __m128i spread = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    size_t i = 0;
+    // each load reads 16 bytes for 12, stay clear of the end
+    for (; i + 6 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, spread));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+inline size_t s24FromCanonicalSsse3(const int32_t *src, size_t count, uint8_t *dst) {
+    const __m128i pack = _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 6 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + 3 * i), _mm_shuffle_epi8(v, pack));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t toCanonicalAvx2(const uint8_t *src, int format, size_t count, int32_t *dst) {
+    size_t i = 0;
+    if (format == SAMPLE_S16) {
+        for (; i + 8 <= count; i += 8) {
+            __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + 2 * i)));
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_slli_epi32(v, 16));
+        }
+    } else if (format == SAMPLE_S24) {
+        const __m256i spread = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                                -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+        for (; i + 10 <= count; i += 8) {
+            const uint8_t *p = src + 3 * i;
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                                _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, spread));
+        }
+    } else if (format == SAMPLE_U8) {
+        const __m256i bias = _mm256_set1_epi32(128);
+        for (; i + 8 <= count; i += 8) {
+            __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_slli_epi32(_mm256_sub_epi32(v, bias), 24));
+        }
+    } else if (format == SAMPLE_F32) {
+        const __m256 scale = _mm256_set1_ps(2147483648.0f);
+        const __m256 top = _mm256_set1_ps(2147483520.0f);
+        for (; i + 8 <= count; i += 8) {
+            __m256 v = _mm256_mul_ps(_mm256_loadu_ps((const float *)(src + 4 * i)), scale);
+            // min_ps returns its second operand when either is NaN, so NaN
+            // passes through and, like anything below -2^31, converts to INT32_MIN
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_cvtps_epi32(_mm256_min_ps(top, v)));
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t fromCanonicalAvx2(const int32_t *src, int format, size_t count, uint8_t *dst) {
+    size_t i = 0;
+    if (format == SAMPLE_S16) {
+        for (; i + 16 <= count; i += 16) {
+            __m256i a = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(src + i)), 16);
+            __m256i b = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(src + i + 8)), 16);
+            // packs works per 128 bit lane, put the quarters back in order
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+            _mm256_storeu_si256((__m256i *)(dst + 2 * i), packed);
+        }
+    } else if (format == SAMPLE_F32) {
+        const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+        for (; i + 8 <= count; i += 8) {
+            __m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(src + i)));
+            _mm256_storeu_ps((float *)(dst + 4 * i), _mm256_mul_ps(v, scale));
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t deinterleaveStereoAvx2(const int32_t *src, size_t frames, int32_t *left, int32_t *right) {
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(src + 2 * i)), split);
+        __m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(src + 2 * i + 8)), split);
+        _mm256_storeu_si256((__m256i *)(left + i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(right + i), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t interleaveStereoAvx2(const int32_t *left, const int32_t *right, size_t frames, int32_t *dst) {
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256i l = _mm256_loadu_si256((const __m256i *)(left + i));
+        __m256i r = _mm256_loadu_si256((const __m256i *)(right + i));
+        __m256i lo = _mm256_unpacklo_epi32(l, r);
+        __m256i hi = _mm256_unpackhi_epi32(l, r);
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    return i;
+}
+#endif
+
+// picked once per process from what the CPU supports
+inline int convertLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const int level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+    return level;
+#else
+    return 0;
+#endif
+}
+
+// count samples (not frames) of format at src into canonical int32
+inline void toCanonical(const uint8_t *src, int format, size_t count, int32_t *dst) {
+    if (format == SAMPLE_S32) {
+        memcpy(dst, src, count * 4);
+        return;
+    }
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (convertLevel() == 2) {
+        done = toCanonicalAvx2(src, format, count, dst);
+    } else if (convertLevel() == 1 && format == SAMPLE_S24) {
+        done = s24ToCanonicalSsse3(src, count, dst);
+    }
+#endif
+    toCanonicalScalar(src + done * sampleWidth(format), format, count - done, dst + done);
+}
+
+inline void fromCanonical(const int32_t *src, int format, size_t count, uint8_t *dst) {
+    if (format == SAMPLE_S32) {
+        memcpy(dst, src, count * 4);
+        return;
+    }
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (convertLevel() == 2) {
+        done = fromCanonicalAvx2(src, format, count, dst);
+    }
+    if (convertLevel() >= 1 && format == SAMPLE_S24) {
+        done = s24FromCanonicalSsse3(src, count, dst);
+    }
+#endif
+    fromCanonicalScalar(src + done, format, count - done, dst + done * sampleWidth(format));
+}
+
+inline void deinterleave(const int32_t *src, size_t frames, int channels, int32_t *const *planes) {
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (channels == 2 && convertLevel() == 2) {
+        done = deinterleaveStereoAvx2(src, frames, planes[0], planes[1]);
+    }
+#endif
+    if (done == 0) {
+        deinterleaveScalar(src, frames, channels, planes);
+        return;
+    }
+    int32_t *rest[2] = {planes[0] + done, planes[1] + done};
+    deinterleaveScalar(src + done * 2, frames - done, 2, rest);
+}
+
+inline void interleave(const int32_t *const *planes, size_t frames, int channels, int32_t *dst) {
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (channels == 2 && convertLevel() == 2) {
+        done = interleaveStereoAvx2(planes[0], planes[1], frames, dst);
+    }
+#endif
+    if (done == 0) {
+        interleaveScalar(planes, frames, channels, dst);
+        return;
+    }
+    const int32_t *rest[2] = {planes[0] + done, planes[1] + done};
+    interleaveScalar(rest, frames - done, 2, dst + done * 2);
+}
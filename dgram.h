@@ -1,4 +1,10 @@
+#pragma once
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <endian.h>
 
 struct WavHeader {
     char riff[4];        // "RIFF"
@@ -16,9 +22,234 @@ struct WavHeader {
     int data_size;       // Data size
 };
 
-struct datagram {
-    int id;
-    char message[256];
-    int32_t data[256];
+// Wire format shared by udp.cpp and udpclient.cpp.
+// Every packet starts with a fixed 18 byte header, all fields little-endian:
+//
+//   0  version      u8   WIRE_VERSION
+//   1  type         u8   PKT_*
+//   2  flags        u16  PKT_FLAG_*
+//   4  stream_id    u32  chosen by the client in its PKT_REQUEST
+//   8  seq          u64  chunk index for data, meaning depends on type otherwise
+//  16  payload_len  u16  bytes following the header
+//
+// Receivers drop packets with a different version and ignore types and flags
+// they do not know, so either side can grow new packet types on its own.
+
+#define WIRE_VERSION 1
+#define PACKET_HEADER_SIZE 18
+#define CHUNK_BYTES 1024
+#define MAX_PAYLOAD_SIZE 1400
+#define MAX_PACKET_SIZE (PACKET_HEADER_SIZE + MAX_PAYLOAD_SIZE)
+
+#define PKT_REQUEST 1     // client -> server: start stream_id
+#define PKT_STREAM_INFO 2 // server -> client: WavHeader and chunk geometry, sent once
+#define PKT_DATA 3        // server -> client: chunk seq
+#define PKT_ACK 4         // client -> server: selective ACK
+#define PKT_END 5         // server -> client: seq is the chunk count
+#define PKT_FEC 6         // server -> client: parity, seq = group * fec_m + index (fec.h)
+
+#define PKT_FLAG_HAVE_INFO 0x0001 // on ACKs: the stream info has arrived
+#define PKT_FLAG_CODEC 0x0002     // on requests: the client decodes CODEC_LPC (codec.h)
+
+struct PacketHeader {
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t stream_id;
+    uint64_t seq;
+    uint16_t payload_len;
+};
+
+// header only, for payloads sent from where they already are
+inline size_t encodeHeader(uint8_t *buf, uint8_t type, uint16_t flags, uint32_t stream_id, uint64_t seq, uint16_t payload_len) {
+    uint16_t le16;
+    uint32_t le32;
+    uint64_t le64;
+    buf[0] = WIRE_VERSION;
+    buf[1] = type;
+    le16 = htole16(flags);
+    memcpy(buf + 2, &le16, 2);
+    le32 = htole32(stream_id);
+    memcpy(buf + 4, &le32, 4);
+    le64 = htole64(seq);
+    memcpy(buf + 8, &le64, 8);
+    le16 = htole16(payload_len);
+    memcpy(buf + 16, &le16, 2);
+    return PACKET_HEADER_SIZE;
+}
+
+// write header + payload into buf (at least MAX_PACKET_SIZE bytes), returns the packet length
+inline size_t encodePacket(uint8_t *buf, uint8_t type, uint16_t flags, uint32_t stream_id, uint64_t seq, const void *payload, uint16_t payload_len) {
+    encodeHeader(buf, type, flags, stream_id, seq, payload_len);
+    if (payload_len > 0) {
+        memcpy(buf + PACKET_HEADER_SIZE, payload, payload_len);
+    }
+    return PACKET_HEADER_SIZE + payload_len;
+}
+
+// parse and validate a received packet, payload points into buf
+inline bool decodePacket(const uint8_t *buf, size_t len, PacketHeader &hdr, const uint8_t *&payload) {
+    uint16_t le16;
+    uint32_t le32;
+    uint64_t le64;
+    if (len < PACKET_HEADER_SIZE || buf[0] != WIRE_VERSION) {
+        return false;
+    }
+    hdr.version = buf[0];
+    hdr.type = buf[1];
+    memcpy(&le16, buf + 2, 2);
+    hdr.flags = le16toh(le16);
+    memcpy(&le32, buf + 4, 4);
+    hdr.stream_id = le32toh(le32);
+    memcpy(&le64, buf + 8, 8);
+    hdr.seq = le64toh(le64);
+    memcpy(&le16, buf + 16, 2);
+    hdr.payload_len = le16toh(le16);
+    if (hdr.payload_len > len - PACKET_HEADER_SIZE) {
+        return false;
+    }
+    payload = buf + PACKET_HEADER_SIZE;
+    return true;
+}
+
+// PKT_STREAM_INFO payload: the WAV header as it sits in the file (RIFF is
+// little-endian already) followed by the chunk geometry, the FEC group
+// shape (fec_m == 0: no parity is sent) and the codec of the data payloads;
+// chunk_bytes always counts PCM bytes
+struct StreamInfo {
     WavHeader header;
-};
\ No newline at end of file
+    uint32_t chunk_bytes;
+    uint64_t chunk_count;
+    uint8_t fec_k = 0;
+    uint8_t fec_m = 0;
+    uint8_t codec = 0;
+};
+
+#define STREAM_INFO_SIZE (sizeof(WavHeader) + 4 + 8 + 3)
+
+inline uint16_t encodeStreamInfo(uint8_t *buf, const StreamInfo &info) {
+    uint32_t le32 = htole32(info.chunk_bytes);
+    uint64_t le64 = htole64(info.chunk_count);
+    memcpy(buf, &info.header, sizeof(WavHeader));
+    memcpy(buf + sizeof(WavHeader), &le32, 4);
+    memcpy(buf + sizeof(WavHeader) + 4, &le64, 8);
+    buf[sizeof(WavHeader) + 12] = info.fec_k;
+    buf[sizeof(WavHeader) + 13] = info.fec_m;
+    buf[sizeof(WavHeader) + 14] = info.codec;
+    return STREAM_INFO_SIZE;
+}
+
+inline bool decodeStreamInfo(const uint8_t *buf, size_t len, StreamInfo &info) {
+    uint32_t le32;
+    uint64_t le64;
+    if (len < STREAM_INFO_SIZE) {
+        return false;
+    }
+    memcpy(&info.header, buf, sizeof(WavHeader));
+    memcpy(&le32, buf + sizeof(WavHeader), 4);
+    memcpy(&le64, buf + sizeof(WavHeader) + 4, 8);
+    info.chunk_bytes = le32toh(le32);
+    info.chunk_count = le64toh(le64);
+    info.fec_k = buf[sizeof(WavHeader) + 12];
+    info.fec_m = buf[sizeof(WavHeader) + 13];
+    info.codec = buf[sizeof(WavHeader) + 14];
+    return true;
+}
+
+// which chunk ids the receiver holds, one bit each
+struct ChunkBitmap {
+    std::vector<uint64_t> words;
+    int64_t bits = 0;
+    int64_t count = 0;
+
+    void resize(int64_t n) {
+        bits = n;
+        words.assign((n + 63) / 64, 0);
+        count = 0;
+    }
+
+    bool test(int64_t id) const {
+        return id >= 0 && id < bits && (words[id / 64] >> (id % 64) & 1);
+    }
+
+    // returns false for ids out of range or already set
+    bool set(int64_t id) {
+        if (id < 0 || id >= bits || test(id)) {
+            return false;
+        }
+        words[id / 64] |= 1ULL << (id % 64);
+        count++;
+        return true;
+    }
+
+    bool full() const {
+        return bits > 0 && count == bits;
+    }
+
+    // the 64 bits for ids start .. start + 63, zero past the end
+    uint64_t window(int64_t start) const {
+        if (start >= bits) {
+            return 0;
+        }
+        size_t w = start / 64;
+        int shift = start % 64;
+        uint64_t out = words[w] >> shift;
+        if (shift != 0 && w + 1 < words.size()) {
+            out |= words[w + 1] << (64 - shift);
+        }
+        return out;
+    }
+};
+
+// selective ACK sent by the receiver every few datagrams and whenever the
+// line goes quiet
+#define ACK_EVERY 2
+#define SACK_BITS 1024
+
+struct ackgram {
+    int64_t cumulative;  // every id below this has arrived
+    int64_t highest;     // highest datagram id seen so far
+    int64_t received;    // number of distinct datagrams seen so far
+    uint64_t bitmap[SACK_BITS / 64]; // bit i set => id cumulative + 1 + i has arrived
+};
+
+// PKT_ACK payload: cumulative, highest and received as u64 followed by only
+// the bitmap words that cover ids up to highest
+#define ACK_FIXED_SIZE 24
+
+inline uint16_t encodeAck(uint8_t *buf, const ackgram &ack) {
+    int64_t span = ack.highest - ack.cumulative;
+    size_t words = span <= 0 ? 0 : std::min<size_t>((span + 63) / 64, SACK_BITS / 64);
+    uint64_t le64;
+    le64 = htole64(ack.cumulative);
+    memcpy(buf, &le64, 8);
+    le64 = htole64(ack.highest);
+    memcpy(buf + 8, &le64, 8);
+    le64 = htole64(ack.received);
+    memcpy(buf + 16, &le64, 8);
+    for (size_t i = 0; i < words; i++) {
+        le64 = htole64(ack.bitmap[i]);
+        memcpy(buf + ACK_FIXED_SIZE + i * 8, &le64, 8);
+    }
+    return ACK_FIXED_SIZE + words * 8;
+}
+
+inline bool decodeAck(const uint8_t *buf, size_t len, ackgram &ack) {
+    uint64_t le64;
+    if (len < ACK_FIXED_SIZE) {
+        return false;
+    }
+    memset(&ack, 0, sizeof(ack));
+    memcpy(&le64, buf, 8);
+    ack.cumulative = le64toh(le64);
+    memcpy(&le64, buf + 8, 8);
+    ack.highest = le64toh(le64);
+    memcpy(&le64, buf + 16, 8);
+    ack.received = le64toh(le64);
+    size_t words = std::min<size_t>((len - ACK_FIXED_SIZE) / 8, SACK_BITS / 64);
+    for (size_t i = 0; i < words; i++) {
+        memcpy(&le64, buf + ACK_FIXED_SIZE + i * 8, 8);
+        ack.bitmap[i] = le64toh(le64);
+    }
+    return true;
+}
@@ -0,0 +1,386 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "dgram.h"
+#include "chunk_writer.h"
+
+// Forward error correction for the UDP stream. Data chunks are taken in
+// groups of K and every group is followed by M parity packets (PKT_FEC), so
+// the receiver can rebuild up to M lost chunks of a group on its own and only
+// falls back to a retransmission when more went missing. Each chunk is
+// protected as the symbol [len u16 | payload zero padded to chunk_bytes].
+// M == 1 is plain XOR parity; for M > 1 parity j of chunk i is weighted by the
+// Cauchy coefficient 1 / (j + (M + i)) in GF(2^8), which keeps every square
+// submatrix invertible, i.e. any M losses per group are recoverable.
+
+#define FEC_MAX_M 16
+#define FEC_MAX_SHARDS 255         // K + M, Cauchy points must stay distinct
+#define FEC_MAX_PENDING_GROUPS 1024
+
+// GF(2^8) over x^8 + x^4 + x^3 + x^2 + 1 (0x11d)
+struct GaloisField {
+    uint8_t exp[512];
+    uint8_t log[256];
+    // c * n and c * (n << 4) for every nibble n, the shuffle tables of the SIMD paths
+    alignas(16) uint8_t nibble_lo[256][16];
+    alignas(16) uint8_t nibble_hi[256][16];
+
+    GaloisField() {
+        int x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11d;
+            }
+        }
+        for (int i = 255; i < 512; i++) {
+            exp[i] = exp[i - 255];
+        }
+        log[0] = 0;
+        for (int c = 0; c < 256; c++) {
+            for (int n = 0; n < 16; n++) {
+                nibble_lo[c][n] = mul(c, n);
+                nibble_hi[c][n] = mul(c, n << 4);
+            }
+        }
+    }
+
+    uint8_t mul(uint8_t a, uint8_t b) const {
+        if (a == 0 || b == 0) {
+            return 0;
+        }
+        return exp[log[a] + log[b]];
+    }
+
+    uint8_t inv(uint8_t a) const {
+        return exp[255 - log[a]];
+    }
+};
+
+inline const GaloisField &gf() {
+    static const GaloisField field;
+    return field;
+}
+
+inline uint8_t fecCoefficient(int chunk_index, int parity_index, int m) {
+    if (m == 1) {
+        return 1;
+    }
+    return gf().inv(parity_index ^ (m + chunk_index));
+}
+
+inline size_t fecSymbolSize(size_t chunk_bytes) {
+    return 2 + chunk_bytes;
+}
+
+// dst ^= c * src over len bytes. Products go through two 16 entry tables, one
+// per nibble, which the SIMD paths look up with a byte shuffle.
+inline void gfMulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c == 1) {
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t a, b;
+            memcpy(&a, dst + i, 8);
+            memcpy(&b, src + i, 8);
+            a ^= b;
+            memcpy(dst + i, &a, 8);
+        }
+        for (; i < len; i++) {
+            dst[i] ^= src[i];
+        }
+        return;
+    }
+    const uint8_t *lo = gf().nibble_lo[c];
+    const uint8_t *hi = gf().nibble_hi[c];
+    for (size_t i = 0; i < len; i++) {
+        dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("ssse3")))
+inline void gfMulAddSsse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    __m128i tlo = _mm_load_si128((const __m128i *)gf().nibble_lo[c]);
+    __m128i thi = _mm_load_si128((const __m128i *)gf().nibble_hi[c]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(s, mask)),
+                                  _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+    }
+    if (i < len) {
+        gfMulAddScalar(dst + i, src + i, c, len - i);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void gfMulAddAvx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)gf().nibble_lo[c]));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)gf().nibble_hi[c]));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    if (c == 1) {
+        for (; i + 32 <= len; i += 32) {
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, s));
+        }
+    } else {
+        for (; i + 32 <= len; i += 32) {
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask)),
+                                         _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+            __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, p));
+        }
+    }
+    if (i < len) {
+        gfMulAddScalar(dst + i, src + i, c, len - i);
+    }
+}
+#endif
+
+// picked once per process from what the CPU supports
+inline void gfMulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c == 0) {
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    static const int level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+    if (level == 2) {
+        gfMulAddAvx2(dst, src, c, len);
+        return;
+    }
+    if (level == 1) {
+        gfMulAddSsse3(dst, src, c, len);
+        return;
+    }
+#endif
+    gfMulAddScalar(dst, src, c, len);
+}
+
+// parity j of a group: the weighted sum of its chunks' symbols, written to
+// parity (fecSymbolSize bytes); count may be short for the last group, the
+// missing chunks count as all zero
+inline void fecEncodeParity(uint8_t *parity, size_t symbol_size, const uint8_t *const *payloads, const size_t *lens,
+                            int count, int j, int m) {
+    memset(parity, 0, symbol_size);
+    for (int i = 0; i < count; i++) {
+        uint8_t c = fecCoefficient(i, j, m);
+        uint16_t le16 = htole16(lens[i]);
+        gfMulAdd(parity, (const uint8_t *)&le16, c, 2);
+        gfMulAdd(parity + 2, payloads[i], c, lens[i]);
+    }
+}
+
+// Receiver side: keeps the parity of groups that still have holes and
+// rebuilds the missing chunks once enough of it has arrived. Chunks that did
+// arrive are read back from the output file, so nothing but parity is held.
+class FecDecoder {
+public:
+    int k = 0;
+    int m = 0;
+    long recovered = 0;
+
+    bool configure(const StreamInfo &info) {
+        if (info.fec_m == 0) {
+            return true;
+        }
+        if (info.fec_k == 0 || info.fec_m > FEC_MAX_M || info.fec_k + info.fec_m > FEC_MAX_SHARDS ||
+            fecSymbolSize(info.chunk_bytes) > MAX_PAYLOAD_SIZE) {
+            std::cerr << "Unsupported FEC parameters " << (int)info.fec_k << "," << (int)info.fec_m << std::endl;
+            return false;
+        }
+        k = info.fec_k;
+        m = info.fec_m;
+        chunk_count = info.chunk_count;
+        symbol_size = fecSymbolSize(info.chunk_bytes);
+        return true;
+    }
+
+    bool enabled() const {
+        return m > 0;
+    }
+
+    // keep a PKT_FEC payload, returns its group or -1 if it is of no use
+    int64_t addParity(uint64_t seq, const uint8_t *payload, size_t len, const ChunkWriter &output) {
+        int64_t group = seq / m;
+        int index = seq % m;
+        if (!enabled() || len != symbol_size || group * k >= chunk_count || groupComplete(group, output)) {
+            return -1;
+        }
+        Group &g = pending[group];
+        if (g.parity.empty()) {
+            g.parity.resize(m);
+        }
+        if (g.parity[index].empty()) {
+            g.parity[index].assign(payload, payload + len);
+            g.have++;
+        }
+        while (pending.size() > FEC_MAX_PENDING_GROUPS) {
+            pending.erase(pending.begin());  // the oldest will be retransmitted instead
+        }
+        return group;
+    }
+
+    int64_t groupOf(int64_t id) const {
+        return id / k;
+    }
+
+    int64_t lastOf(int64_t group) const {
+        return std::min<int64_t>((group + 1) * k, chunk_count) - 1;
+    }
+
+    // rebuild what group is missing if the parity allows it; returns the
+    // number of chunks written to output
+    int recover(int64_t group, ChunkWriter &output) {
+        auto it = pending.find(group);
+        if (it == pending.end()) {
+            return 0;
+        }
+        Group &g = it->second;
+        int64_t first = group * k;
+        int count = (int)std::min<int64_t>(k, chunk_count - first);
+        std::vector<int> missing;
+        for (int i = 0; i < count; i++) {
+            if (!output.received.test(first + i)) {
+                missing.push_back(i);
+            }
+        }
+        int e = missing.size();
+        if (e == 0) {
+            pending.erase(it);
+            return 0;
+        }
+        if (e > g.have) {
+            return 0;
+        }
+
+        // rhs[r] = parity row - contribution of every chunk we hold
+        std::vector<int> rows;
+        for (int j = 0; j < m && (int)rows.size() < e; j++) {
+            if (!g.parity[j].empty()) {
+                rows.push_back(j);
+            }
+        }
+        std::vector<std::vector<uint8_t>> rhs(e);
+        for (int r = 0; r < e; r++) {
+            rhs[r] = g.parity[rows[r]];
+        }
+        std::vector<uint8_t> symbol(symbol_size);
+        for (int i = 0, next_missing = 0; i < count; i++) {
+            if (next_missing < e && missing[next_missing] == i) {
+                next_missing++;
+                continue;
+            }
+            memset(symbol.data(), 0, symbol_size);
+            size_t len = output.read(first + i, symbol.data() + 2);
+            uint16_t le16 = htole16(len);
+            memcpy(symbol.data(), &le16, 2);
+            for (int r = 0; r < e; r++) {
+                gfMulAdd(rhs[r].data(), symbol.data(), fecCoefficient(i, rows[r], m), symbol_size);
+            }
+        }
+
+        // solve A x = rhs, A[r][c] = coefficient of missing chunk c in parity row r
+        std::vector<uint8_t> a(e * e), inv(e * e, 0);
+        for (int r = 0; r < e; r++) {
+            for (int c = 0; c < e; c++) {
+                a[r * e + c] = fecCoefficient(missing[c], rows[r], m);
+            }
+            inv[r * e + r] = 1;
+        }
+        if (!invert(a, inv, e)) {
+            return 0;
+        }
+        int written = 0;
+        for (int c = 0; c < e; c++) {
+            memset(symbol.data(), 0, symbol_size);
+            for (int r = 0; r < e; r++) {
+                gfMulAdd(symbol.data(), rhs[r].data(), inv[c * e + r], symbol_size);
+            }
+            uint16_t le16;
+            memcpy(&le16, symbol.data(), 2);
+            size_t len = le16toh(le16);
+            if (len != output.chunkLength(first + missing[c])) {
+                std::cerr << "FEC rebuilt chunk " << first + missing[c] << " with a bad length, dropping it" << std::endl;
+                continue;
+            }
+            if (output.write(first + missing[c], symbol.data() + 2, len)) {
+                written++;
+            }
+        }
+        recovered += written;
+        pending.erase(it);
+        return written;
+    }
+
+private:
+    struct Group {
+        std::vector<std::vector<uint8_t>> parity;
+        int have = 0;
+    };
+
+    int64_t chunk_count = 0;
+    size_t symbol_size = 0;
+    std::map<int64_t, Group> pending;
+
+    bool groupComplete(int64_t group, const ChunkWriter &output) const {
+        int64_t first = group * k;
+        int64_t last = std::min<int64_t>(first + k, chunk_count);
+        for (int64_t id = first; id < last; id++) {
+            if (!output.received.test(id)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Gauss-Jordan elimination over GF(2^8); inv starts as the identity
+    static bool invert(std::vector<uint8_t> &a, std::vector<uint8_t> &inv, int n) {
+        const GaloisField &f = gf();
+        for (int col = 0; col < n; col++) {
+            int pivot = col;
+            while (pivot < n && a[pivot * n + col] == 0) {
+                pivot++;
+            }
+            if (pivot == n) {
+                return false;
+            }
+            if (pivot != col) {
+                for (int c = 0; c < n; c++) {
+                    std::swap(a[pivot * n + c], a[col * n + c]);
+                    std::swap(inv[pivot * n + c], inv[col * n + c]);
+                }
+            }
+            uint8_t scale = f.inv(a[col * n + col]);
+            for (int c = 0; c < n; c++) {
+                a[col * n + c] = f.mul(a[col * n + c], scale);
+                inv[col * n + c] = f.mul(inv[col * n + c], scale);
+            }
+            for (int r = 0; r < n; r++) {
+                uint8_t factor = a[r * n + col];
+                if (r == col || factor == 0) {
+                    continue;
+                }
+                for (int c = 0; c < n; c++) {
+                    a[r * n + c] ^= f.mul(factor, a[col * n + c]);
+                    inv[r * n + c] ^= f.mul(factor, inv[col * n + c]);
+                }
+            }
+        }
+        return true;
+    }
+};
@@ -0,0 +1,129 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <functional>
+
+// Process-wide cache of encoded WebSocket streams for server.cpp: every
+// message a connection is sent for one file in one mode (wsframe.h), built
+// once on the first request and shared read-only by pointer from then on. The
+// cache keeps the most recently used streams up to a byte budget; evicting
+// one only drops the cache's reference, connections still sending it keep
+// theirs.
+
+#define FRAME_CACHE_MAX_BYTES (64 * 1024 * 1024)
+
+struct EncodedStream {
+    std::vector<std::string> messages;  // in order, the end of stream marker included
+    unsigned char opcode = 129;         // 129 text, 130 binary
+    size_t bytes = 0;
+};
+
+struct FrameCacheStats {
+    long hits = 0;
+    long misses = 0;
+    long evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t max_bytes = 0;
+
+    double hitRatio() const {
+        return hits + misses > 0 ? (double)hits / (hits + misses) : 0;
+    }
+};
+
+class FrameCache {
+public:
+    using Builder = std::function<std::shared_ptr<const EncodedStream>()>;
+
+    explicit FrameCache(size_t max_bytes = FRAME_CACHE_MAX_BYTES) : max_bytes(max_bytes) {}
+
+    // the stream for (path, mode), from build() if it is not cached; callers
+    // that miss while it is being built wait for that build rather than
+    // starting their own. nullptr if build() fails, which is not cached.
+    std::shared_ptr<const EncodedStream> get(const std::string &path, int mode, const Builder &build) {
+        Key key(path, mode);
+        std::promise<std::shared_ptr<const EncodedStream>> promise;
+        std::shared_future<std::shared_ptr<const EncodedStream>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = entries.find(key);
+            if (it != entries.end()) {
+                hits++;
+                lru.splice(lru.begin(), lru, it->second.position);
+                pending = it->second.stream;
+            } else {
+                misses++;
+                lru.push_front(key);
+                Entry &entry = entries[key];
+                entry.stream = promise.get_future().share();
+                entry.position = lru.begin();
+            }
+        }
+        if (pending.valid()) {
+            return pending.get();
+        }
+
+        std::shared_ptr<const EncodedStream> stream = build();
+        promise.set_value(stream);
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(key);
+        if (!stream) {
+            lru.erase(it->second.position);
+            entries.erase(it);
+            return nullptr;
+        }
+        it->second.bytes = stream->bytes;
+        it->second.built = true;
+        total_bytes += stream->bytes;
+        // least recently used first; streams still being built are passed over
+        // and the one just built stays even if it is over the budget on its own
+        for (auto victim = lru.end(); total_bytes > max_bytes && victim != lru.begin();) {
+            --victim;
+            auto entry = entries.find(*victim);
+            if (!entry->second.built || *victim == key) {
+                continue;
+            }
+            total_bytes -= entry->second.bytes;
+            entries.erase(entry);
+            victim = lru.erase(victim);
+            evictions++;
+        }
+        return stream;
+    }
+
+    FrameCacheStats stats() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        FrameCacheStats s;
+        s.hits = hits;
+        s.misses = misses;
+        s.evictions = evictions;
+        s.entries = entries.size();
+        s.bytes = total_bytes;
+        s.max_bytes = max_bytes;
+        return s;
+    }
+
+private:
+    using Key = std::pair<std::string, int>;
+
+    struct Entry {
+        std::shared_future<std::shared_ptr<const EncodedStream>> stream;
+        std::list<Key>::iterator position;
+        size_t bytes = 0;   // counted once the build is done
+        bool built = false;
+    };
+
+    mutable std::mutex mtx;
+    std::map<Key, Entry> entries;
+    std::list<Key> lru;     // most recently used at the front
+    size_t max_bytes;
+    size_t total_bytes = 0;
+    long hits = 0;
+    long misses = 0;
+    long evictions = 0;
+};
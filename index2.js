@@ -1,4 +1,6 @@
-var ws = new WebSocket("ws://localhost:8081/echo");
+// mode=coded asks for losslessly compressed binary frames (wsframe.h), mode=binary
+// for raw ones; leave the mode off for the old comma separated text
+var ws = new WebSocket("ws://localhost:8081/echo?mode=coded");
 ws.binaryType = 'arraybuffer'; // Expect binary audio data as ArrayBuffer
 
 const audioElement = document.getElementById('audio');
@@ -9,7 +11,39 @@ let audioBufferQueue = [];
 let isPlaying = false;
 let datalength = 0;
 
-ws.onmessage = async (evt) => { 
+// wsframe.h
+const WS_FRAME_VERSION = 1;
+const WS_FRAME_HEADER_SIZE = 24;
+const WS_PAYLOAD_RAW = 0;
+const WS_PAYLOAD_CODED = 1;
+const WS_PAYLOAD_END = 2;
+// convert.h
+const SAMPLE_U8 = 1, SAMPLE_S16 = 2, SAMPLE_S24 = 3, SAMPLE_S32 = 4, SAMPLE_F32 = 5;
+const SAMPLE_WIDTHS = [0, 1, 2, 3, 4, 4];
+
+ws.onmessage = async (evt) => {
+    if (evt.data instanceof ArrayBuffer) {
+      const frame = parseFrame(evt.data);
+      if (frame === null || frame.payload === WS_PAYLOAD_END) {
+        return;
+      }
+      const planes = framePlanes(frame);
+      if (planes === null) {
+        console.log("Undecodable frame", frame.seq);
+        return;
+      }
+      const audioBuffer = audioContext.createBuffer(frame.channels, planes[0].length, frame.sampleRate);
+      for (let c = 0; c < frame.channels; c++) {
+        audioBuffer.copyToChannel(planes[c], c);
+      }
+      datalength += planes[0].length * frame.channels;
+      updatesElement.innerHTML = "Total audio data received: " + datalength + " samples";
+      audioBufferQueue.push(audioBuffer);
+      if (!isPlaying) {
+        playQueuedAudio();
+      }
+      return;
+    }
     const stringData = evt.data;
     if (stringData != "-1"){
       // Decode the audio binary data into AudioBuffer
@@ -23,13 +57,13 @@ ws.onmessage = async (evt) => {
 
       datalength += intArray.length;
       document.getElementById("updates").innerHTML = "Total audio data received: " + datalength + " samples";
-  
+
       const audioBuffer = await audioContext.decodeAudioData(arrayBuffer).catch((error) => {
         console.log("Error decoding audio data:", error);
       });
       // Queue the decoded buffer for playback
       audioBufferQueue.push(audioBuffer);
-  
+
       if (!isPlaying) {
         playQueuedAudio();
       }
@@ -72,4 +106,210 @@ async function playQueuedAudio() {
   function decodeStringToIntArray(str) {
     str = str.trim().split(',').map(Number);
     return new Int32Array(str);
-  }
\ No newline at end of file
+  }
+
+// header fields of a binary frame, null if it is not one
+function parseFrame(buffer) {
+    if (buffer.byteLength < WS_FRAME_HEADER_SIZE) {
+      return null;
+    }
+    const view = new DataView(buffer);
+    if (view.getUint8(0) !== WS_FRAME_VERSION) {
+      return null;
+    }
+    return {
+      format: view.getUint8(1),
+      channels: view.getUint8(2),
+      payload: view.getUint8(3),
+      seq: view.getUint32(4, true),
+      sampleRate: view.getUint32(8, true),
+      timestamp: Number(view.getBigUint64(12, true)),
+      pcmBytes: view.getUint32(20, true),
+      body: new Uint8Array(buffer, WS_FRAME_HEADER_SIZE),
+    };
+}
+
+// the frame's audio as one Float32Array per channel, null if it is corrupt
+function framePlanes(frame) {
+    const width = SAMPLE_WIDTHS[frame.format] || 0;
+    if (width === 0 || frame.channels === 0) {
+      return null;
+    }
+    const frames = Math.floor(frame.pcmBytes / (width * frame.channels));
+    let pcm = frame.body;
+    if (frame.payload === WS_PAYLOAD_CODED) {
+      pcm = decodeBlock(frame.body, width, frame.channels, frame.pcmBytes);
+      if (pcm === null) {
+        return null;
+      }
+    }
+    if (pcm.length < frames * width * frame.channels) {
+      return null;
+    }
+    const view = new DataView(pcm.buffer, pcm.byteOffset, pcm.byteLength);
+    const planes = [];
+    for (let c = 0; c < frame.channels; c++) {
+      planes.push(new Float32Array(frames));
+    }
+    let pos = 0;
+    for (let i = 0; i < frames; i++) {
+      for (let c = 0; c < frame.channels; c++, pos += width) {
+        planes[c][i] = readSample(view, pos, frame.format);
+      }
+    }
+    return planes;
+}
+
+function readSample(view, pos, format) {
+    switch (format) {
+      case SAMPLE_U8:
+        return (view.getUint8(pos) - 128) / 128;
+      case SAMPLE_S16:
+        return view.getInt16(pos, true) / 32768;
+      case SAMPLE_S24:
+        return ((view.getInt8(pos + 2) * 65536) + view.getUint16(pos, true)) / 8388608;
+      case SAMPLE_S32:
+        return view.getInt32(pos, true) / 2147483648;
+      default:
+        return view.getFloat32(pos, true);
+    }
+}
+
+// CodecDecoder::decode (codec.h) for the browser: the pcmBytes raw bytes a
+// CODEC_LPC block stands for, or null. Samples stay plain numbers, which hold
+// the residuals of up to 32 bit audio exactly.
+function decodeBlock(block, width, channels, pcmBytes) {
+    if (block.length < 1) {
+      return null;
+    }
+    if (block[0] === 0) {
+      return block.length === pcmBytes + 1 ? block.subarray(1) : null;
+    }
+    const blockAlign = width * channels;
+    const frames = Math.floor(pcmBytes / blockAlign);
+    const tail = pcmBytes - frames * blockAlign;
+    const stereo = block[1];
+    if (block[0] !== 1 || block.length < 2 || frames === 0 || (stereo !== 0 && channels !== 2) || stereo > 3) {
+      return null;
+    }
+    const reader = new BitReader(block.subarray(2));
+    const x = [];
+    for (let c = 0; c < channels; c++) {
+      x.push(decodeChannel(reader, frames));
+      if (reader.error) {
+        return null;
+      }
+    }
+    const used = 2 + reader.bytesUsed();
+    if (used + tail !== block.length) {
+      return null;
+    }
+    if (stereo !== 0) {
+      const a = x[0], b = x[1];
+      for (let i = 0; i < frames; i++) {
+        let l, r;
+        if (stereo === 1) {
+          l = a[i];
+          r = a[i] - b[i];
+        } else if (stereo === 2) {
+          r = b[i];
+          l = a[i] + r;
+        } else {
+          const mid = a[i] * 2 + (((b[i] % 2) + 2) % 2);
+          l = Math.floor((mid + b[i]) / 2);
+          r = Math.floor((mid - b[i]) / 2);
+        }
+        a[i] = l;
+        b[i] = r;
+      }
+    }
+    const raw = new Uint8Array(pcmBytes);
+    for (let c = 0; c < channels; c++) {
+      let pos = c * width;
+      for (let i = 0; i < frames; i++, pos += blockAlign) {
+        let v = x[c][i];
+        if (width === 1) {
+          v += 128;
+        }
+        for (let b = 0; b < width; b++) {
+          raw[pos + b] = ((v % 256) + 256) % 256;
+          v = Math.floor(v / 256);
+        }
+      }
+    }
+    raw.set(block.subarray(used), frames * blockAlign);
+    return raw;
+}
+
+function decodeChannel(reader, n) {
+    const x = new Float64Array(n);
+    const order = reader.get(3);
+    const wasted = reader.get(6);
+    if (order > 4) {
+      reader.error = true;
+      return x;
+    }
+    for (let start = 0; start < n && !reader.error; start += 64) {
+      const count = Math.min(64, n - start);
+      const k = reader.get(6);
+      const scale = Math.pow(2, k);
+      for (let i = 0; i < count; i++) {
+        const u = reader.getUnary() * scale + reader.get(k);
+        // unzigzag
+        x[start + i] = u % 2 === 0 ? u / 2 : -(u + 1) / 2;
+      }
+    }
+    for (let p = order; p >= 1; p--) {
+      for (let i = p; i < n; i++) {
+        x[i] += x[i - 1];
+      }
+    }
+    if (wasted > 0) {
+      const scale = Math.pow(2, wasted);
+      for (let i = 0; i < n; i++) {
+        x[i] *= scale;
+      }
+    }
+    return x;
+}
+
+// MSB first, like BitReader in codec.h
+class BitReader {
+    constructor(bytes) {
+      this.bytes = bytes;
+      this.bit = 0;
+      this.error = false;
+    }
+
+    get(n) {
+      let value = 0;
+      for (let i = 0; i < n; i++) {
+        value = value * 2 + this.next();
+      }
+      return value;
+    }
+
+    getUnary() {
+      let q = 0;
+      while (this.next() === 0) {
+        if (this.error || ++q > 65536) {
+          this.error = true;
+          return 0;
+        }
+      }
+      return q;
+    }
+
+    next() {
+      const byte = this.bit >> 3;
+      if (byte >= this.bytes.length) {
+        this.error = true;
+        return 1;
+      }
+      return (this.bytes[byte] >> (7 - (this.bit++ & 7))) & 1;
+    }
+
+    bytesUsed() {
+      return (this.bit + 7) >> 3;
+    }
+}
@@ -0,0 +1,208 @@
+#pragma once
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Bounded send queue in front of one relay listener. The relay hands a
+// connection one message at a time and keeps the rest here, so what a slow
+// client can pin is capped by max_bytes/max_messages instead of growing in
+// SimpleWeb's unbounded per-connection queue. When a new frame does not fit,
+// the oldest queued frames are dropped: for live audio the newest frame is
+// the one worth having. A listener that keeps dropping for longer than the
+// grace period is disconnected; one that takes frames without dropping while
+// its queue is at most half full has caught up, even if it never drains.
+//
+// A queue can start gated: until open() it discards what it is given, so a
+// new listener sees nothing before the catch-up the relay sends it on open.
+//
+// The queue also estimates the listener's goodput: bytes sent over the time a
+// send was in flight, so idle time between messages does not count against
+// it. A send completes once the socket has taken the bytes, which on a slow
+// link is as fast as the link drains them.
+
+#define GOODPUT_WINDOW_MS 200       // busy time per goodput sample
+#define GOODPUT_MAX_WINDOW_MS 2000  // or this much wall time, for listeners rarely busy
+
+struct SendQueueLimits {
+    size_t max_bytes = 1 << 20;
+    size_t max_messages = 256;
+    std::chrono::milliseconds grace{5000};
+};
+
+struct ListenerQueueStats {
+    int id = 0;
+    size_t queued_messages = 0;
+    size_t queued_bytes = 0;
+    long dropped = 0;
+    bool evicted = false;
+    double goodput_bps = 0;  // 0 until measured
+};
+
+template <typename Server>
+class ListenerQueue : public std::enable_shared_from_this<ListenerQueue<Server>> {
+public:
+    using Connection = typename Server::Connection;
+    using OutMessage = typename Server::OutMessage;
+    // called on an io thread when a send completes; error is empty on success
+    using SentHook = std::function<void(const std::string &error, std::chrono::steady_clock::duration took)>;
+
+    struct PushResult {
+        int dropped = 0;       // queued frames discarded to make room for this one
+        bool evicted = false;  // this push found the listener too slow and closed it
+    };
+
+    ListenerQueue(const std::shared_ptr<Connection> &connection, const SendQueueLimits &limits, int id, SentHook on_sent, bool gated = false)
+        : connection(connection), limits(limits), id(id), on_sent(std::move(on_sent)), gate_open(!gated) {}
+
+    // let messages through a gated queue; the ones pushed before are gone
+    void open() {
+        std::lock_guard<std::mutex> lock(mtx);
+        gate_open = true;
+    }
+
+    // any thread; bytes is the payload length of message
+    PushResult push(const std::shared_ptr<OutMessage> &message, size_t bytes, unsigned char opcode) {
+        PushResult result;
+        std::shared_ptr<Connection> to_close;
+        bool start = false;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (evicted || !gate_open) {
+                return result;
+            }
+            if (in_flight) {
+                pending.push_back(Pending{message, bytes, opcode});
+                queued_bytes += bytes;
+                while (pending.size() > 1 && (pending.size() > limits.max_messages || queued_bytes > limits.max_bytes)) {
+                    queued_bytes -= pending.front().bytes;
+                    pending.pop_front();
+                    result.dropped++;
+                }
+                if (result.dropped > 0) {
+                    dropped += result.dropped;
+                    auto now = std::chrono::steady_clock::now();
+                    if (!behind) {
+                        behind = true;
+                        behind_since = now;
+                    } else if (now - behind_since > limits.grace) {
+                        evicted = true;
+                        pending.clear();
+                        queued_bytes = 0;
+                        to_close = connection.lock();
+                        result.evicted = true;
+                    }
+                } else if (behind && pending.size() <= limits.max_messages / 2 && queued_bytes <= limits.max_bytes / 2) {
+                    behind = false;
+                }
+            } else {
+                in_flight = true;
+                start = true;
+            }
+        }
+        if (to_close) {
+            // a stalled socket would never get a close frame out, so drop it
+            to_close->close();
+        }
+        if (start) {
+            sendNow(Pending{message, bytes, opcode});
+        }
+        return result;
+    }
+
+    ListenerQueueStats stats() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        ListenerQueueStats out;
+        out.id = id;
+        out.queued_messages = pending.size();
+        out.queued_bytes = queued_bytes;
+        out.dropped = dropped;
+        out.evicted = evicted;
+        out.goodput_bps = goodput_bps;
+        return out;
+    }
+
+private:
+    struct Pending {
+        std::shared_ptr<OutMessage> message;
+        size_t bytes;
+        unsigned char opcode;
+    };
+
+    void sendNow(const Pending &item) {
+        std::shared_ptr<Connection> conn = connection.lock();
+        if (!conn) {
+            return;
+        }
+        auto self = this->shared_from_this();
+        auto sent = std::chrono::steady_clock::now();
+        size_t bytes = item.bytes;
+        conn->send(item.message, [self, sent, bytes](const auto &ec) {
+            auto took = std::chrono::steady_clock::now() - sent;
+            self->on_sent(ec ? ec.message() : std::string(), took);
+            if (!ec) {
+                self->measure(bytes, took);
+            }
+            self->sendNext();
+        }, item.opcode);
+    }
+
+    // one finished send into the goodput estimate, smoothed like an RTT
+    void measure(size_t bytes, std::chrono::steady_clock::duration took) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto now = std::chrono::steady_clock::now();
+        if (window_bytes == 0 && window_busy.count() == 0) {
+            window_start = now;
+        }
+        window_bytes += bytes;
+        window_busy += took;
+        if (window_busy < std::chrono::milliseconds(GOODPUT_WINDOW_MS) && now - window_start < std::chrono::milliseconds(GOODPUT_MAX_WINDOW_MS)) {
+            return;
+        }
+        double seconds = std::chrono::duration<double>(window_busy).count();
+        if (seconds > 0) {
+            double sample = window_bytes * 8 / seconds;
+            goodput_bps = goodput_bps == 0 ? sample : 0.75 * goodput_bps + 0.25 * sample;
+        }
+        window_bytes = 0;
+        window_busy = std::chrono::steady_clock::duration::zero();
+    }
+
+    // completion of the message in flight; start the next one if there is one
+    void sendNext() {
+        Pending item{nullptr, 0, 0};
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (pending.empty() || evicted) {
+                in_flight = false;
+                behind = false;
+                return;
+            }
+            item = std::move(pending.front());
+            pending.pop_front();
+            queued_bytes -= item.bytes;
+        }
+        sendNow(item);
+    }
+
+    std::weak_ptr<Connection> connection;
+    SendQueueLimits limits;
+    int id;
+    SentHook on_sent;
+
+    mutable std::mutex mtx;
+    std::deque<Pending> pending;
+    size_t queued_bytes = 0;
+    bool in_flight = false;
+    bool behind = false;
+    std::chrono::steady_clock::time_point behind_since;
+    long dropped = 0;
+    bool evicted = false;
+    bool gate_open;
+    double goodput_bps = 0;
+    size_t window_bytes = 0;
+    std::chrono::steady_clock::duration window_busy{0};
+    std::chrono::steady_clock::time_point window_start;
+};
@@ -69,7 +69,7 @@ export async function startServer() {
 
       switch (name) {
         case "audio_stats_tool":
-          return await audioStatsHandler();
+          return await audioStatsHandler(args);
 
         default:
           return {
@@ -23,6 +23,12 @@ export const AUDIO_STATS_TOOL: Tool = {
         description: "Pagination offset (max 9, default 0)",
         default: 0,
       },
+      fields: {
+        type: "array",
+        items: { type: "string" },
+        description:
+          "Stats to return, e.g. connections, messages_sent_total, broadcast_turnaround_p99_us, send_latency_p50_us. Omit for all of them.",
+      },
     },
     required: ["query"],
   },
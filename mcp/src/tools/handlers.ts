@@ -1,9 +1,10 @@
 import { fetchAudioStats } from "../utils/audioStatsFetcher.ts";
 // Web search handler
-export async function audioStatsHandler() {
+export async function audioStatsHandler(args: Record<string, unknown> = {}) {
 
-  // http request to audio stats server would go here
-  const results = await fetchAudioStats();
+  // only ask the relay for the fields the caller needs
+  const fields = Array.isArray(args.fields) ? args.fields.map(String) : [];
+  const results = await fetchAudioStats(fields);
   console.error("results fetched from the server: ", results);
   return {
     content: [{ type: "text", text: results }],
@@ -5,15 +5,15 @@ export interface AudioStats {
   audioQuality: string;
 }
 
-export async function fetchAudioStats() {
-  // Simulate an HTTP request to fetch audio stats
-  // fetch with get request to localhost:4000
-  const url = 'http://localhost:8000';
+// the relay's JSON stats endpoint; it serves a snapshot, so asking often is cheap
+const STATS_URL = 'http://localhost:8000/stats';
+
+// fields: keys to return, e.g. ["connections", "send_latency_p99_us"]; empty means all
+export async function fetchAudioStats(fields: string[] = []) {
+  const url = fields.length > 0 ? `${STATS_URL}?fields=${fields.map(encodeURIComponent).join(',')}` : STATS_URL;
   const response = await fetch(url);
   console.error("results fetched response from the server: ", response);
   const data = await response.text();
   console.error("results fetched from the server: ", data);
   return data;
 }
-
-
@@ -0,0 +1,167 @@
+#pragma once
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Lock free metrics for the relay's hot paths. Counters and histograms are
+// split into cache line padded shards; each thread always writes the same
+// shard with a relaxed add, so recording never takes a lock and threads do
+// not bounce each other's cache lines. Reads sum the shards, which is cheap
+// next to how rarely the stats page is asked for.
+
+#define METRIC_SHARDS 16
+
+// which shard the calling thread writes; threads are spread round robin
+inline size_t metricShard() {
+    static std::atomic<size_t> next{0};
+    static thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+class ShardedCounter {
+public:
+    void add(int64_t n = 1) {
+        slots[metricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        int64_t total = 0;
+        for (const Slot &slot : slots) {
+            total += slot.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<int64_t> value{0};
+    };
+    Slot slots[METRIC_SHARDS];
+};
+
+// A single value that is overwritten rather than summed (last seen latency).
+class Gauge {
+public:
+    void set(int64_t v) {
+        value.store(v, std::memory_order_relaxed);
+    }
+
+    int64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> value{0};
+};
+
+// HDR style log linear histogram of non negative integers (microseconds in
+// the relay). Values below 2*HIST_SUB_BUCKETS are exact; above that every
+// power of two is split into HIST_SUB_BUCKETS buckets, so a reported
+// percentile is within 1/HIST_SUB_BUCKETS (about 3%) of the true value.
+// Values from 2^HIST_MAX_BITS up are counted in the last bucket.
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40  // 2^40 us is about 12 days
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+inline size_t histBucket(int64_t v) {
+    if (v < 0) {
+        v = 0;
+    }
+    uint64_t u = std::min<uint64_t>((uint64_t)v, (1ULL << HIST_MAX_BITS) - 1);
+    if (u < 2 * HIST_SUB_BUCKETS) {
+        return (size_t)u;
+    }
+    int msb = 63 - __builtin_clzll(u);
+    int shift = msb - HIST_SUB_BITS;
+    return (size_t)shift * HIST_SUB_BUCKETS + (size_t)(u >> shift);
+}
+
+// largest value that lands in bucket i
+inline int64_t histBucketValue(size_t i) {
+    if (i < 2 * HIST_SUB_BUCKETS) {
+        return (int64_t)i;
+    }
+    int shift = (int)(i / HIST_SUB_BUCKETS) - 1;
+    uint64_t mantissa = i - (size_t)shift * HIST_SUB_BUCKETS;
+    return (int64_t)(((mantissa + 1) << shift) - 1);
+}
+
+class LatencyHistogram {
+public:
+    LatencyHistogram() : shards(new Shard[METRIC_SHARDS]) {}
+
+    void record(int64_t v) {
+        Shard &shard = shards[metricShard()];
+        shard.buckets[histBucket(v)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(v, std::memory_order_relaxed);
+        last.set(v);
+    }
+
+    template <typename Rep, typename Period>
+    void record(std::chrono::duration<Rep, Period> d) {
+        record((int64_t)std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+    }
+
+    struct Summary {
+        int64_t count = 0;
+        int64_t last = 0;
+        int64_t sum = 0;
+        double mean = 0;
+        int64_t p50 = 0, p90 = 0, p99 = 0, p999 = 0;
+        int64_t max = 0;
+    };
+
+    // one pass over the shards; the percentiles come from the same counts
+    Summary summary() const {
+        std::vector<int64_t> counts(HIST_BUCKETS, 0);
+        int64_t sum = 0;
+        for (int s = 0; s < METRIC_SHARDS; s++) {
+            for (size_t i = 0; i < HIST_BUCKETS; i++) {
+                counts[i] += shards[s].buckets[i].load(std::memory_order_relaxed);
+            }
+            sum += shards[s].sum.load(std::memory_order_relaxed);
+        }
+        Summary out;
+        for (int64_t c : counts) {
+            out.count += c;
+        }
+        out.last = last.get();
+        if (out.count == 0) {
+            return out;
+        }
+        out.sum = sum;
+        out.mean = (double)sum / out.count;
+        out.p50 = percentile(counts, out.count, 0.50);
+        out.p90 = percentile(counts, out.count, 0.90);
+        out.p99 = percentile(counts, out.count, 0.99);
+        out.p999 = percentile(counts, out.count, 0.999);
+        out.max = percentile(counts, out.count, 1.0);
+        return out;
+    }
+
+private:
+    static int64_t percentile(const std::vector<int64_t> &counts, int64_t total, double q) {
+        int64_t rank = std::max<int64_t>(1, (int64_t)std::ceil(q * total));
+        int64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return histBucketValue(i);
+            }
+        }
+        return histBucketValue(counts.size() - 1);
+    }
+
+    struct alignas(64) Shard {
+        std::atomic<int64_t> buckets[HIST_BUCKETS] = {};
+        std::atomic<int64_t> sum{0};
+    };
+    std::unique_ptr<Shard[]> shards;
+    Gauge last;
+};
@@ -0,0 +1,278 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "convert.h"
+#include "wsframe.h"
+
+// Server side mixing for relay rooms opened as /mix/NAME. Speakers send PCM
+// as wsframe.h frames (WS_PAYLOAD_RAW, any convert.h format); the mixer puts
+// every speaker's samples on one clock and, once per MIX_FRAME_MS tick, sums
+// them and hands out one s16 frame per listener: the full mix for people who
+// only listen and the mix minus their own voice for each speaker. A listener
+// then receives one stream however many people talk, instead of one per
+// speaker.
+//
+// Summing is done once per tick in int32 at 16 bit scale, which cannot
+// overflow for any realistic room; each output is (sum - own) narrowed with a
+// saturating pack, so a speaker's own voice comes out exactly, even when the
+// room is loud enough to clip.
+//
+// Not thread safe: the relay only touches a room's mixer from the broadcast
+// worker the room is pinned to.
+
+#define MIX_FRAME_MS 20               // one output frame per tick
+#define MIX_DELAY_FRAMES 3            // playout delay a new speaker is placed behind
+#define MIX_BUFFER_MS 1000            // how far ahead of the clock a speaker may be
+#define MIX_SPEAKER_TIMEOUT_MS 2000   // speakers silent this long are forgotten
+#define MIX_MIN_RATE 8000             // sample rates a room accepts; the rate sizes
+#define MIX_MAX_RATE 192000           // every speaker's ring, so it comes off the wire bounded
+#define MIX_MAX_CHANNELS 8
+
+inline void mixAccumulateScalar(int32_t *acc, const int32_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        acc[i] += src[i];
+    }
+}
+
+// dst = saturate16(acc - own), own may be null
+inline void mixPackS16Scalar(const int32_t *acc, const int32_t *own, size_t n, int16_t *dst) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t v = own ? acc[i] - own[i] : acc[i];
+        dst[i] = (int16_t)std::min(32767, std::max(-32768, v));
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+inline size_t mixAccumulateAvx2(int32_t *acc, const int32_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi32(a, b));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t mixPackS16Avx2(const int32_t *acc, const int32_t *own, size_t n, int16_t *dst) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(acc + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(acc + i + 8));
+        if (own) {
+            lo = _mm256_sub_epi32(lo, _mm256_loadu_si256((const __m256i *)(own + i)));
+            hi = _mm256_sub_epi32(hi, _mm256_loadu_si256((const __m256i *)(own + i + 8)));
+        }
+        // packs works per 128 bit lane; the permute puts the halves back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + i), packed);
+    }
+    return i;
+}
+
+#endif
+
+inline void mixAccumulate(int32_t *acc, const int32_t *src, size_t n) {
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (convertLevel() == 2) {
+        done = mixAccumulateAvx2(acc, src, n);
+    }
+#endif
+    mixAccumulateScalar(acc + done, src + done, n - done);
+}
+
+inline void mixPackS16(const int32_t *acc, const int32_t *own, size_t n, int16_t *dst) {
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (convertLevel() == 2) {
+        done = mixPackS16Avx2(acc, own, n, dst);
+    }
+#endif
+    mixPackS16Scalar(acc + done, own ? own + done : nullptr, n - done, dst + done);
+}
+
+class AudioMixer {
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    struct Output {
+        std::string everyone;                                  // wsframe message with every speaker
+        std::vector<std::pair<const void *, std::string>> minus_one;  // per speaker, without them
+    };
+
+    // a message from speaker (any stable identity, the relay uses the
+    // connection); false if it is not raw PCM in the room's rate and layout.
+    // The first frame fixes the room's sample rate and channel count, until
+    // the last speaker times out and the room is free for another format.
+    bool push(const void *speaker, const uint8_t *msg, size_t len, time_point now) {
+        WsFrameHeader hdr;
+        if (!decodeWsFrameHeader(msg, len, hdr) || hdr.payload != WS_PAYLOAD_RAW) {
+            return false;
+        }
+        if (hdr.format == SAMPLE_UNSUPPORTED || hdr.format > SAMPLE_F32 || hdr.channels == 0 || hdr.channels > MIX_MAX_CHANNELS ||
+            hdr.sample_rate < MIX_MIN_RATE || hdr.sample_rate > MIX_MAX_RATE) {
+            rejected++;
+            return false;
+        }
+        if (channels == 0) {
+            start(hdr.sample_rate, hdr.channels);
+        } else if (hdr.sample_rate != sample_rate || hdr.channels != channels) {
+            rejected++;
+            return false;
+        }
+        size_t samples = (len - WS_FRAME_HEADER_SIZE) / sampleWidth(hdr.format);
+        samples -= samples % channels;
+        if (samples == 0) {
+            return true;
+        }
+        canonical.resize(samples);
+        toCanonical(msg + WS_FRAME_HEADER_SIZE, hdr.format, samples, canonical.data());
+
+        Speaker &sp = speakers[speaker];
+        if (sp.ring.empty()) {
+            sp.ring.assign(ring_frames * channels, 0);
+            sp.synced = false;
+        }
+        // speaker frame position -> mixer frame position; resync on a jump
+        // the ring cannot hold, like a client restarting its timestamps
+        int64_t target = (int64_t)hdr.timestamp + sp.offset;
+        if (!sp.synced || target < (int64_t)clock - (int64_t)ring_frames || target >= (int64_t)(clock + ring_frames)) {
+            sp.offset = (int64_t)(clock + MIX_DELAY_FRAMES * frame_len) - (int64_t)hdr.timestamp;
+            sp.synced = true;
+            target = (int64_t)hdr.timestamp + sp.offset;
+        }
+        sp.last_heard = now;
+        size_t frames = samples / channels;
+        for (size_t f = 0; f < frames; f++) {
+            int64_t at = target + (int64_t)f;
+            if (at < (int64_t)clock) {
+                late_frames++;
+                continue;
+            }
+            if (at >= (int64_t)(clock + ring_frames)) {
+                break;
+            }
+            int32_t *slot = &sp.ring[(size_t)(at % ring_frames) * channels];
+            for (int c = 0; c < channels; c++) {
+                // canonical is full scale int32; mix at 16 bit scale so sums fit
+                slot[c] = canonical[f * channels + c] >> 16;
+            }
+        }
+        return true;
+    }
+
+    // one tick: the next MIX_FRAME_MS of every speaker, consumed. false when
+    // nobody is speaking, so there is nothing to send.
+    bool mix(Output &out, time_point now) {
+        out.everyone.clear();
+        out.minus_one.clear();
+        if (channels == 0) {
+            return false;
+        }
+        for (auto it = speakers.begin(); it != speakers.end();) {
+            if (now - it->second.last_heard > std::chrono::milliseconds(MIX_SPEAKER_TIMEOUT_MS)) {
+                it = speakers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (speakers.empty()) {
+            // nobody left to hold the format to; the next speaker sets it again
+            reset();
+            return false;
+        }
+
+        size_t n = frame_len * channels;
+        acc.assign(n, 0);
+        // each speaker's slice of this tick, copied out of its ring so the
+        // kernels see contiguous samples, then cleared so a gap reads as silence
+        for (auto &entry : speakers) {
+            Speaker &sp = entry.second;
+            sp.current.resize(n);
+            size_t start = (size_t)(clock % ring_frames) * channels;
+            size_t first = std::min(n, sp.ring.size() - start);
+            memcpy(sp.current.data(), &sp.ring[start], first * sizeof(int32_t));
+            memset(&sp.ring[start], 0, first * sizeof(int32_t));
+            if (first < n) {
+                memcpy(sp.current.data() + first, sp.ring.data(), (n - first) * sizeof(int32_t));
+                memset(sp.ring.data(), 0, (n - first) * sizeof(int32_t));
+            }
+            mixAccumulate(acc.data(), sp.current.data(), n);
+        }
+
+        WsFrameHeader hdr;
+        hdr.format = SAMPLE_S16;
+        hdr.channels = (uint8_t)channels;
+        hdr.payload = WS_PAYLOAD_RAW;
+        hdr.seq = seq++;
+        hdr.sample_rate = sample_rate;
+        hdr.timestamp = clock;
+        hdr.pcm_bytes = (uint32_t)(n * 2);
+        out.everyone = frame(hdr, nullptr, n);
+        for (auto &entry : speakers) {
+            out.minus_one.emplace_back(entry.first, frame(hdr, entry.second.current.data(), n));
+        }
+        clock += frame_len;
+        return true;
+    }
+
+    size_t speakerCount() const {
+        return speakers.size();
+    }
+
+    long late_frames = 0;  // speaker frames that arrived after their slot was mixed
+    long rejected = 0;     // frames in a rate or layout other than the room's, or out of bounds
+
+private:
+    struct Speaker {
+        std::vector<int32_t> ring;     // ring_frames * channels, at 16 bit scale
+        std::vector<int32_t> current;  // this tick's slice
+        int64_t offset = 0;
+        bool synced = false;
+        time_point last_heard;
+    };
+
+    void start(uint32_t rate, int ch) {
+        sample_rate = rate;
+        channels = ch;
+        frame_len = std::max<size_t>(1, (size_t)rate * MIX_FRAME_MS / 1000);
+        ring_frames = std::max<size_t>(frame_len * (MIX_DELAY_FRAMES + 2), (size_t)rate * MIX_BUFFER_MS / 1000);
+    }
+
+    void reset() {
+        sample_rate = 0;
+        channels = 0;
+        frame_len = 0;
+        ring_frames = 0;
+        clock = 0;
+        acc.clear();
+        acc.shrink_to_fit();
+        canonical.clear();
+        canonical.shrink_to_fit();
+    }
+
+    std::string frame(const WsFrameHeader &hdr, const int32_t *own, size_t n) {
+        std::string msg(WS_FRAME_HEADER_SIZE + n * 2, '\0');
+        encodeWsFrameHeader((uint8_t *)&msg[0], hdr);
+        mixPackS16(acc.data(), own, n, (int16_t *)&msg[WS_FRAME_HEADER_SIZE]);
+        return msg;
+    }
+
+    uint32_t sample_rate = 0;
+    int channels = 0;
+    size_t frame_len = 0;    // sample frames per tick
+    size_t ring_frames = 0;
+    uint64_t clock = 0;      // next sample frame to mix
+    uint32_t seq = 0;
+    std::map<const void *, Speaker> speakers;
+    std::vector<int32_t> acc;
+    std::vector<int32_t> canonical;
+};
@@ -0,0 +1,187 @@
+#pragma once
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <climits>
+#include <cstdint>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Bounded multi-producer single-consumer ring, lock free on both sides
+// (Vyukov's sequence numbered cells). The consumer sleeps on a futex when the
+// ring is empty and producers only make the wake syscall when it is actually
+// asleep, so an idle queue costs no CPU and a busy one no syscalls.
+
+inline void futexWait(std::atomic<uint32_t> &word, uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void futexWake(std::atomic<uint32_t> &word, int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+template <typename T>
+class MpscRing {
+public:
+    // capacity is rounded up to a power of two
+    explicit MpscRing(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask = size - 1;
+        cells = std::unique_ptr<Cell[]>(new Cell[size]);
+        for (size_t i = 0; i < size; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing &) = delete;
+    MpscRing &operator=(const MpscRing &) = delete;
+
+    // any thread; false when the ring is full or closed, item is left alone then
+    bool push(T &item) {
+        if (closed.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Cell *cell;
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->item = std::move(item);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        // pairs with the fence in pop(): either it sees the item or we see it waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed)) {
+            wake.fetch_add(1, std::memory_order_relaxed);
+            futexWake(wake, 1);
+        }
+        return true;
+    }
+
+    // consumer only
+    bool tryPop(T &item) {
+        Cell *cell = &cells[head & mask];
+        if (cell->seq.load(std::memory_order_acquire) != head + 1) {
+            return false;
+        }
+        item = std::move(cell->item);
+        cell->item = T();
+        cell->seq.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+    // consumer only; blocks until there is an item, false once the ring is
+    // closed and drained
+    bool pop(T &item) {
+        for (;;) {
+            if (tryPop(item)) {
+                return true;
+            }
+            uint32_t seen = wake.load(std::memory_order_acquire);
+            waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (tryPop(item)) {
+                waiting.store(false, std::memory_order_relaxed);
+                return true;
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                waiting.store(false, std::memory_order_relaxed);
+                return false;
+            }
+            futexWait(wake, seen);
+            waiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+        wake.fetch_add(1, std::memory_order_release);
+        futexWake(wake, INT_MAX);
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T item;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) size_t head = 0;
+    std::atomic<bool> waiting{false};
+    std::atomic<uint32_t> wake{0};
+    std::atomic<bool> closed{false};
+};
+
+// A fixed pool of consumer threads, each owning one ring. Items are routed by
+// a key, so everything submitted under one key is handled by one thread in
+// submission order while different keys spread over the pool.
+template <typename T>
+class ShardedWorkers {
+public:
+    ShardedWorkers(int workers, size_t capacity, std::function<void(T &)> handler) : handler(std::move(handler)) {
+        for (int i = 0; i < std::max(1, workers); i++) {
+            rings.emplace_back(new MpscRing<T>(capacity));
+        }
+        for (auto &ring : rings) {
+            threads.emplace_back([this, r = ring.get()] { run(*r); });
+        }
+    }
+
+    ~ShardedWorkers() {
+        for (auto &ring : rings) {
+            ring->close();
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+    }
+
+    // false if that worker's ring is full; the caller decides what a drop means
+    bool submit(size_t key, T &item) {
+        // keys are often pointers, mix the aligned low bits away
+        uint64_t mixed = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+        return rings[(mixed >> 32) % rings.size()]->push(item);
+    }
+
+    // straight to one worker, for callers that pin their own keys to workers
+    bool submitTo(size_t worker, T &item) {
+        return rings[worker % rings.size()]->push(item);
+    }
+
+    size_t size() const {
+        return rings.size();
+    }
+
+private:
+    void run(MpscRing<T> &ring) {
+        T item;
+        while (ring.pop(item)) {
+            handler(item);
+            item = T();
+        }
+    }
+
+    std::function<void(T &)> handler;
+    std::vector<std::unique_ptr<MpscRing<T>>> rings;
+    std::vector<std::thread> threads;
+};
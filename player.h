@@ -0,0 +1,407 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <portaudio.h>
+#include "dgram.h"
+#include "chunk_writer.h"
+#include "convert.h"
+
+// Streaming playback for udpclient: chunks are played as they arrive instead
+// of after the whole file is in. The playout point trails the first arrival by
+// a delay sized from the RFC 3550 interarrival jitter; a chunk that is not
+// there when its turn comes is concealed rather than waited for, so a
+// retransmission never stalls the audio.
+
+#define PLAYOUT_MIN_DELAY_MS 20     // never start sooner than this after the first chunk
+#define PLAYOUT_MAX_DELAY_MS 200    // nor later, however bad the jitter looks
+#define PLAYOUT_JITTER_MULT 4       // delay = mult * jitter + one chunk
+#define PLC_DECAY 0.7               // gain applied per consecutive concealed chunk
+#define PLC_MAX_REPEATS 5           // after this many in a row, play silence
+
+using PlayClock = std::chrono::steady_clock;
+
+// where the played audio goes
+class AudioSink {
+public:
+    virtual ~AudioSink() = default;
+    virtual bool write(const uint8_t *data, size_t frames) = 0;
+    // true when write() itself blocks at the sample rate (a sound card);
+    // otherwise the player paces the writes
+    virtual bool paced() const {
+        return false;
+    }
+};
+
+// discards everything; for measuring startup and concealment headless
+class NullSink : public AudioSink {
+public:
+    bool write(const uint8_t *, size_t) override {
+        return true;
+    }
+};
+
+// the played stream, concealment included, as a WAV file
+class WavFileSink : public AudioSink {
+public:
+    WavFileSink(const std::string &path, const WavHeader &format, size_t frame_bytes)
+        : header(format), frame_bytes(frame_bytes) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Error opening playback file " << path << std::endl;
+            return;
+        }
+        header.data_size = 0;
+        header.overall_size = sizeof(WavHeader) - 8;
+        ::write(fd, &header, sizeof(WavHeader));
+    }
+
+    ~WavFileSink() override {
+        if (fd >= 0) {
+            // the sizes are only known now
+            pwrite(fd, &header, sizeof(WavHeader), 0);
+            ::close(fd);
+        }
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    bool write(const uint8_t *data, size_t frames) override {
+        size_t len = frames * frame_bytes;
+        if (::write(fd, data, len) != (ssize_t)len) {
+            std::cerr << "Error writing playback file" << std::endl;
+            return false;
+        }
+        header.data_size += len;
+        header.overall_size += len;
+        return true;
+    }
+
+private:
+    int fd = -1;
+    WavHeader header;
+    size_t frame_bytes;
+};
+
+// default output device through PortAudio's blocking API
+class PortAudioSink : public AudioSink {
+public:
+    ~PortAudioSink() override {
+        if (stream != nullptr) {
+            Pa_StopStream(stream);
+            Pa_CloseStream(stream);
+        }
+        if (initialized) {
+            Pa_Terminate();
+        }
+    }
+
+    bool open(const WavHeader &format, unsigned long frames_per_buffer) {
+        static const PaSampleFormat pa_formats[] = {0, paUInt8, paInt16, paInt24, paInt32, paFloat32};
+        int sample_format = sampleFormat(format);
+        if (sample_format == SAMPLE_UNSUPPORTED) {
+            std::cerr << "No PortAudio sample format for " << format.bits_per_sample << " bit audio" << std::endl;
+            return false;
+        }
+        PaError err = Pa_Initialize();
+        if (err != paNoError) {
+            std::cerr << "PortAudio error: " << Pa_GetErrorText(err) << std::endl;
+            return false;
+        }
+        initialized = true;
+        err = Pa_OpenDefaultStream(&stream, 0, format.num_channels, pa_formats[sample_format], format.sample_rate,
+                                   frames_per_buffer, nullptr, nullptr);
+        if (err == paNoError) {
+            err = Pa_StartStream(stream);
+        }
+        if (err != paNoError) {
+            std::cerr << "PortAudio error: " << Pa_GetErrorText(err) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool write(const uint8_t *data, size_t frames) override {
+        // an underflow here is the device running dry, keep going
+        Pa_WriteStream(stream, data, frames);
+        return true;
+    }
+
+    bool paced() const override {
+        return true;
+    }
+
+private:
+    bool initialized = false;
+    PaStream *stream = nullptr;
+};
+
+// scale the whole samples in buf by gain; offset is where buf starts in the
+// stream, so samples cut by the buffer edges are recognised and left alone
+inline void scaleSamples(uint8_t *buf, size_t len, size_t offset, const WavHeader &format, double gain) {
+    int sample_format = sampleFormat(format);
+    if (sample_format == SAMPLE_UNSUPPORTED) {
+        return;
+    }
+    size_t width = sampleWidth(sample_format);
+    size_t skip = (width - offset % width) % width;
+    if (skip >= len) {
+        return;
+    }
+    size_t count = (len - skip) / width;
+    static thread_local std::vector<int32_t> canonical;
+    canonical.resize(count);
+    toCanonical(buf + skip, sample_format, count, canonical.data());
+    for (size_t i = 0; i < count; i++) {
+        canonical[i] = (int32_t)std::llround(canonical[i] * gain);
+    }
+    fromCanonical(canonical.data(), sample_format, count, buf + skip);
+}
+
+class Player {
+public:
+    Player() = default;
+    Player(const Player &) = delete;
+    Player &operator=(const Player &) = delete;
+
+    ~Player() {
+        stop();
+    }
+
+    // spec is "portaudio", "null" or the path of a WAV file to play into;
+    // store is where the received chunks are read back from
+    bool open(const std::string &spec, const StreamInfo &info, const ChunkWriter &store, PlayClock::time_point requested) {
+        format = info.header;
+        frame_bytes = std::max(1, (int)format.block_align);
+        chunk_bytes = info.chunk_bytes;
+        chunk_count = info.chunk_count;
+        if (format.sample_rate <= 0) {
+            std::cerr << "Stream has no sample rate, cannot play it." << std::endl;
+            return false;
+        }
+        chunk_period = (double)chunk_bytes / frame_bytes / format.sample_rate;
+        if (spec == "portaudio") {
+            std::unique_ptr<PortAudioSink> pa(new PortAudioSink());
+            if (!pa->open(format, chunk_bytes / frame_bytes)) {
+                return false;
+            }
+            sink = std::move(pa);
+        } else if (spec == "null") {
+            sink.reset(new NullSink());
+        } else {
+            std::unique_ptr<WavFileSink> file(new WavFileSink(spec, format, frame_bytes));
+            if (!file->isOpen()) {
+                return false;
+            }
+            sink = std::move(file);
+        }
+        this->store = &store;
+        request_time = requested;
+        arrived.reset(new std::atomic<uint8_t>[chunk_count]);
+        for (uint64_t i = 0; i < chunk_count; i++) {
+            arrived[i].store(0, std::memory_order_relaxed);
+        }
+        worker = std::thread(&Player::run, this);
+        return true;
+    }
+
+    bool isOpen() const {
+        return sink != nullptr;
+    }
+
+    // chunk id is in the store and may be played
+    void onArrival(int64_t id) {
+        if (id < 0 || (uint64_t)id >= chunk_count || arrived[id].exchange(1, std::memory_order_release)) {
+            return;
+        }
+        int64_t highest = highest_arrived.load(std::memory_order_relaxed);
+        while (id > highest && !highest_arrived.compare_exchange_weak(highest, id, std::memory_order_relaxed)) {
+        }
+
+        // RFC 3550 A.8: the transit time of each chunk against its place in
+        // the media timeline, smoothed with gain 1/16
+        std::lock_guard<std::mutex> lock(mtx);
+        PlayClock::time_point now = PlayClock::now();
+        if (!first_arrival_seen) {
+            first_arrival = now;
+            first_arrival_seen = true;
+            cv.notify_all();
+        }
+        double transit = std::chrono::duration<double>(now - first_arrival).count() - id * chunk_period;
+        if (have_transit) {
+            double d = std::fabs(transit - last_transit);
+            jitter += (d - jitter) / 16;
+        }
+        last_transit = transit;
+        have_transit = true;
+    }
+
+    // no more chunks will arrive; whatever is still missing is lost
+    void endOfInput() {
+        input_done.store(true, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mtx);
+        cv.notify_all();
+    }
+
+    // play out what is left and wait for it
+    void finish() {
+        endOfInput();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // give up on playback immediately
+    void stop() {
+        stopping.store(true, std::memory_order_release);
+        finish();
+    }
+
+    void report() const {
+        std::cout << "Playback: started " << startup_ms << " ms after the request (playout delay "
+                  << playout_delay_ms << " ms, jitter " << jitter_ms << " ms), " << played << " chunks played, "
+                  << concealed_lost << " concealed as lost, " << concealed_late << " concealed as late" << std::endl;
+    }
+
+    uint64_t played = 0;
+    uint64_t concealed_lost = 0;   // missing although later chunks were in
+    uint64_t concealed_late = 0;   // nothing newer had arrived yet; playout slips one chunk
+    double startup_ms = 0;
+    double playout_delay_ms = 0;
+    double jitter_ms = 0;
+
+private:
+    bool isArrived(uint64_t id) const {
+        return arrived[id].load(std::memory_order_acquire) != 0;
+    }
+
+    // wait for the first chunk, then as long as the jitter says to
+    bool waitForStart() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return first_arrival_seen || input_done.load(std::memory_order_acquire); });
+        if (!first_arrival_seen) {
+            return false;
+        }
+        PlayClock::time_point start = first_arrival + std::chrono::milliseconds(PLAYOUT_MIN_DELAY_MS);
+        cv.wait_until(lock, start, [this] { return stopping.load(std::memory_order_acquire); });
+        double delay = PLAYOUT_JITTER_MULT * jitter + chunk_period;
+        delay = std::min(std::max(delay, PLAYOUT_MIN_DELAY_MS / 1000.0), PLAYOUT_MAX_DELAY_MS / 1000.0);
+        start = first_arrival + std::chrono::duration_cast<PlayClock::duration>(std::chrono::duration<double>(delay));
+        cv.wait_until(lock, start, [this] { return stopping.load(std::memory_order_acquire); });
+        playout_delay_ms = delay * 1000;
+        jitter_ms = jitter * 1000;
+        return !stopping.load(std::memory_order_acquire);
+    }
+
+    // a stand-in for chunk id: the same stretch of audio one chunk (rounded
+    // up to whole frames) back, faded, and silence once it has gone on too long
+    void conceal(size_t len) {
+        size_t back = (chunk_bytes + frame_bytes - 1) / frame_bytes * frame_bytes;
+        size_t start = pending.size();
+        pending.resize(start + len, format.bits_per_sample == 8 ? 128 : 0);
+        consecutive_concealed++;
+        if (consecutive_concealed > PLC_MAX_REPEATS || history.size() < back) {
+            return;
+        }
+        memcpy(pending.data() + start, history.data() + history.size() - back, len);
+        scaleSamples(pending.data() + start, len, played_bytes, format, std::pow(PLC_DECAY, consecutive_concealed));
+    }
+
+    // the last len bytes of pending are the next stretch of the stream
+    void append(size_t len) {
+        played_bytes += len;
+        // keep just enough of the past to conceal from
+        history.insert(history.end(), pending.end() - len, pending.end());
+        size_t keep = chunk_bytes + frame_bytes;
+        if (history.size() > 2 * keep) {
+            history.erase(history.begin(), history.end() - keep);
+        }
+    }
+
+    void run() {
+        if (!waitForStart()) {
+            return;
+        }
+        PlayClock::time_point base = PlayClock::now();
+        startup_ms = std::chrono::duration<double, std::milli>(base - request_time).count();
+        std::vector<uint8_t> chunk(chunk_bytes);
+        uint64_t next = 0;
+        uint64_t slot = 0;
+        while (next < chunk_count && !stopping.load(std::memory_order_acquire)) {
+            if (!sink->paced()) {
+                std::this_thread::sleep_until(base + std::chrono::duration_cast<PlayClock::duration>(
+                                                         std::chrono::duration<double>(slot * chunk_period)));
+            }
+            slot++;
+            size_t len = store->chunkLength(next);
+            if (isArrived(next)) {
+                size_t start = pending.size();
+                pending.resize(start + len);
+                store->read(next, pending.data() + start);
+                consecutive_concealed = 0;
+                played++;
+                next++;
+            } else if ((int64_t)next < highest_arrived.load(std::memory_order_relaxed) ||
+                       input_done.load(std::memory_order_acquire)) {
+                conceal(len);
+                concealed_lost++;
+                next++;
+            } else {
+                // the stream is behind, not lossy: fill in and try this chunk again
+                // next time, which grows the playout delay by a chunk
+                conceal(len);
+                concealed_late++;
+            }
+            append(len);
+            size_t frames = pending.size() / frame_bytes;
+            if (frames > 0) {
+                if (!sink->write(pending.data(), frames)) {
+                    break;
+                }
+                pending.erase(pending.begin(), pending.begin() + frames * frame_bytes);
+            }
+        }
+    }
+
+    WavHeader format;
+    size_t frame_bytes = 1;
+    size_t chunk_bytes = 0;
+    uint64_t chunk_count = 0;
+    double chunk_period = 0;     // seconds of audio per full chunk
+    std::unique_ptr<AudioSink> sink;
+    const ChunkWriter *store = nullptr;
+    PlayClock::time_point request_time;
+
+    std::unique_ptr<std::atomic<uint8_t>[]> arrived;
+    std::atomic<int64_t> highest_arrived{-1};
+    std::atomic<bool> input_done{false};
+    std::atomic<bool> stopping{false};
+    std::thread worker;
+
+    // jitter estimate, shared with the receive loop
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool first_arrival_seen = false;
+    PlayClock::time_point first_arrival;
+    bool have_transit = false;
+    double last_transit = 0;
+    double jitter = 0;
+
+    // playout thread only
+    std::vector<uint8_t> pending;   // bytes not yet handed to the sink (a partial frame at most)
+    std::vector<uint8_t> history;   // the most recent bytes played
+    size_t played_bytes = 0;
+    int consecutive_concealed = 0;
+};
@@ -6,71 +6,91 @@
 
 #include "server_ws.hpp"
 #include "audio.h"
+#include "mpsc.h"
+#include "snapshot.h"
+#include "rooms.h"
+#include "mixer.h"
+#include "webm.h"
+#include "simulcast.h"
 #include "rest_api.cpp"
 
 using namespace SimpleWeb;
 using namespace std;
 using WsServer = SimpleWeb::SocketServer<SimpleWeb::WS>;
 
-std::mutex connections_mtx;
-std::set<std::shared_ptr<WsServer::Connection>> connections;
-
-std::mutex connections_open_mtx;
-int connections_open;
-
-std::mutex connections_closed_mtx;
-int connections_closed;
-
-std::mutex last_broadcast_turn_around_time_mtx;
-long last_broadcast_turn_around_time;
-
-std::mutex total_broadcast_turn_around_time_mtx;
-long total_broadcast_turn_around_time;
-
-std::mutex count_broadcast_turn_around_time_mtx;
-long count_broadcast_turn_around_time;
-
-std::mutex last_cpu_utilization_during_broadcast_mtx;
-double last_cpu_utilization_during_broadcast;
-
-std::mutex average_cpu_utilization_during_broadcast_mtx;
-double average_cpu_utilization_during_broadcast;
-
-std::mutex last_memory_utilization_during_broadcast_mtx;
-double last_memory_utilization_during_broadcast;
-
-std::mutex total_messages_recieved_mtx;
-long total_messages_recieved;
+// every open connection; on_open/on_close rebuild it, readers only load snapshots
+SnapshotSet<Listener> connections;
+
+// /room/NAME puts a connection in room NAME, plain /echo in DEFAULT_ROOM;
+// messages only go to the sender's room. /mix/NAME is the mixing room
+// "mix:NAME": speakers send PCM frames and every member gets one mixed
+// stream back (mixer.h). Every other room keeps a short history of what it
+// relayed, so a joiner can start playing straight away (webm.h), and sends
+// each listener the simulcast layer its link can carry (simulcast.h).
+#define DEFAULT_ROOM "echo"
+#define MIX_ROOM_PREFIX "mix:"
+RoomRegistry<Listener> rooms;
+
+std::string roomName(const shared_ptr<WsServer::Connection> &connection) {
+    if (connection->path_match.size() < 2) {
+        return DEFAULT_ROOM;
+    }
+    bool mixed = connection->path.compare(0, 5, "/mix/") == 0;
+    return (mixed ? MIX_ROOM_PREFIX : "") + connection->path_match[1].str();
+}
 
-std::mutex total_messages_sent_mtx;
-long total_messages_sent;
+void initRoom(RelayRoom &room) {
+    if (room.name.compare(0, strlen(MIX_ROOM_PREFIX), MIX_ROOM_PREFIX) == 0) {
+        room.mixer = std::make_shared<AudioMixer>();
+    } else {
+        room.history = std::make_shared<StreamHistory>();
+        room.simulcast = std::make_shared<SimulcastRoom>();
+    }
+}
 
-std::mutex total_bytes_sent_mtx;
-long total_bytes_sent;
+// ?resume=N on the URL a client reconnects with, -1 without
+int64_t resumeFrom(const std::string &query_string) {
+    size_t at = query_string.find("resume=");
+    if (at == std::string::npos || (at > 0 && query_string[at - 1] != '&')) {
+        return -1;
+    }
+    return strtoll(query_string.c_str() + at + 7, nullptr, 10);
+}
 
-std::mutex total_bytes_recieved_mtx;
-long total_bytes_recieved;
+// per listener send queue bounds, from --max-queue-bytes, --max-queue-messages
+// and --slow-grace-ms
+SendQueueLimits send_queue_limits;
+std::atomic<int> next_listener_id{0};
 
-std::mutex total_threads_created_mtx;
-int total_threads_created;
+// every counter and timer on the stats page, see RelayMetrics in rest_helper.cpp
+RelayMetrics relay_metrics;
 
-std::mutex current_number_of_threads_mtx;
-int current_number_of_threads;
+#define BROADCAST_WORKERS 2            // default for --broadcast-workers
+#define BROADCAST_QUEUE_CAPACITY 1024  // messages waiting per worker
 
-std::mutex binary_data_processing_queue_mtx;
-std::vector<BinaryDataQueueItem> binary_data_processing_queue;
+void broadcast_binary(const std::shared_ptr<WsServer::OutMessage> &msg, size_t bytes, RelayRoom &room, const shared_ptr<WsServer::Connection> &curr_connection, std::chrono::high_resolution_clock::time_point received, bool include_self = false, unsigned char opcode = 129, const SimulcastHeader *layer = nullptr, uint64_t seq = 0);
 
-std::chrono::_V2::system_clock::time_point start_time;
-std::chrono::_V2::system_clock::time_point end_time;
+// every room is pinned to one worker, so a room's messages go out in the
+// order they came in and different rooms fan out in parallel
+std::unique_ptr<ShardedWorkers<BinaryDataQueueItem>> broadcast_workers;
 
-void queuebinarydataforprocessing(std::shared_ptr<WsServer::OutMessage> &data, shared_ptr<WsServer::Connection> connection, bool include_self = false, unsigned char opcode = 129) {
-    std::lock_guard<std::mutex> lock(binary_data_processing_queue_mtx);
+void queuebinarydataforprocessing(std::shared_ptr<WsServer::OutMessage> &data, const SimulcastHeader *layer, const std::shared_ptr<RelayRoom> &room, shared_ptr<WsServer::Connection> connection, std::chrono::high_resolution_clock::time_point received, bool include_self = false, unsigned char opcode = 129) {
     BinaryDataQueueItem item;
     item.data = data;
+    if (layer) {
+        item.layered = true;
+        item.layer = *layer;
+    }
     item.connection = connection;
+    item.room = room;
     item.include_self = include_self;
     item.opcode = opcode;
-    binary_data_processing_queue.push_back(item);
+    item.received = received;
+    item.bytes = data->size();
+    if (!broadcast_workers->submitTo(room->worker, item)) {
+        // the workers are that far behind; dropping is better than stalling the io thread
+        relay_metrics.broadcasts_dropped.add();
+    }
 }
 
 
@@ -89,79 +109,225 @@ int sendData(shared_ptr<WsServer::Connection> connection, std::string data, unsi
   return sizeof(data);
 }
 
-int sendBinaryData(shared_ptr<WsServer::Connection> connection, std::shared_ptr<WsServer::OutMessage> &data, unsigned char opcode = 129) {
-    std::cout << "Sending using sendBinaryData " << std::endl;
-    // connection->send is an asynchronous function
-    // auto out_message = std::make_shared<WsServer::OutMessage>();
-    // out_message->write(data.c_str(), data.size());
-    connection->send(data, [](const SimpleWeb::error_code &ec) {
-        if(ec) {
-            std::cout << "Server: Error sending message. " <<
-                // See http://www.boost.org/doc/libs/1_55_0/doc/html/boost_asio/reference.html, Error Codes for error code meanings
-                "Error: " << ec << ", error message: " << ec.message() << std::endl;
-        }
-  }, opcode);
-  return sizeof(data);
+// a listener's queued send finished, on an io thread
+void onListenerSent(const std::string &error, std::chrono::steady_clock::duration took) {
+    relay_metrics.send_latency.record(took);
+    if (!error.empty()) {
+        relay_metrics.send_errors.add();
+        std::cout << "Server: Error sending message. Error message: " << error << std::endl;
+    }
+}
+
+// "STREAM_SEQ n": the client has every relayed message up to n; "STREAM_SEQ
+// none": it is being sent messages it cannot resume from
+std::shared_ptr<WsServer::OutMessage> streamSeqMessage(const std::string &seq) {
+    std::string text = "STREAM_SEQ " + seq;
+    std::shared_ptr<WsServer::OutMessage> msg = std::make_shared<WsServer::OutMessage>(text.size());
+    msg->write(text.data(), text.size());
+    return msg;
 }
 
-void broadcast_binary(std::shared_ptr<WsServer::OutMessage> msg, shared_ptr<WsServer::Connection> curr_connection, bool include_self = false, unsigned char opcode = 129) {
-    std::vector<std::shared_ptr<WsServer::Connection>> conn_pool;
-    {
-        std::lock_guard<std::mutex> lock(connections_mtx);
-        conn_pool.assign(connections.begin(), connections.end());
+// Fans one received message out to the other listeners in its room. msg is
+// shared, not copied: each listener's queue holds the same pointer and
+// SimpleWeb writes the same payload buffer to every socket, adding only its
+// own frame header. A simulcast layer only goes to the listeners the room's
+// SimulcastRoom picks that layer for, judged by their queues. In a relayed
+// room seq is the message's place in the history, 0 if it was not kept, and
+// a listener whose count of messages would be off is sent a "STREAM_SEQ"
+// first (StreamCursor).
+void broadcast_binary(const std::shared_ptr<WsServer::OutMessage> &msg, size_t bytes, RelayRoom &room, const shared_ptr<WsServer::Connection> &curr_connection, std::chrono::high_resolution_clock::time_point received, bool include_self, unsigned char opcode, const SimulcastHeader *layer, uint64_t seq) {
+    int64_t sends = 0;
+    int64_t dropped = 0;
+    int64_t skipped = 0;
+    int64_t switches = 0;
+    int64_t resyncs = 0;
+    FanoutTimer timer;
+    auto now = std::chrono::steady_clock::now();
+    if (layer) {
+        room.simulcast->publish(curr_connection.get(), *layer, now);
     }
-    for (auto &conn : conn_pool) {
-      if (!include_self && conn == curr_connection) {
+    std::shared_ptr<WsServer::OutMessage> resync;
+    // one version check per message, however many members the room has
+    for (const Listener &listener : roomMembers(room)) {
+      if (!include_self && listener.connection == curr_connection) {
           continue;
       }else{
-        { 
-          std::lock_guard<std::mutex> lock(total_messages_sent_mtx);
-          std::lock_guard<std::mutex> lock2(total_bytes_sent_mtx);
-          total_bytes_sent += sizeof(msg->rdbuf());
-          total_messages_sent++;
+        if (layer) {
+            ListenerQueueStats queue = listener.queue->stats();
+            SimulcastLink link;
+            link.goodput_bps = queue.goodput_bps;
+            link.queued_bytes = queue.queued_bytes;
+            link.dropped = queue.dropped;
+            SimulcastDecision decision = room.simulcast->forward(*listener.simulcast, curr_connection.get(), *layer, link, now);
+            if (decision == SIMULCAST_SKIP) {
+                skipped++;
+                continue;
+            }
+            switches += decision == SIMULCAST_SWITCH;
+        }
+        bool lost = false;
+        StreamCursorAction action = room.history ? listener.cursor->next(seq) : STREAM_CURSOR_NONE;
+        if (action != STREAM_CURSOR_NONE) {
+            if (!resync) {
+                resync = action == STREAM_CURSOR_RESYNC ? streamSeqMessage(std::to_string(seq - 1)) : streamSeqMessage("none");
+            }
+            lost = listener.queue->push(resync, resync->size(), 129).dropped > 0;
+            resyncs++;
         }
-        sendBinaryData(conn, msg, opcode);
+        // queued behind whatever this listener has not taken yet; a slow
+        // one loses its oldest frames rather than growing without bound
+        RelayListenerQueue::PushResult pushed = listener.queue->push(msg, bytes, opcode);
+        if (lost || pushed.dropped > 0) {
+            listener.cursor->lost();
+        }
+        dropped += pushed.dropped;
+        if (pushed.evicted) {
+            std::cout << "Server: Evicting slow listener " << listener.connection.get() << std::endl;
+            relay_metrics.slow_listeners_evicted.add();
+        }
+        sends++;
       }
     }
-    end_time = std::chrono::high_resolution_clock::now();
-    {
-        std::lock_guard<std::mutex> lock(last_broadcast_turn_around_time_mtx);
-        last_broadcast_turn_around_time = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
-        std::lock_guard<std::mutex> lock2(total_broadcast_turn_around_time_mtx);
-        total_broadcast_turn_around_time += last_broadcast_turn_around_time;
-        std::lock_guard<std::mutex> lock3(count_broadcast_turn_around_time_mtx);
-        count_broadcast_turn_around_time++;
+    relay_metrics.messages_sent.add(sends);
+    relay_metrics.bytes_sent.add(sends * bytes);
+    room.messages_out.fetch_add(sends, std::memory_order_relaxed);
+    room.bytes_out.fetch_add(sends * bytes, std::memory_order_relaxed);
+    if (dropped > 0) {
+        relay_metrics.listener_frames_dropped.add(dropped);
+    }
+    if (skipped > 0) {
+        relay_metrics.simulcast_skipped.add(skipped);
+        relay_metrics.simulcast_bytes_skipped.add(skipped * bytes);
+    }
+    if (switches > 0) {
+        relay_metrics.simulcast_switches.add(switches);
     }
+    if (resyncs > 0) {
+        relay_metrics.stream_seq_resyncs.add(resyncs);
+    }
+    recordFanoutCost(timer.stop(), sends);
+    // from this message arriving to the last send being handed to asio
+    relay_metrics.broadcast_turnaround.record(std::chrono::high_resolution_clock::now() - received);
 }
 
-void processBinaryDataQueue() {
-  std::cout << "Binary data processing thread started." << std::endl;
-  while (true) {
-      BinaryDataQueueItem item;
-      {
-          std::lock_guard<std::mutex> lock(binary_data_processing_queue_mtx);
-          if (!binary_data_processing_queue.empty()) {
-              item = binary_data_processing_queue.front();
-              binary_data_processing_queue.erase(binary_data_processing_queue.begin());
-          } else {
-              continue; // No items to process
-          }
-      }
-      broadcast_binary(item.data, item.connection, item.include_self, item.opcode);
-  }
+// The bytes of a queued outgoing message, for the room's history to keep
+// instead of a copy. OutMessage writes into an asio::streambuf, whose readable
+// bytes are one contiguous buffer; sending a message only reads them.
+StreamHistory::Bytes messageBytes(const std::shared_ptr<WsServer::OutMessage> &msg) {
+    auto *buf = static_cast<SimpleWeb::asio::streambuf *>(msg->rdbuf());
+    SimpleWeb::asio::const_buffer readable = buf->data();
+    return StreamHistory::Bytes(msg, static_cast<const char *>(readable.data()), readable.size());
 }
 
-void broadcast(std::string msg, shared_ptr<WsServer::Connection> curr_connection, bool include_self = false, unsigned char opcode = 129) {
-    std::vector<std::shared_ptr<WsServer::Connection>> conn_pool;
-    {
-        std::lock_guard<std::mutex> lock(connections_mtx);
-        conn_pool.assign(connections.begin(), connections.end());
+// A new listener in a relayed room, on the room's worker. Everything the room
+// relayed before this point is in its history and nothing after it has reached
+// the listener's queue, which is gated until now, so the catch-up and the live
+// messages follow on without a gap or a repeat. The client learns the sequence
+// number of the last relayed message it has been given from "STREAM_SEQ n",
+// and can reconnect with ?resume=n.
+void catch_up(RelayRoom &room, BinaryDataQueueItem &item) {
+    item.joiner->open();
+    bool resumed = false;
+    std::vector<StreamHistory::Bytes> backlog = room.history->catchUp(item.resume, resumed);
+    for (const StreamHistory::Bytes &bytes : backlog) {
+        std::shared_ptr<WsServer::OutMessage> msg = std::make_shared<WsServer::OutMessage>(bytes.size);
+        msg->write(bytes.data, bytes.size);
+        item.joiner->push(msg, bytes.size, 130);
+    }
+    std::shared_ptr<WsServer::OutMessage> seq = streamSeqMessage(std::to_string(room.history->lastSeq()));
+    item.joiner->push(seq, seq->size(), 129);
+    item.cursor->told(room.history->lastSeq());
+    // the catch-up was layered senders' layer 0, so that is where it goes on
+    room.simulcast->seed(*item.subscriber, std::chrono::steady_clock::now());
+    if (resumed) {
+        relay_metrics.resumes.add();
+    } else if (!backlog.empty()) {
+        relay_metrics.fast_starts.add();
+    }
+    relay_metrics.join_catch_up.record(std::chrono::high_resolution_clock::now() - item.received);
+}
+
+// One mixer tick on the room's worker: every member gets a single frame, the
+// full mix or, for speakers, the mix without their own voice.
+void mix_room(RelayRoom &room) {
+    static thread_local AudioMixer::Output out;
+    FanoutTimer timer;
+    if (!room.mixer->mix(out, std::chrono::steady_clock::now())) {
+        return;
+    }
+    auto wrap = [](const std::string &frame) {
+        std::shared_ptr<WsServer::OutMessage> msg = std::make_shared<WsServer::OutMessage>(frame.size());
+        msg->write(frame.data(), frame.size());
+        return msg;
+    };
+    std::shared_ptr<WsServer::OutMessage> everyone = wrap(out.everyone);
+    std::map<const void *, std::shared_ptr<WsServer::OutMessage>> minus_one;
+    for (auto &entry : out.minus_one) {
+        minus_one[entry.first] = wrap(entry.second);
+    }
+    // every variant of a tick's frame has the same length
+    size_t size = out.everyone.size();
+    int64_t sends = 0;
+    int64_t dropped = 0;
+    for (const Listener &listener : roomMembers(room)) {
+        auto own = minus_one.find(listener.connection.get());
+        const std::shared_ptr<WsServer::OutMessage> &msg = own != minus_one.end() ? own->second : everyone;
+        RelayListenerQueue::PushResult pushed = listener.queue->push(msg, size, 130);
+        dropped += pushed.dropped;
+        if (pushed.evicted) {
+            std::cout << "Server: Evicting slow listener " << listener.connection.get() << std::endl;
+            relay_metrics.slow_listeners_evicted.add();
+        }
+        sends++;
+    }
+    relay_metrics.messages_sent.add(sends);
+    relay_metrics.bytes_sent.add(sends * size);
+    room.messages_out.fetch_add(sends, std::memory_order_relaxed);
+    room.bytes_out.fetch_add(sends * size, std::memory_order_relaxed);
+    if (dropped > 0) {
+        relay_metrics.listener_frames_dropped.add(dropped);
+    }
+    // the mixing and the fan-out of one tick
+    recordFanoutCost(timer.stop(), sends);
+}
+
+// a speaker's frame for a mixing room, on the room's worker
+void mix_in(RelayRoom &room, BinaryDataQueueItem &item) {
+    if (!room.mixer->push(item.connection.get(), (const uint8_t *)item.pcm.data(), item.pcm.size(), std::chrono::steady_clock::now())) {
+        relay_metrics.mix_frames_rejected.add();
+    }
+    relay_metrics.broadcast_turnaround.record(std::chrono::high_resolution_clock::now() - item.received);
+}
+
+// ticks every mixing room once per MIX_FRAME_MS; the mixing itself happens
+// on each room's own worker
+void mixClock() {
+    auto next = std::chrono::steady_clock::now();
+    for (;;) {
+        next += std::chrono::milliseconds(MIX_FRAME_MS);
+        std::this_thread::sleep_until(next);
+        std::shared_ptr<const RoomRegistry<Listener>::Map> map = rooms.load();
+        for (const auto &entry : *map) {
+            if (!entry.second->mixer) {
+                continue;
+            }
+            BinaryDataQueueItem item;
+            item.room = entry.second;
+            item.tick = true;
+            item.bytes = 0;
+            if (!broadcast_workers->submitTo(entry.second->worker, item)) {
+                relay_metrics.mix_ticks_dropped.add();
+            }
+        }
     }
-    for (auto &conn : conn_pool) {
-      if (!include_self && conn == curr_connection) {
+}
+
+void broadcast(std::string msg, RelayRoom &room, shared_ptr<WsServer::Connection> curr_connection, bool include_self = false, unsigned char opcode = 129) {
+    for (const Listener &listener : roomMembers(room)) {
+      if (!include_self && listener.connection == curr_connection) {
           continue;
       }else{
-          sendData(conn, msg, opcode); 
+          sendData(listener.connection, msg, opcode); 
       }
     }
      
@@ -185,35 +351,59 @@ int run_server(){
 
   echo.on_message = [](shared_ptr<WsServer::Connection> connection, shared_ptr<WsServer::InMessage> in_message) {
     //start a timer to measure how long it takes to process the message
-    start_time = std::chrono::high_resolution_clock::now();
-    {
-        std::lock_guard<std::mutex> lock(total_messages_recieved_mtx);
-        std::lock_guard<std::mutex> lock2(total_bytes_recieved_mtx);
-        total_bytes_recieved += sizeof(in_message->rdbuf());
-        total_messages_recieved++;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    relay_metrics.messages_received.add();
+    relay_metrics.bytes_received.add(in_message->size());
+    std::shared_ptr<RelayRoom> room = rooms.find(roomName(connection));
+    if (!room) {
+        // the connection has already left its room
+        return;
     }
+    room->messages_in.fetch_add(1, std::memory_order_relaxed);
+    room->bytes_in.fetch_add(in_message->size(), std::memory_order_relaxed);
     
-    if ((in_message->fin_rsv_opcode & 0x0f) == 2) {
+    if ((in_message->fin_rsv_opcode & 0x0f) == 2 && room->mixer) {
+        // mixed, not forwarded; the worker decodes it
+        BinaryDataQueueItem item;
+        item.connection = connection;
+        item.room = room;
+        item.include_self = false;
+        item.opcode = 130;
+        item.received = start_time;
+        item.pcm = in_message->string();
+        item.bytes = item.pcm.size();
+        if (!broadcast_workers->submitTo(room->worker, item)) {
+            relay_metrics.broadcasts_dropped.add();
+        }
+    } else if ((in_message->fin_rsv_opcode & 0x0f) == 2) {
         // Close frame received, ignore the message
         // in_message->binary(); // Consume the message to clear the stream
-        std::shared_ptr<WsServer::OutMessage> binary_data = std::make_shared<WsServer::OutMessage>();
-        // *binary_data << in_message->string();
-        // write in_message data to binary_data
-        char buffer[8192];
-         std::size_t bytes_read;
-         std::streambuf *in_buf = in_message->rdbuf();
-         while ((bytes_read = in_buf->sgetn(buffer, sizeof(buffer))) > 0) {
-             binary_data->write(buffer, bytes_read);
-         }
-        // binary_data->write(asio::buffers_begin(in_message->rdbuf()), asio::buffers_size(in_message->rdbuf()));
+        // the one buffer every listener is sent, and the room's history
+        // keeps, is sized once and filled with a single copy straight from
+        // the socket's buffer; it is never written again once it is queued.
+        // Simulcast layers lose their header here, listeners get the bare
+        // stream: the header is read first and not copied along.
+        size_t size = in_message->size();
+        char head[SIMULCAST_HEADER_SIZE];
+        size_t head_len = std::min<size_t>(size, SIMULCAST_HEADER_SIZE);
+        in_message->read(head, head_len);
+        SimulcastHeader layer;
+        bool layered = decodeSimulcastHeader((const uint8_t *)head, head_len, layer);
+        std::shared_ptr<WsServer::OutMessage> binary_data = std::make_shared<WsServer::OutMessage>(layered ? size - head_len : size);
+        if (!layered) {
+            binary_data->write(head, head_len);
+        }
+        if (size > head_len) {
+            *binary_data << in_message->rdbuf();
+        }
 
         std::cout << "Server: Binary message received from " << connection.get() << ", size: " << binary_data->size() << " bytes" << std::endl;
-        queuebinarydataforprocessing(binary_data, connection, false, 130);
+        queuebinarydataforprocessing(binary_data, layered ? &layer : nullptr, room, connection, start_time, false, 130);
         
     }else{
       std::string out_message = in_message->string();
       cout << "Server: Message received from " << connection.get() << std::endl;
-      broadcast(out_message, connection);
+      broadcast(out_message, *room, connection);
       // sendData(connection, "SOCKET_OPEN");
     }
     
@@ -228,11 +418,34 @@ int run_server(){
   echo.on_open = [](shared_ptr<WsServer::Connection> connection) {
     std::cout << "Server: Opened connection " << connection.get() << std::endl;
     
-    {
-        std::lock_guard<std::mutex> lock(connections_mtx);
-        connections.insert(connection);
-        std::lock_guard<std::mutex> lock2(connections_open_mtx);
-        connections_open++;
+    auto opened = std::chrono::high_resolution_clock::now();
+    Listener listener;
+    listener.connection = connection;
+    // gated: the room's worker opens it when it sends the catch-up
+    listener.queue = std::make_shared<RelayListenerQueue>(connection, send_queue_limits, ++next_listener_id, onListenerSent, true);
+    listener.simulcast = std::make_shared<SimulcastSubscriber>();
+    listener.cursor = std::make_shared<StreamCursor>();
+    if (connections.insert(listener)) {
+        relay_metrics.connections_opened.add();
+    }
+    std::shared_ptr<RelayRoom> room = rooms.join(roomName(connection), listener, initRoom);
+    std::cout << "Server: Connection " << connection.get() << " joined room " << room->name << " (worker " << room->worker << ")" << std::endl;
+    if (room->history) {
+        BinaryDataQueueItem item;
+        item.room = room;
+        item.joiner = listener.queue;
+        item.cursor = listener.cursor;
+        item.subscriber = listener.simulcast;
+        item.resume = resumeFrom(connection->query_string);
+        item.received = opened;
+        item.bytes = 0;
+        if (!broadcast_workers->submitTo(room->worker, item)) {
+            // no catch-up then, but the live messages should still flow
+            relay_metrics.broadcasts_dropped.add();
+            listener.queue->open();
+        }
+    } else {
+        listener.queue->open();
     }
     
     sendData(connection, "SOCKET_OPEN");
@@ -241,11 +454,23 @@ int run_server(){
   // See RFC 6455 7.4.1. for status codes
   echo.on_close = [](shared_ptr<WsServer::Connection> connection, int status, const string & reason) {
     std::cout << "Server: Closed connection " << connection.get() << " with status code " << status << " and reason: " << reason << std::endl;
-    {
-        std::lock_guard<std::mutex> lock(connections_mtx);
-        connections.erase(connection);
-        std::lock_guard<std::mutex> lock3(connections_closed_mtx);
-        connections_closed++;
+    Listener listener;
+    listener.connection = connection;
+    std::shared_ptr<RelayRoom> room = rooms.find(roomName(connection));
+    rooms.leave(roomName(connection), listener);
+    if (room && room->history) {
+        // its parser and init segment go on the worker that owns the history
+        BinaryDataQueueItem item;
+        item.room = room;
+        item.connection = connection;
+        item.left = true;
+        item.bytes = 0;
+        if (!broadcast_workers->submitTo(room->worker, item)) {
+            relay_metrics.broadcasts_dropped.add();
+        }
+    }
+    if (connections.erase(listener)) {
+        relay_metrics.connections_closed.add();
     }
     sendData(connection, "SOCKET_CLOSED");
   };
@@ -261,6 +486,22 @@ int run_server(){
           << "Error: " << ec << ", error message: " << ec.message() << std::endl;
   };
 
+  // ws://host:8081/room/NAME joins room NAME; same handlers, scoped by the name
+  auto &room = server.endpoint["^/room/([A-Za-z0-9_-]{1,64})/?$"];
+  room.on_message = echo.on_message;
+  room.on_open = echo.on_open;
+  room.on_close = echo.on_close;
+  room.on_handshake = echo.on_handshake;
+  room.on_error = echo.on_error;
+
+  // ws://host:8081/mix/NAME joins the mixing room NAME
+  auto &mix = server.endpoint["^/mix/([A-Za-z0-9_-]{1,64})/?$"];
+  mix.on_message = echo.on_message;
+  mix.on_open = echo.on_open;
+  mix.on_close = echo.on_close;
+  mix.on_handshake = echo.on_handshake;
+  mix.on_error = echo.on_error;
+
   // Start server and receive assigned port when server is listening for requests
   promise<unsigned short> server_port;
   thread server_thread([&server, &server_port]() {
@@ -283,7 +524,29 @@ int run_server(){
   return 0;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    int workers = BROADCAST_WORKERS;
+    int stats_interval_ms = STATS_INTERVAL_MS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--broadcast-workers") == 0 && i + 1 < argc) {
+            workers = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--stats-interval-ms") == 0 && i + 1 < argc) {
+            stats_interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-queue-bytes") == 0 && i + 1 < argc) {
+            send_queue_limits.max_bytes = std::max(1L, atol(argv[++i]));
+        } else if (strcmp(argv[i], "--max-queue-messages") == 0 && i + 1 < argc) {
+            send_queue_limits.max_messages = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--slow-grace-ms") == 0 && i + 1 < argc) {
+            send_queue_limits.grace = std::chrono::milliseconds(std::max(0, atoi(argv[++i])));
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            // cycles and cache misses per fan-out; needs perf_event_paranoid <= 2
+            PerfCounters::enable(true);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--broadcast-workers N] [--stats-interval-ms MS]"
+                      << " [--max-queue-bytes N] [--max-queue-messages N] [--slow-grace-ms MS] [--perf-counters]" << std::endl;
+            return 1;
+        }
+    }
     std::cout << "Starting WebSocket server..." << std::endl;
     // detect if interrupt signal to end program
     std::signal(SIGINT, [](int signum) {
@@ -294,10 +557,37 @@ int main() {
 
     // WebSocket (WS)-server at port 8080 using 1 thread
     // Initialize TinyAPI in a different thread to avoid blocking
-    std::thread tinyapi_thread(initTinyAPI);
+    std::thread tinyapi_thread(initTinyAPI, stats_interval_ms);
     tinyapi_thread.detach();
-    std::thread binary_data_processing_thread(processBinaryDataQueue);
-    binary_data_processing_thread.detach();
+    broadcast_workers.reset(new ShardedWorkers<BinaryDataQueueItem>(workers, BROADCAST_QUEUE_CAPACITY, [](BinaryDataQueueItem &item) {
+        if (item.room->mixer) {
+            if (item.tick) {
+                mix_room(*item.room);
+            } else {
+                mix_in(*item.room, item);
+            }
+            return;
+        }
+        if (item.joiner) {
+            catch_up(*item.room, item);
+            return;
+        }
+        if (item.left) {
+            item.room->history->forget(item.connection.get());
+            return;
+        }
+        // joiners catch up on a layered sender's lowest layer, then move up
+        // like everyone else
+        uint64_t seq = 0;
+        if (item.room->history && (!item.layered || item.layer.layer == 0)) {
+            seq = item.room->history->add(item.connection.get(), messageBytes(item.data));
+        }
+        broadcast_binary(item.data, item.bytes, *item.room, item.connection, item.received, item.include_self, item.opcode, item.layered ? &item.layer : nullptr, seq);
+    }));
+    rooms.setWorkers(workers);
+    std::cout << workers << " broadcast workers started" << std::endl;
+    std::thread mix_clock_thread(mixClock);
+    mix_clock_thread.detach();
     run_server();
     
 
@@ -27,30 +27,56 @@ const timeslice = 1500; // 1 second slices
 // Helper function for recieving base64 audio and converting to Blob
 let detectedMimeType = null;
 
-const ws = new WebSocket('ws://localhost:8081/echo/');
-ws.binaryType = 'blob';
+// sequence number of the last relayed message received. The server sends
+// "STREAM_SEQ n" after the catch-up a new connection gets, and again ahead
+// of any binary message that is not simply the next one (messages we were
+// not sent, frames dropped on a slow link), so counting binary messages in
+// between is exact. "STREAM_SEQ none" means we are on a simulcast layer the
+// server keeps no history of, so there is nothing to resume from. Reconnecting with ?resume=n replays only what was missed
+// instead of starting over.
+let streamSeq = null;
+let ws = null;
+
+function connect() {
+  const resume = streamSeq === null ? '' : `?resume=${streamSeq}`;
+  ws = new WebSocket(`ws://localhost:8081/echo/${resume}`);
+  ws.binaryType = 'blob';
+
+  ws.onopen = () => {
+    console.log('WebSocket connection established');
+  };
 
-ws.onopen = () => {
-  console.log('WebSocket connection established');
-};
+  ws.onmessage = (event) => {
+    console.log('Message received from server:');
+    if (typeof event.data === 'string') {
+      if (event.data === 'SOCKET_OPEN') {
+        console.log('WebSocket connection is open and ready for audio data');
+      } else if (event.data === 'STREAM_SEQ none') {
+        // a simulcast layer the server keeps no history of; a reconnect starts afresh
+        streamSeq = null;
+      } else if (event.data.startsWith('STREAM_SEQ ')) {
+        streamSeq = parseInt(event.data.slice(11), 10);
+      }
+      return;
+    }
+    if (streamSeq !== null) {
+      streamSeq++;
+    }
+    audioB64Buffer.push(event.data);
+    fillAudioBuffer();
+  };
 
-ws.onmessage = (event) => {
-  console.log('Message received from server:');
-  if (event.data === 'SOCKET_OPEN') {
-    console.log('WebSocket connection is open and ready for audio data');
-    return;
-  }
-  audioB64Buffer.push(event.data);
-  fillAudioBuffer();
-};
+  ws.onclose = () => {
+    console.log('WebSocket connection closed');
+    setTimeout(connect, 1000);
+  };
 
-ws.onclose = () => {
-  console.log('WebSocket connection closed');
-};
+  ws.onerror = (error) => {
+    console.error('WebSocket error:', error);
+  };
+}
 
-ws.onerror = (error) => {
-  console.error('WebSocket error:', error);
-};
+connect();
 
 
 function getSupportedMimeType() {
@@ -0,0 +1,246 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <set>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// What the relay costs the machine, for the stats page: CPU time per fan-out
+// from the running thread's own clock, optional hardware counters (cycles and
+// cache misses) around each fan-out, and process wide CPU, threads and
+// resident memory read from the kernel when the stats are collected.
+//
+// A fan-out whose CPU time is close to its wall time is CPU bound; many
+// cache misses per send mean it is waiting on memory rather than computing.
+
+// CPU time the calling thread has used, in nanoseconds
+inline int64_t threadCpuNanos() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Per thread hardware counters, one perf_event group read per sample. Off
+// unless enabled before the measured threads start; a thread whose counters
+// the kernel refuses (perf_event_paranoid, no PMU in a VM) simply goes
+// without, and available() says whether any thread got them.
+class PerfCounters {
+public:
+    static void enable(bool on) {
+        enabled().store(on, std::memory_order_relaxed);
+    }
+
+    static bool available() {
+        return opened().load(std::memory_order_relaxed) > 0;
+    }
+
+    // the calling thread's counters, opened on first use; null without them
+    static PerfCounters *forThisThread() {
+        if (!enabled().load(std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        static thread_local PerfCounters counters;
+        return counters.leader >= 0 ? &counters : nullptr;
+    }
+
+    // cycles and cache misses in user space since the counters were opened
+    bool read(uint64_t &cycles, uint64_t &cache_misses) const {
+        struct {
+            uint64_t nr;
+            uint64_t values[2];
+        } group;
+        if (::read(leader, &group, sizeof(group)) != (ssize_t)sizeof(group) || group.nr != 2) {
+            return false;
+        }
+        cycles = group.values[0];
+        cache_misses = group.values[1];
+        return true;
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+private:
+    PerfCounters() {
+        leader = open(PERF_COUNT_HW_CPU_CYCLES, -1);
+        if (leader < 0) {
+            return;
+        }
+        member = open(PERF_COUNT_HW_CACHE_MISSES, leader);
+        if (member < 0) {
+            close(leader);
+            leader = -1;
+            return;
+        }
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        opened().fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ~PerfCounters() {
+        if (leader >= 0) {
+            close(member);
+            close(leader);
+        }
+    }
+
+    static int open(uint64_t config, int group) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = group < 0;  // the group starts at once when the leader is enabled
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+    }
+
+    static std::atomic<bool> &enabled() {
+        static std::atomic<bool> on{false};
+        return on;
+    }
+
+    static std::atomic<int> &opened() {
+        static std::atomic<int> count{0};
+        return count;
+    }
+
+    int leader = -1;
+    int member = -1;
+};
+
+// what one fan-out cost the thread that ran it
+struct FanoutCost {
+    int64_t wall_ns = 0;
+    int64_t cpu_ns = 0;
+    bool counted = false;  // cycles and cache_misses are valid
+    uint64_t cycles = 0;
+    uint64_t cache_misses = 0;
+};
+
+// started where a fan-out begins, stopped where it ends, on the same thread
+class FanoutTimer {
+public:
+    FanoutTimer() : perf(PerfCounters::forThisThread()) {
+        if (perf && !perf->read(cycles, cache_misses)) {
+            perf = nullptr;
+        }
+        cpu = threadCpuNanos();
+        wall = std::chrono::steady_clock::now();
+    }
+
+    FanoutCost stop() const {
+        FanoutCost cost;
+        cost.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wall).count();
+        cost.cpu_ns = threadCpuNanos() - cpu;
+        uint64_t c, m;
+        if (perf && perf->read(c, m)) {
+            cost.counted = true;
+            cost.cycles = c - cycles;
+            cost.cache_misses = m - cache_misses;
+        }
+        return cost;
+    }
+
+private:
+    const PerfCounters *perf;
+    uint64_t cycles = 0;
+    uint64_t cache_misses = 0;
+    int64_t cpu;
+    std::chrono::steady_clock::time_point wall;
+};
+
+// the lines of /proc/self/status the stats use; 0 where it cannot be read
+struct ProcStatus {
+    long threads = 0;
+    long rss_kb = 0;  // VmRSS, resident now
+    long hwm_kb = 0;  // VmHWM, peak resident
+};
+
+inline ProcStatus readProcStatus() {
+    ProcStatus status;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return status;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "Threads: %ld", &status.threads);
+        sscanf(line, "VmRSS: %ld", &status.rss_kb);
+        sscanf(line, "VmHWM: %ld", &status.hwm_kb);
+    }
+    fclose(f);
+    return status;
+}
+
+// Threads of this process, counted from /proc/self/task each time the stats
+// are collected. Every thread id seen is remembered, so seen() is the number
+// of threads created so far, short of any that came and went between two
+// samples.
+class ThreadCensus {
+public:
+    // threads running now
+    size_t sample() {
+        std::lock_guard<std::mutex> lock(mtx);
+        DIR *dir = opendir("/proc/self/task");
+        if (!dir) {
+            return 0;
+        }
+        size_t live = 0;
+        while (dirent *entry = readdir(dir)) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            live++;
+            tids.insert(atol(entry->d_name));
+        }
+        closedir(dir);
+        return live;
+    }
+
+    size_t seen() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return tids.size();
+    }
+
+private:
+    mutable std::mutex mtx;
+    std::set<long> tids;
+};
+
+// Process CPU (user + system, every thread) as a percentage of one core over
+// the time since the previous sample; over 100 when several cores are busy.
+class ProcessCpu {
+public:
+    double sample() {
+        std::lock_guard<std::mutex> lock(mtx);
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        int64_t cpu = (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+        auto now = std::chrono::steady_clock::now();
+        int64_t wall = std::chrono::duration_cast<std::chrono::microseconds>(now - last_wall).count();
+        if (last_cpu >= 0 && wall > 0) {
+            percent = 100.0 * (cpu - last_cpu) / wall;
+        }
+        last_cpu = cpu;
+        last_wall = now;
+        return percent;
+    }
+
+private:
+    std::mutex mtx;
+    int64_t last_cpu = -1;
+    std::chrono::steady_clock::time_point last_wall;
+    double percent = 0;
+};
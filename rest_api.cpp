@@ -1,52 +1,322 @@
 #include "tinyapi.h"
 #include "rest_helper.cpp"
+#include "stats.h"
 #include <csignal>
+#include <map>
 
-std::tuple<std::string, std::string> getstats(RequestContext request_context) {
-  // you can access the exact endpoint inside your defined method using the
+#define STATS_INTERVAL_MS 1000  // default for --stats-interval-ms
+#define STATS_MAX_LISTENERS 100 // listeners listed one by one, deepest queues first
+#define STATS_MAX_ROOMS 100     // rooms listed one by one, biggest first
+
+std::string formatPercentiles(const LatencyHistogram::Summary &summary) {
+  return std::to_string(summary.p50) + "/" + std::to_string(summary.p90) + "/" +
+         std::to_string(summary.p99) + "/" + std::to_string(summary.p999) + "us (" +
+         std::to_string(summary.count) + " samples)";
+}
+
+void addStat(StatsSnapshot &snapshot, const std::string &name, double value, const std::string &type, const std::string &help, bool integer = true) {
+  StatField field;
+  field.name = name;
+  field.value = value;
+  field.integer = integer;
+  field.family = "relay_" + name;
+  field.type = type;
+  field.help = help;
+  snapshot.fields.push_back(field);
+}
+
+// p50/p90/p99/p999 as name_p50_us... in JSON and one Prometheus summary
+void addLatencyStats(StatsSnapshot &snapshot, const std::string &name, const LatencyHistogram::Summary &summary, const std::string &help) {
+  const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+  const char *suffixes[] = {"p50", "p90", "p99", "p999"};
+  int64_t values[] = {summary.p50, summary.p90, summary.p99, summary.p999};
+  std::string family = "relay_" + name + "_microseconds";
+  for (int i = 0; i < 4; i++) {
+    StatField field;
+    field.name = name + "_" + suffixes[i] + "_us";
+    field.value = values[i];
+    field.family = family;
+    field.labels = std::string("quantile=\"") + quantiles[i] + "\"";
+    field.type = "summary";
+    field.help = help;
+    snapshot.fields.push_back(field);
+  }
+  StatField sum;
+  sum.name = name + "_sum_us";
+  sum.value = summary.sum;
+  sum.family = family + "_sum";
+  snapshot.fields.push_back(sum);
+  StatField count;
+  count.name = name + "_count";
+  count.value = summary.count;
+  count.family = family + "_count";
+  snapshot.fields.push_back(count);
+  addStat(snapshot, name + "_last_us", summary.last, "gauge", "Most recent " + help);
+}
+
+// per listener queue depth and drops, only for listeners that are behind or
+// have dropped something; with thousands of healthy listeners the rest are noise
+void addListenerStats(StatsSnapshot &snapshot, std::vector<ListenerQueueStats> listeners) {
+  listeners.erase(std::remove_if(listeners.begin(), listeners.end(), [](const ListenerQueueStats &l) {
+    return l.queued_messages == 0 && l.dropped == 0;
+  }), listeners.end());
+  std::sort(listeners.begin(), listeners.end(), [](const ListenerQueueStats &a, const ListenerQueueStats &b) {
+    return a.queued_bytes > b.queued_bytes;
+  });
+  if (listeners.size() > STATS_MAX_LISTENERS) {
+    listeners.resize(STATS_MAX_LISTENERS);
+  }
+  struct Column {
+    const char *name, *family, *type, *help;
+    double (*value)(const ListenerQueueStats &);
+  };
+  const Column columns[] = {
+    {"queue_messages", "relay_listener_queue_messages", "gauge", "Messages waiting in a listener's send queue.",
+     [](const ListenerQueueStats &l) { return (double)l.queued_messages; }},
+    {"queue_bytes", "relay_listener_queue_bytes", "gauge", "Bytes waiting in a listener's send queue.",
+     [](const ListenerQueueStats &l) { return (double)l.queued_bytes; }},
+    {"dropped", "relay_listener_dropped_total", "counter", "Frames dropped from a listener's full send queue.",
+     [](const ListenerQueueStats &l) { return (double)l.dropped; }},
+    {"goodput_bps", "relay_listener_goodput_bits_per_second", "gauge", "Estimated goodput of a listener's link, 0 until measured.",
+     [](const ListenerQueueStats &l) { return l.goodput_bps; }},
+  };
+  for (const Column &column : columns) {
+    for (const ListenerQueueStats &l : listeners) {
+      StatField field;
+      field.name = "listener_" + std::to_string(l.id) + "_" + column.name;
+      field.value = column.value(l);
+      field.family = column.family;
+      field.labels = "listener=\"" + std::to_string(l.id) + "\"";
+      field.type = column.type;
+      field.help = column.help;
+      snapshot.fields.push_back(field);
+    }
+  }
+}
+
+// members and throughput per room, labelled room="NAME" in Prometheus
+void addRoomStats(StatsSnapshot &snapshot, std::vector<RoomStats> room_stats) {
+  std::sort(room_stats.begin(), room_stats.end(), [](const RoomStats &a, const RoomStats &b) {
+    return a.members > b.members;
+  });
+  if (room_stats.size() > STATS_MAX_ROOMS) {
+    room_stats.resize(STATS_MAX_ROOMS);
+  }
+  struct Column {
+    const char *name, *family, *type, *help;
+    double (*value)(const RoomStats &);
+  };
+  const Column columns[] = {
+    {"members", "relay_room_members", "gauge", "Connections in a room.",
+     [](const RoomStats &r) { return (double)r.members; }},
+    {"worker", "relay_room_worker", "gauge", "Broadcast worker a room is pinned to.",
+     [](const RoomStats &r) { return (double)r.worker; }},
+    {"mixed", "relay_room_mixed", "gauge", "1 if the room mixes its speakers into one stream.",
+     [](const RoomStats &r) { return (double)r.mixed; }},
+    {"messages_in_total", "relay_room_messages_in_total", "counter", "Messages sent into a room.",
+     [](const RoomStats &r) { return (double)r.messages_in; }},
+    {"bytes_in_total", "relay_room_bytes_in_total", "counter", "Payload bytes sent into a room.",
+     [](const RoomStats &r) { return (double)r.bytes_in; }},
+    {"messages_out_total", "relay_room_messages_out_total", "counter", "Messages a room fanned out to its members.",
+     [](const RoomStats &r) { return (double)r.messages_out; }},
+    {"bytes_out_total", "relay_room_bytes_out_total", "counter", "Payload bytes a room fanned out to its members.",
+     [](const RoomStats &r) { return (double)r.bytes_out; }},
+  };
+  for (const Column &column : columns) {
+    for (const RoomStats &r : room_stats) {
+      StatField field;
+      field.name = "room_" + r.name + "_" + column.name;
+      field.value = column.value(r);
+      field.family = column.family;
+      field.labels = "room=\"" + r.name + "\"";
+      field.type = column.type;
+      field.help = column.help;
+      snapshot.fields.push_back(field);
+    }
+  }
+}
+
+// runs on the stats thread every interval, never on a request
+void collectRelayStats(StatsSnapshot &snapshot) {
   int curr_connections = getActiveConnections();
   int total_connections_opened = getTotalConnectionsOpened();
   int total_connections_closed = getTotalConnectionsClosed();
-  long last_broadcast_turn_around_time = getLastBroadcastTurnAroundTime();
-  double average_broadcast_turn_around_time = getAverageBroadcastTurnAroundTime();
+  LatencyHistogram::Summary broadcast_turn_around_time = getBroadcastTurnAroundTime();
+  LatencyHistogram::Summary send_latency = getSendLatency();
+  LatencyHistogram::Summary join_catch_up = getJoinCatchUp();
   double last_cpu_utilization_during_broadcast = getLastCpuUtilizationDuringBroadcast();
   double average_cpu_utilization_during_broadcast = getAverageCpuUtilizationDuringBroadcast();
   double last_memory_utilization_during_broadcast = getLastMemoryUtilizationDuringBroadcast();
+  double peak_memory_utilization = getPeakMemoryUtilization();
+  double process_cpu_utilization = getProcessCpuUtilization();
+  LatencyHistogram::Summary fanout_cpu_time = getFanoutCpuTime();
+  FanoutTotals fanout = getFanoutTotals();
   long total_messages_recieved = getTotalMessagesRecieved();
   long total_messages_sent = getTotalMessagesSent();
   long total_bytes_sent = getTotalBytesSent();
   long total_bytes_recieved = getTotalBytesRecieved();
-  int total_threads_created = getTotalThreadsCreated();
   int current_number_of_threads = getCurrentNumberOfThreads();
+  int total_threads_created = getTotalThreadsCreated();
+  long broadcasts_dropped = getBroadcastsDropped();
+  long send_errors = getSendErrors();
+  long listener_frames_dropped = getListenerFramesDropped();
+  long slow_listeners_evicted = getSlowListenersEvicted();
+  std::vector<ListenerQueueStats> listener_queues = getListenerQueueStats();
+  std::vector<RoomStats> room_stats = getRoomStats();
+  long mix_frames_rejected = getMixFramesRejected();
+  long mix_ticks_dropped = getMixTicksDropped();
+  long fast_starts = getFastStarts();
+  long resumes = getResumes();
+  long stream_seq_resyncs = getStreamSeqResyncs();
+  long simulcast_switches = getSimulcastSwitches();
+  long simulcast_skipped = getSimulcastSkipped();
+  long simulcast_bytes_skipped = getSimulcastBytesSkipped();
+  size_t queued_bytes = 0;
+  size_t deepest_queue = 0;
+  for (const ListenerQueueStats &l : listener_queues) {
+    queued_bytes += l.queued_bytes;
+    deepest_queue = std::max(deepest_queue, l.queued_messages);
+  }
+
+  addStat(snapshot, "connections", curr_connections, "gauge", "Open WebSocket connections.");
+  addStat(snapshot, "connections_opened_total", total_connections_opened, "counter", "Connections opened since start.");
+  addStat(snapshot, "connections_closed_total", total_connections_closed, "counter", "Connections closed since start.");
+  addLatencyStats(snapshot, "broadcast_turnaround", broadcast_turn_around_time, "time from a message arriving to it being fanned out.");
+  addLatencyStats(snapshot, "send_latency", send_latency, "time from send() to its completion callback.");
+  addStat(snapshot, "cpu_utilization_last_percent", last_cpu_utilization_during_broadcast, "gauge", "Thread CPU time over wall time of the last fan-out.", false);
+  addStat(snapshot, "cpu_utilization_average_percent", average_cpu_utilization_during_broadcast, "gauge", "Thread CPU time over wall time of all fan-outs.", false);
+  addStat(snapshot, "process_cpu_percent", process_cpu_utilization, "gauge", "Process CPU over the last stats interval, percent of one core.", false);
+  addLatencyStats(snapshot, "fanout_cpu", fanout_cpu_time, "thread CPU time of one fan-out.");
+  addStat(snapshot, "fanouts_total", fanout.fanouts, "counter", "Fan-outs measured.");
+  addStat(snapshot, "fanout_cpu_seconds_total", fanout.cpu_ns / 1e9, "counter", "Thread CPU time spent in fan-outs.", false);
+  addStat(snapshot, "perf_counters", fanout.perf_available, "gauge", "1 if fan-outs are measured with hardware counters (--perf-counters).");
+  addStat(snapshot, "fanout_cycles_total", fanout.cycles, "counter", "CPU cycles in fan-outs with hardware counters.");
+  addStat(snapshot, "fanout_cache_misses_total", fanout.cache_misses, "counter", "Cache misses in fan-outs with hardware counters.");
+  addStat(snapshot, "fanout_sends_counted_total", fanout.counted_sends, "counter", "Listener sends in fan-outs with hardware counters.");
+  addStat(snapshot, "rss_megabytes", last_memory_utilization_during_broadcast, "gauge", "Resident memory now.", false);
+  addStat(snapshot, "max_rss_megabytes", peak_memory_utilization, "gauge", "Peak resident memory.", false);
+  addStat(snapshot, "messages_received_total", total_messages_recieved, "counter", "Messages received from clients.");
+  addStat(snapshot, "messages_sent_total", total_messages_sent, "counter", "Messages queued to listeners.");
+  addStat(snapshot, "bytes_sent_total", total_bytes_sent, "counter", "Payload bytes sent to clients.");
+  addStat(snapshot, "bytes_received_total", total_bytes_recieved, "counter", "Payload bytes received from clients.");
+  addStat(snapshot, "threads_created_total", total_threads_created, "counter", "Threads seen since start, sampled from /proc/self/task.");
+  addStat(snapshot, "threads", current_number_of_threads, "gauge", "Threads running now.");
+  addStat(snapshot, "broadcasts_dropped_total", broadcasts_dropped, "counter", "Broadcasts dropped because a worker queue was full.");
+  addStat(snapshot, "send_errors_total", send_errors, "counter", "Sends that completed with an error.");
+  addStat(snapshot, "listener_frames_dropped_total", listener_frames_dropped, "counter", "Frames dropped from full listener send queues.");
+  addStat(snapshot, "slow_listeners_evicted_total", slow_listeners_evicted, "counter", "Listeners disconnected for staying behind past the grace period.");
+  addStat(snapshot, "listener_queued_bytes", queued_bytes, "gauge", "Bytes waiting in all listener send queues.");
+  addStat(snapshot, "listener_deepest_queue_messages", deepest_queue, "gauge", "Messages waiting in the deepest listener send queue.");
+  addListenerStats(snapshot, listener_queues);
+  addStat(snapshot, "rooms", room_stats.size(), "gauge", "Rooms with at least one member.");
+  addRoomStats(snapshot, room_stats);
+  addStat(snapshot, "mix_frames_rejected_total", mix_frames_rejected, "counter", "Messages in mixing rooms that were not mixable PCM.");
+  addStat(snapshot, "mix_ticks_dropped_total", mix_ticks_dropped, "counter", "Mixer ticks lost to a full worker queue.");
+  addStat(snapshot, "fast_starts_total", fast_starts, "counter", "Joiners sent an init segment and the latest cluster.");
+  addStat(snapshot, "resumes_total", resumes, "counter", "Joiners sent only the messages missed since ?resume=.");
+  addStat(snapshot, "stream_seq_resyncs_total", stream_seq_resyncs, "counter", "STREAM_SEQ messages sent so a client's count of relayed messages stays right.");
+  addStat(snapshot, "simulcast_switches_total", simulcast_switches, "counter", "Listeners moved to another simulcast layer of a sender.");
+  addStat(snapshot, "simulcast_skipped_total", simulcast_skipped, "counter", "Simulcast messages not sent to listeners on another layer.");
+  addStat(snapshot, "simulcast_bytes_skipped_total", simulcast_bytes_skipped, "counter", "Payload bytes simulcast layer selection did not send.");
+  addLatencyStats(snapshot, "join_catch_up", join_catch_up, "time from a connection opening to its catch-up being queued.");
 
   // Construct the response string
   std::string response = "";
   response += "Current Connections: " + std::to_string(curr_connections) + "\n";
   response += "Total Connections Opened: " + std::to_string(total_connections_opened) + "\n";
   response += "Total Connections Closed: " + std::to_string(total_connections_closed) + "\n";
-  response += "Last Broadcast Turn Around Time: " + std::to_string(last_broadcast_turn_around_time) + "us\n";
-  response += "Average Broadcast Turn Around Time: " + std::to_string(average_broadcast_turn_around_time) + "us\n";
+  response += "Last Broadcast Turn Around Time: " + std::to_string(broadcast_turn_around_time.last) + "us\n";
+  response += "Average Broadcast Turn Around Time: " + std::to_string(broadcast_turn_around_time.mean) + "us\n";
+  response += "Broadcast Turn Around Time p50/p90/p99/p999: " + formatPercentiles(broadcast_turn_around_time) + "\n";
+  response += "Send Completion Latency p50/p90/p99/p999: " + formatPercentiles(send_latency) + "\n";
   response += "Last CPU Utilization During Broadcast: " + std::to_string(last_cpu_utilization_during_broadcast) + "%\n";
   response += "Average CPU Utilization During Broadcast: " + std::to_string(average_cpu_utilization_during_broadcast) + "%\n";
+  response += "Process CPU Utilization: " + std::to_string(process_cpu_utilization) + "%\n";
+  response += "Fan-out CPU Time p50/p90/p99/p999: " + formatPercentiles(fanout_cpu_time) + "\n";
+  if (fanout.sends > 0) {
+    response += "Fan-out CPU per Send: " + std::to_string(fanout.cpu_ns / fanout.sends) + "ns\n";
+  }
+  if (fanout.counted > 0 && fanout.counted_sends > 0) {
+    response += "Fan-out Cycles per Send: " + std::to_string(fanout.cycles / fanout.counted_sends) +
+                ", Cache Misses per Send: " + std::to_string((double)fanout.cache_misses / fanout.counted_sends) + "\n";
+  } else {
+    response += std::string("Fan-out Hardware Counters: ") + (fanout.perf_available ? "no samples yet" : "off") + "\n";
+  }
   response += "Last Memory Utilization During Broadcast: " + std::to_string(last_memory_utilization_during_broadcast) + "MB\n";
+  response += "Peak Memory Utilization: " + std::to_string(peak_memory_utilization) + "MB\n";
   response += "Total Messages Recieved: " + std::to_string(total_messages_recieved) + "\n";
   response += "Total Messages Sent: " + std::to_string(total_messages_sent) + "\n";
   response += "Total Bytes Sent: " + std::to_string(total_bytes_sent) + " bytes\n";
   response += "Total Bytes Recieved: " + std::to_string(total_bytes_recieved) + " bytes\n";
   response += "Total Threads Created: " + std::to_string(total_threads_created) + "\n";
   response += "Current Number of Threads: " + std::to_string(current_number_of_threads) + "\n";
+  response += "Broadcasts Dropped (queue full): " + std::to_string(broadcasts_dropped) + "\n";
+  response += "Send Errors: " + std::to_string(send_errors) + "\n";
+  response += "Listener Frames Dropped (queue full): " + std::to_string(listener_frames_dropped) + "\n";
+  response += "Slow Listeners Evicted: " + std::to_string(slow_listeners_evicted) + "\n";
+  response += "Listener Queued Bytes: " + std::to_string(queued_bytes) + " bytes\n";
+  response += "Deepest Listener Queue: " + std::to_string(deepest_queue) + " messages\n";
+  response += "Rooms: " + std::to_string(room_stats.size()) + "\n";
+  response += "Mix Frames Rejected: " + std::to_string(mix_frames_rejected) + "\n";
+  response += "Mix Ticks Dropped: " + std::to_string(mix_ticks_dropped) + "\n";
+  response += "Fast Starts: " + std::to_string(fast_starts) + ", Resumes: " + std::to_string(resumes) +
+              ", Sequence Resyncs: " + std::to_string(stream_seq_resyncs) + "\n";
+  response += "Simulcast Layer Switches: " + std::to_string(simulcast_switches) + ", Skipped: " + std::to_string(simulcast_skipped) +
+              " messages / " + std::to_string(simulcast_bytes_skipped) + " bytes\n";
+  response += "Join Catch-up Time p50/p90/p99/p999: " + formatPercentiles(join_catch_up) + "\n";
+  for (size_t i = 0; i < room_stats.size() && i < STATS_MAX_ROOMS; i++) {
+    const RoomStats &r = room_stats[i];
+    response += "  " + r.name + ": " + std::to_string(r.members) + (r.mixed ? " members (mixed)" : " members") + ", worker " + std::to_string(r.worker) +
+                ", " + std::to_string(r.messages_in) + " in / " + std::to_string(r.messages_out) + " out, " +
+                std::to_string(r.bytes_out) + " bytes out\n";
+  }
+  snapshot.text = response;
+}
 
+StatsPublisher *stats_publisher;
 
+std::tuple<std::string, std::string> getstats(const RequestTarget & /*target*/) {
+  std::tuple<std::string, std::string> result(stats_publisher->load()->text, "text/html");
+  return result;
+}
 
-//   create a std::tuple<std::string, std::string> and return it
-    std::tuple<std::string, std::string> result(response, "text/html");
+// /stats?fields=messages_sent_total,send_latency_p99_us returns just those keys
+std::tuple<std::string, std::string> getJsonStats(const RequestTarget &target) {
+  std::set<std::string> fields = parseStatFields(target.query);
+  std::tuple<std::string, std::string> result(stats_publisher->load()->selectJson(fields), "application/json");
   return result;
 }
 
-int initTinyAPI() {
+std::tuple<std::string, std::string> getPrometheusMetrics(const RequestTarget & /*target*/) {
+  std::tuple<std::string, std::string> result(stats_publisher->load()->prometheus, "text/plain; version=0.0.4");
+  return result;
+}
+
+typedef std::tuple<std::string, std::string> (*StatsHandler)(const RequestTarget &);
+std::map<std::string, StatsHandler> stats_routes = {
+  {"/", getstats},
+  {"/stats", getJsonStats},
+  {"/metrics", getPrometheusMetrics},
+};
+
+// Every stats route goes through here. The endpoint is the whole request
+// target; it is split into path and query first and only the path picks the
+// handler, so /stats?fields=a reaches /stats and a query never selects a route.
+std::tuple<std::string, std::string> routeStats(RequestContext request_context) {
+  RequestTarget target = splitRequestTarget(request_context.endpoint);
+  auto route = stats_routes.find(target.path);
+  if (route == stats_routes.end()) {
+    std::tuple<std::string, std::string> result("Not found\n", "text/plain");
+    return result;
+  }
+  return route->second(target);
+}
+
+int initTinyAPI(int stats_interval_ms) {
   // Quickly setting up a basic (HTTP/1.1) REST Api at device's localhost
   const int TinyAPIPort = 8000;
   std::cout << "Initializing TinyAPI on port " << TinyAPIPort << std::endl;
+  stats_publisher = new StatsPublisher(collectRelayStats, stats_interval_ms);
   std::string localhost = "127.0.0.1";
   size_t timeout = 1450000; // 14.5s
   TinyAPI *new_api =
@@ -56,7 +326,9 @@ int initTinyAPI() {
   }
 
   // Easy Routing
-  new_api->getMethods["/"] = getstats;
+  for (const auto &route : stats_routes) {
+    new_api->getMethods[route.first] = routeStats;
+  }
 
   // Start the server
   new_api->enable_listener();
@@ -70,4 +342,4 @@ int initTinyAPI() {
     });
   delete new_api;
   return 0;
-}
\ No newline at end of file
+}
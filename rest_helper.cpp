@@ -1,164 +1,299 @@
 
 #include <set>
-#include <mutex>
 #include "server_ws.hpp"
 #include <sys/resource.h>
+#include <chrono>
+#include "snapshot.h"
+#include "metrics.h"
+#include "listener_queue.h"
+#include "rooms.h"
+#include "simulcast.h"
+#include "webm.h"
+#include "resources.h"
+
+using RelayListenerQueue = ListenerQueue<SimpleWeb::SocketServer<SimpleWeb::WS>>;
+
+// one connected client and the bounded queue its broadcasts go through;
+// ordered by connection so a bare connection finds it in the set
+struct Listener {
+    std::shared_ptr<SimpleWeb::SocketServer<SimpleWeb::WS>::Connection> connection;
+    std::shared_ptr<RelayListenerQueue> queue;
+    std::shared_ptr<SimulcastSubscriber> simulcast;  // its layer per sender, only its room's worker touches it
+    std::shared_ptr<StreamCursor> cursor;  // relayed rooms: the sequence number its client has, also the worker's
+
+    bool operator<(const Listener &other) const {
+        return connection < other.connection;
+    }
+};
+
+extern SnapshotSet<Listener> connections;
+
+using RelayRoom = Room<Listener>;
+extern RoomRegistry<Listener> rooms;
 
 struct BinaryDataQueueItem {
     std::shared_ptr<SimpleWeb::SocketServer<SimpleWeb::WS>::OutMessage> data;
     std::shared_ptr<SimpleWeb::SocketServer<SimpleWeb::WS>::Connection> connection;
+    std::shared_ptr<RelayRoom> room;  // fanned out to this room's members only
     bool include_self;
     unsigned char opcode;
+    std::chrono::high_resolution_clock::time_point received;
+    size_t bytes;  // payload length, measured once when the message arrives
+    std::string pcm;   // mixing rooms: the speaker's wsframe message instead of data
+    bool tick = false; // mixing rooms: no message, time to mix the next frame
+    std::shared_ptr<RelayListenerQueue> joiner;  // no message, send this new listener the catch-up
+    std::shared_ptr<StreamCursor> cursor;  // the joiner's
+    std::shared_ptr<SimulcastSubscriber> subscriber;  // the joiner's
+    bool left = false;  // relayed rooms: no message, connection has gone and its history state with it
+    int64_t resume = -1;  // the joiner's ?resume= sequence number
+    bool layered = false;   // data is one simulcast layer, header already stripped
+    SimulcastHeader layer;
 };
 
-extern std::mutex connections_mtx;
-extern std::set<std::shared_ptr<SimpleWeb::SocketServer<SimpleWeb::WS>::Connection>> connections;
+// Everything the stats page reports. The hot paths record into sharded
+// counters and histograms (metrics.h), so nothing here takes a lock.
+struct RelayMetrics {
+    ShardedCounter connections_opened;
+    ShardedCounter connections_closed;
+    ShardedCounter messages_received;
+    ShardedCounter messages_sent;
+    ShardedCounter bytes_received;   // payload bytes
+    ShardedCounter bytes_sent;
+    ShardedCounter broadcasts_dropped;
+    ShardedCounter send_errors;
+    ShardedCounter listener_frames_dropped;  // oldest frames dropped from full listener queues
+    ShardedCounter slow_listeners_evicted;
+    ShardedCounter mix_frames_rejected;  // messages in mixing rooms that were not mixable PCM
+    ShardedCounter mix_ticks_dropped;    // mixer ticks lost to a full worker queue
+    ShardedCounter fast_starts;  // joiners sent an init segment and the latest cluster
+    ShardedCounter resumes;      // joiners sent just what they missed since ?resume=
+    ShardedCounter stream_seq_resyncs;  // "STREAM_SEQ n" sent ahead of a message so a client's count stays right
+    ShardedCounter simulcast_switches;       // listeners moved to another layer of a sender
+    ShardedCounter simulcast_skipped;        // layer messages not sent to a listener on a different layer
+    ShardedCounter simulcast_bytes_skipped;
+    LatencyHistogram broadcast_turnaround;  // us, message received to fanned out
+    LatencyHistogram send_latency;          // us, send() to its completion callback
+    LatencyHistogram join_catch_up;         // us, connection opened to its catch-up queued
+    // what fan-outs cost the worker threads running them (resources.h)
+    LatencyHistogram fanout_cpu;                   // us of thread CPU per fan-out
+    Gauge last_fanout_cpu_basis_points;            // CPU / wall of the last fan-out, in 1/100 %
+    ShardedCounter fanouts;
+    ShardedCounter fanout_sends;
+    ShardedCounter fanout_cpu_ns;
+    ShardedCounter fanout_wall_ns;
+    ShardedCounter fanouts_counted;                // fan-outs with hardware counters
+    ShardedCounter fanout_sends_counted;
+    ShardedCounter fanout_cycles;
+    ShardedCounter fanout_cache_misses;
+    // sampled from the kernel when the stats are collected
+    ThreadCensus threads;
+    ProcessCpu process_cpu;
+};
 
-extern std::mutex connections_open_mtx;
-extern int connections_open;
+extern RelayMetrics relay_metrics;
 
-extern std::mutex connections_closed_mtx;
-extern int connections_closed;
 
-extern std::mutex last_broadcast_turn_around_time_mtx;
-extern long last_broadcast_turn_around_time;
+int getActiveConnections() {
+    // size of the current snapshot, no lock needed
+    return connections.size();
+}
 
-extern std::mutex total_broadcast_turn_around_time_mtx;
-extern long total_broadcast_turn_around_time;
+int getTotalConnectionsOpened() {
+    return relay_metrics.connections_opened.value();
+}
 
-extern std::mutex count_broadcast_turn_around_time_mtx;
-extern long count_broadcast_turn_around_time;
+int getTotalConnectionsClosed() {
+    return relay_metrics.connections_closed.value();
+}
 
-extern std::mutex average_broadcast_turn_around_time_mtx;
-extern double average_broadcast_turn_around_time;
+LatencyHistogram::Summary getBroadcastTurnAroundTime() {
+    return relay_metrics.broadcast_turnaround.summary();
+}
 
-extern std::mutex last_cpu_utilization_during_broadcast_mtx;
-extern double last_cpu_utilization_during_broadcast;
+LatencyHistogram::Summary getSendLatency() {
+    return relay_metrics.send_latency.summary();
+}
 
-extern std::mutex average_cpu_utilization_during_broadcast_mtx;
-extern double average_cpu_utilization_during_broadcast;
+LatencyHistogram::Summary getJoinCatchUp() {
+    return relay_metrics.join_catch_up.summary();
+}
 
-extern std::mutex last_memory_utilization_during_broadcast_mtx;
-extern double last_memory_utilization_during_broadcast;
+// one fan-out's cost on the worker that ran it; sends is how many listeners it reached
+void recordFanoutCost(const FanoutCost &cost, int64_t sends) {
+    relay_metrics.fanout_cpu.record(cost.cpu_ns / 1000);
+    if (cost.wall_ns > 0) {
+        relay_metrics.last_fanout_cpu_basis_points.set(cost.cpu_ns * 10000 / cost.wall_ns);
+    }
+    relay_metrics.fanouts.add();
+    relay_metrics.fanout_sends.add(sends);
+    relay_metrics.fanout_cpu_ns.add(cost.cpu_ns);
+    relay_metrics.fanout_wall_ns.add(cost.wall_ns);
+    if (cost.counted) {
+        relay_metrics.fanouts_counted.add();
+        relay_metrics.fanout_sends_counted.add(sends);
+        relay_metrics.fanout_cycles.add(cost.cycles);
+        relay_metrics.fanout_cache_misses.add(cost.cache_misses);
+    }
+}
 
-extern std::mutex average_memory_utilization_during_broadcast_mtx;
-extern double average_memory_utilization_during_broadcast;
+// thread CPU time over wall time of the last fan-out, in percent
+double getLastCpuUtilizationDuringBroadcast() {
+    return relay_metrics.last_fanout_cpu_basis_points.get() / 100.0;
+}
 
-extern std::mutex total_messages_recieved_mtx;
-extern long total_messages_recieved;
+// the same over every fan-out so far
+double getAverageCpuUtilizationDuringBroadcast() {
+    int64_t wall = relay_metrics.fanout_wall_ns.value();
+    return wall > 0 ? 100.0 * relay_metrics.fanout_cpu_ns.value() / wall : 0;
+}
 
-extern std::mutex total_messages_sent_mtx;
-extern long total_messages_sent;
+LatencyHistogram::Summary getFanoutCpuTime() {
+    return relay_metrics.fanout_cpu.summary();
+}
 
-extern std::mutex total_bytes_sent_mtx;
-extern long total_bytes_sent;
+// totals over the fan-outs measured so far
+struct FanoutTotals {
+    long fanouts, sends, cpu_ns;
+    long counted, counted_sends, cycles, cache_misses;
+    bool perf_available;
+};
 
-extern std::mutex total_bytes_recieved_mtx;
-extern long total_bytes_recieved;
+FanoutTotals getFanoutTotals() {
+    FanoutTotals totals;
+    totals.fanouts = relay_metrics.fanouts.value();
+    totals.sends = relay_metrics.fanout_sends.value();
+    totals.cpu_ns = relay_metrics.fanout_cpu_ns.value();
+    totals.counted = relay_metrics.fanouts_counted.value();
+    totals.counted_sends = relay_metrics.fanout_sends_counted.value();
+    totals.cycles = relay_metrics.fanout_cycles.value();
+    totals.cache_misses = relay_metrics.fanout_cache_misses.value();
+    totals.perf_available = PerfCounters::available();
+    return totals;
+}
 
-extern std::mutex total_threads_created_mtx;
-extern int total_threads_created;
+// user + system CPU of the whole process since the previous call, in
+// percent of one core
+double getProcessCpuUtilization() {
+    return relay_metrics.process_cpu.sample();
+}
 
-extern std::mutex current_number_of_threads_mtx;
-extern int current_number_of_threads;
+// resident memory now, from /proc/self/status
+double getLastMemoryUtilizationDuringBroadcast() {
+    return readProcStatus().rss_kb / 1024.0; // Convert to MB
+}
 
+double getPeakMemoryUtilization() {
+    return readProcStatus().hwm_kb / 1024.0;
+}
 
-int getActiveConnections() {
-    // get global variable connections, engage lock and return its size
-    {
-        std::lock_guard<std::mutex> lock(connections_mtx);
-        return connections.size();
-    }
+long getTotalMessagesRecieved() {
+    return relay_metrics.messages_received.value();
 }
 
-int getTotalConnectionsOpened() {
-    {
-        std::lock_guard<std::mutex> lock(connections_open_mtx);
-        return connections_open;
-    }
+long getTotalMessagesSent() {
+    return relay_metrics.messages_sent.value();
 }
 
-int getTotalConnectionsClosed() {
-    {
-        std::lock_guard<std::mutex> lock(connections_closed_mtx);
-        return connections_closed;
-    }
+long getTotalBytesSent() {
+    return relay_metrics.bytes_sent.value();
 }
 
-long getLastBroadcastTurnAroundTime() {
-    {
-        std::lock_guard<std::mutex> lock(last_broadcast_turn_around_time_mtx);
-        return last_broadcast_turn_around_time;
-    }
+long getTotalBytesRecieved() {
+    return relay_metrics.bytes_received.value();
 }
 
-double getAverageBroadcastTurnAroundTime() {
-    {
-        std::lock_guard<std::mutex> lock(total_broadcast_turn_around_time_mtx);
-        std::lock_guard<std::mutex> lock2(count_broadcast_turn_around_time_mtx);
-        if(count_broadcast_turn_around_time == 0) return 0;
-        return static_cast<double>(total_broadcast_turn_around_time) / count_broadcast_turn_around_time;
-    }
+// thread ids seen in /proc/self/task so far; call getCurrentNumberOfThreads first
+int getTotalThreadsCreated() {
+    return relay_metrics.threads.seen();
 }
 
-double getLastCpuUtilizationDuringBroadcast() {
-    {
-        std::lock_guard<std::mutex> lock(last_cpu_utilization_during_broadcast_mtx);
-        return last_cpu_utilization_during_broadcast;
-    }
+int getCurrentNumberOfThreads() {
+    return relay_metrics.threads.sample();
 }
 
-double getAverageCpuUtilizationDuringBroadcast() {
-    {
-        std::lock_guard<std::mutex> lock(average_cpu_utilization_during_broadcast_mtx);
-        return average_cpu_utilization_during_broadcast;
-    }
+long getBroadcastsDropped() {
+    return relay_metrics.broadcasts_dropped.value();
 }
 
-double getLastMemoryUtilizationDuringBroadcast() {
-    struct rusage usage;
-    getrusage(RUSAGE_SELF, &usage);
-    return static_cast<double>(usage.ru_maxrss)/1024; // Convert to MB
+long getSendErrors() {
+    return relay_metrics.send_errors.value();
 }
 
-long getTotalMessagesRecieved() {
-    {
-        std::lock_guard<std::mutex> lock(total_messages_recieved_mtx);
-        return total_messages_recieved;
-    }
+long getListenerFramesDropped() {
+    return relay_metrics.listener_frames_dropped.value();
 }
 
-long getTotalMessagesSent() {
-    {
-        std::lock_guard<std::mutex> lock(total_messages_sent_mtx);
-        return total_messages_sent;
+struct RoomStats {
+    std::string name;
+    size_t worker;
+    size_t members;
+    bool mixed;
+    long messages_in, bytes_in, messages_out, bytes_out;
+};
+
+std::vector<RoomStats> getRoomStats() {
+    std::vector<RoomStats> out;
+    std::shared_ptr<const RoomRegistry<Listener>::Map> map = rooms.load();
+    out.reserve(map->size());
+    for (const auto &entry : *map) {
+        const RelayRoom &room = *entry.second;
+        RoomStats stats;
+        stats.name = room.name;
+        stats.worker = room.worker;
+        stats.members = room.members.size();
+        stats.mixed = room.mixer != nullptr;
+        stats.messages_in = room.messages_in.load(std::memory_order_relaxed);
+        stats.bytes_in = room.bytes_in.load(std::memory_order_relaxed);
+        stats.messages_out = room.messages_out.load(std::memory_order_relaxed);
+        stats.bytes_out = room.bytes_out.load(std::memory_order_relaxed);
+        out.push_back(stats);
     }
+    return out;
 }
 
-long getTotalBytesSent() {
-    {
-        std::lock_guard<std::mutex> lock(total_bytes_sent_mtx);
-        return total_bytes_sent;
-    }
+long getMixFramesRejected() {
+    return relay_metrics.mix_frames_rejected.value();
 }
 
-long getTotalBytesRecieved() {
-    {
-        std::lock_guard<std::mutex> lock(total_bytes_recieved_mtx);
-        return total_bytes_recieved;
-    }
+long getMixTicksDropped() {
+    return relay_metrics.mix_ticks_dropped.value();
 }
 
-int getTotalThreadsCreated() {
-    {
-        std::lock_guard<std::mutex> lock(total_threads_created_mtx);
-        return total_threads_created;
-    }
+long getFastStarts() {
+    return relay_metrics.fast_starts.value();
 }
 
-int getCurrentNumberOfThreads() {
-    {
-        std::lock_guard<std::mutex> lock(current_number_of_threads_mtx);
-        return current_number_of_threads;
+long getResumes() {
+    return relay_metrics.resumes.value();
+}
+
+long getStreamSeqResyncs() {
+    return relay_metrics.stream_seq_resyncs.value();
+}
+
+long getSimulcastSwitches() {
+    return relay_metrics.simulcast_switches.value();
+}
+
+long getSimulcastSkipped() {
+    return relay_metrics.simulcast_skipped.value();
+}
+
+long getSimulcastBytesSkipped() {
+    return relay_metrics.simulcast_bytes_skipped.value();
+}
+
+long getSlowListenersEvicted() {
+    return relay_metrics.slow_listeners_evicted.value();
+}
+
+// every listener's queue, read under each queue's own lock
+std::vector<ListenerQueueStats> getListenerQueueStats() {
+    std::vector<ListenerQueueStats> out;
+    std::shared_ptr<const std::vector<Listener>> listeners = connections.load();
+    out.reserve(listeners->size());
+    for (const Listener &listener : *listeners) {
+        out.push_back(listener.queue->stats());
     }
+    return out;
 }
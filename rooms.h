@@ -0,0 +1,188 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "snapshot.h"
+
+// Rooms for the relay: a message is fanned out to the members of the room it
+// was sent in, not to every connection, so the cost of a message follows the
+// size of its room. Each room is pinned to one broadcast worker when it is
+// created (the one with the fewest rooms), so its messages stay in order and
+// rooms on different workers never touch the same queue or member set.
+//
+// The name -> room map is published like SnapshotSet: joins and leaves
+// rebuild it under a mutex and bump a version, and find() keeps the map it
+// last loaded per thread, going back to the shared pointer only when the
+// version has moved.
+
+class AudioMixer;     // mixer.h
+class StreamHistory;  // webm.h
+class SimulcastRoom;  // simulcast.h
+
+template <typename Member>
+struct Room : std::enable_shared_from_this<Room<Member>> {
+    std::string name;
+    size_t worker = 0;
+    SnapshotSet<Member> members;
+    std::shared_ptr<AudioMixer> mixer;  // set in mixing rooms only; the room's worker owns it
+    std::shared_ptr<StreamHistory> history;  // relayed rooms: catch-up for joiners, also the worker's
+    std::shared_ptr<SimulcastRoom> simulcast;  // relayed rooms: senders' layers, also the worker's
+
+    // throughput; written by io threads (in) and the room's worker (out)
+    std::atomic<long> messages_in{0};
+    std::atomic<long> bytes_in{0};
+    std::atomic<long> messages_out{0};
+    std::atomic<long> bytes_out{0};
+
+    ~Room() {
+        destroyed.fetch_add(1, std::memory_order_release);
+    }
+
+    // rooms of this kind destroyed so far, how roomMembers notices that some
+    // of its Readers can go without checking them all on every call
+    static inline std::atomic<uint64_t> destroyed{0};
+};
+
+template <typename Member>
+class RoomRegistry {
+public:
+    using RoomPtr = std::shared_ptr<Room<Member>>;
+    using Map = std::map<std::string, RoomPtr>;
+
+    explicit RoomRegistry(size_t workers = 1) : current(std::make_shared<const Map>()), rooms_per_worker(std::max<size_t>(1, workers), 0) {}
+
+    RoomRegistry(const RoomRegistry &) = delete;
+    RoomRegistry &operator=(const RoomRegistry &) = delete;
+
+    // before any join; rooms are spread over this many workers
+    void setWorkers(size_t workers) {
+        std::lock_guard<std::mutex> lock(writer_mtx);
+        rooms_per_worker.assign(std::max<size_t>(1, workers), 0);
+    }
+
+    // adds member to the named room, creating it if this is its first member;
+    // init sees a new room before anyone else can
+    RoomPtr join(const std::string &name, const Member &member, const std::function<void(Room<Member> &)> &init = nullptr) {
+        std::lock_guard<std::mutex> lock(writer_mtx);
+        std::shared_ptr<const Map> map = load();
+        auto it = map->find(name);
+        RoomPtr room;
+        if (it != map->end()) {
+            room = it->second;
+        } else {
+            room = std::make_shared<Room<Member>>();
+            room->name = name;
+            room->worker = 0;
+            for (size_t w = 1; w < rooms_per_worker.size(); w++) {
+                if (rooms_per_worker[w] < rooms_per_worker[room->worker]) {
+                    room->worker = w;
+                }
+            }
+            rooms_per_worker[room->worker]++;
+            if (init) {
+                init(*room);
+            }
+            std::shared_ptr<Map> next = std::make_shared<Map>(*map);
+            (*next)[name] = room;
+            publish(std::move(next));
+        }
+        room->members.insert(member);
+        return room;
+    }
+
+    // removes member; the room goes away with its last member. Messages
+    // already queued for it still hold the room and finish normally.
+    void leave(const std::string &name, const Member &member) {
+        std::lock_guard<std::mutex> lock(writer_mtx);
+        std::shared_ptr<const Map> map = load();
+        auto it = map->find(name);
+        if (it == map->end()) {
+            return;
+        }
+        RoomPtr room = it->second;
+        room->members.erase(member);
+        if (room->members.size() == 0) {
+            rooms_per_worker[room->worker]--;
+            std::shared_ptr<Map> next = std::make_shared<Map>(*map);
+            next->erase(name);
+            publish(std::move(next));
+        }
+    }
+
+    // nullptr if nobody is in the room; any thread, without a lock between
+    // joins and leaves
+    RoomPtr find(const std::string &name) const {
+        struct Cached {
+            const RoomRegistry *registry = nullptr;
+            uint64_t version = 0;
+            std::shared_ptr<const Map> map;
+        };
+        static thread_local Cached cached;
+        uint64_t seen = version.load(std::memory_order_acquire);
+        if (cached.registry != this || cached.version != seen) {
+            // published before the version moved, so at least as new as seen
+            cached.map = load();
+            cached.registry = this;
+            cached.version = seen;
+        }
+        auto it = cached.map->find(name);
+        return it == cached.map->end() ? nullptr : it->second;
+    }
+
+    std::shared_ptr<const Map> load() const {
+        return std::atomic_load_explicit(&current, std::memory_order_acquire);
+    }
+
+private:
+    // writer_mtx held
+    void publish(std::shared_ptr<const Map> next) {
+        std::atomic_store_explicit(&current, std::move(next), std::memory_order_release);
+        version.fetch_add(1, std::memory_order_release);
+    }
+
+    std::mutex writer_mtx;
+    std::shared_ptr<const Map> current;
+    std::atomic<uint64_t> version{1};
+    std::vector<size_t> rooms_per_worker;
+};
+
+// The calling thread's view of room's members for a fan-out. Each thread
+// keeps a SnapshotSet Reader per room it fans out to, so between membership
+// changes this is one acquire load rather than an atomic_load of the shared
+// pointer. The Readers do not keep their rooms alive: once any room has been
+// destroyed, the thread's next call drops the Readers (and the member
+// snapshots they hold) of the rooms that are gone.
+// The reference is good until the thread's next call for the same room.
+template <typename Member>
+const std::vector<Member> &roomMembers(Room<Member> &room) {
+    struct Cached {
+        std::weak_ptr<Room<Member>> room;
+        typename SnapshotSet<Member>::Reader reader;
+    };
+    static thread_local std::map<const Room<Member> *, Cached> readers;
+    static thread_local uint64_t seen_destroyed = 0;
+    uint64_t destroyed = Room<Member>::destroyed.load(std::memory_order_acquire);
+    if (destroyed != seen_destroyed) {
+        seen_destroyed = destroyed;
+        for (auto old = readers.begin(); old != readers.end();) {
+            old = old->second.room.expired() ? readers.erase(old) : std::next(old);
+        }
+    }
+    auto it = readers.find(&room);
+    // an expired entry here is a dead room whose address the new one reuses
+    if (it != readers.end() && it->second.room.expired()) {
+        readers.erase(it);
+        it = readers.end();
+    }
+    if (it == readers.end()) {
+        it = readers.emplace(&room, Cached{room.weak_from_this(), typename SnapshotSet<Member>::Reader(room.members)}).first;
+    }
+    return it->second.reader.get();
+}
@@ -0,0 +1,157 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include "dgram.h"
+#include "congestion.h"
+
+// Sender side view of a transfer driven by the receiver's selective ACKs.
+// Every chunk id is unsent, in flight, acknowledged or known lost. Losses are
+// detected RACK style: a packet still in flight that was sent noticeably
+// earlier than one the receiver has already acknowledged is declared lost and
+// queued for retransmission ahead of fresh data, so holes get filled while new
+// data keeps flowing.
+
+#define SACK_UNSENT 0
+#define SACK_INFLIGHT 1
+#define SACK_ACKED 2
+#define SACK_LOST 3
+
+struct SackScoreboard {
+    std::vector<uint8_t> state;
+    std::vector<uint8_t> retransmitted;  // Karn: no RTT samples from these
+    std::vector<cc_time> sent_at;
+    std::deque<int> lost;                // ids waiting to be resent, oldest first
+    int next_fresh = 0;                  // next id that has never been sent
+    int cumulative = 0;                  // first id not yet acknowledged
+    int inflight = 0;
+    long retransmissions = 0;
+    int fec_k = 0;                       // chunks per FEC group, 0 without FEC
+
+    explicit SackScoreboard(size_t chunks)
+        : state(chunks, SACK_UNSENT), retransmitted(chunks, 0), sent_at(chunks) {}
+
+    int size() const {
+        return (int)state.size();
+    }
+
+    bool done() const {
+        return cumulative >= size();
+    }
+
+    bool allSent() const {
+        return next_fresh >= size();
+    }
+
+    // next id to put on the wire: holes first, then fresh data, -1 if neither
+    int next() {
+        while (!lost.empty()) {
+            int id = lost.front();
+            lost.pop_front();
+            if (state[id] == SACK_LOST) {
+                return id;
+            }
+        }
+        if (next_fresh < size()) {
+            return next_fresh++;
+        }
+        return -1;
+    }
+
+    void onSent(int id) {
+        if (state[id] == SACK_LOST) {
+            retransmitted[id] = 1;
+            retransmissions++;
+        }
+        state[id] = SACK_INFLIGHT;
+        sent_at[id] = ccNow();
+        inflight++;
+    }
+
+    // returns the number of chunks newly acknowledged by this ACK. The ACK
+    // comes off the wire: a cumulative point outside the transfer is ignored
+    // rather than trusted to index the scoreboard.
+    int onAck(const ackgram &ack, CongestionController &cc) {
+        if (ack.cumulative < 0 || ack.cumulative > size()) {
+            cc.onAck(0);
+            return 0;
+        }
+        int newly_acked = 0;
+        int newest_id = -1;
+        auto markAcked = [&](int id) {
+            if (state[id] == SACK_ACKED || state[id] == SACK_UNSENT) {
+                return;
+            }
+            if (state[id] == SACK_INFLIGHT) {
+                inflight--;
+            }
+            state[id] = SACK_ACKED;
+            newly_acked++;
+            if (newest_id < 0 || sent_at[id] > sent_at[newest_id]) {
+                newest_id = id;
+            }
+        };
+
+        int ack_cumulative = (int)ack.cumulative;
+        for (int id = cumulative; id < ack_cumulative; id++) {
+            markAcked(id);
+        }
+        for (int i = 0; i < SACK_BITS; i++) {
+            // ack_cumulative is within [0, size()], so this cannot overflow
+            int64_t id = (int64_t)ack_cumulative + 1 + i;
+            if (id < 0 || id >= size()) {
+                break;
+            }
+            if (ack.bitmap[i / 64] & (1ULL << (i % 64))) {
+                markAcked(id);
+            }
+        }
+        while (cumulative < size() && state[cumulative] == SACK_ACKED) {
+            cumulative++;
+        }
+        if (newest_id < 0) {
+            cc.onAck(0);
+            return 0;
+        }
+
+        if (!retransmitted[newest_id]) {
+            cc.onRttSample(std::chrono::duration<double, std::micro>(ccNow() - sent_at[newest_id]).count());
+        }
+
+        // anything the receiver has had a chance to report on, sent before the
+        // newest acknowledged packet by more than the reordering window, is gone
+        auto reorder_window = std::chrono::microseconds((long)(cc.srtt_us / 4));
+        cc_time horizon = sent_at[newest_id] - reorder_window;
+        int scan_end = (int)std::min<int64_t>(next_fresh, (int64_t)ack_cumulative + 1 + SACK_BITS);
+        int highest_lost = -1;
+        // with FEC a hole is only given up on once the receiver has had the
+        // group's parity, i.e. something from a later group was acknowledged;
+        // once everything is out the tail is judged as without FEC
+        if (fec_k > 0 && !allSent()) {
+            scan_end = std::min(scan_end, newest_id / fec_k * fec_k);
+        }
+        for (int id = cumulative; id < scan_end; id++) {
+            if (state[id] == SACK_INFLIGHT && sent_at[id] < horizon) {
+                state[id] = SACK_LOST;
+                inflight--;
+                lost.push_back(id);
+                highest_lost = id;
+            }
+        }
+        cc.onAck(newly_acked);
+        if (highest_lost >= 0) {
+            cc.onLoss(highest_lost, next_fresh);
+        }
+        return newly_acked;
+    }
+
+    // retransmission timeout: nothing in flight can be trusted any more
+    void onTimeout() {
+        for (int id = cumulative; id < next_fresh; id++) {
+            if (state[id] == SACK_INFLIGHT) {
+                state[id] = SACK_LOST;
+                lost.push_back(id);
+            }
+        }
+        inflight = 0;
+    }
+};
@@ -1,29 +1,36 @@
 #include "server_ws.hpp"
 #include <future>
 #include <pthread.h>
+#include "tinyapi.h"
 #include "audio.h"
+#include "chunk_source.h"
+#include "wsframe.h"
+#include "frame_cache.h"
 
 using namespace SimpleWeb;
 using namespace std;
 using WsServer = SimpleWeb::SocketServer<SimpleWeb::WS>;
 
-std::vector<int32_t> getAllAudio(std::ifstream& file)
+#define AUDIO_FILE "SampleWav.wav"
+#define TEXT_SAMPLES_PER_MESSAGE 256
+#define STATS_PORT 8001
+
+// every stream is encoded once, whichever connection asks first
+FrameCache frame_cache;
+
+// every sample of the file in the canonical int32 form (see convert.h), so a
+// 16 bit or float file goes out as samples rather than as its raw bytes
+std::vector<int32_t> getAllAudio(const ChunkSource &source)
 {
     std::cout << "Audio processing started. Really..." << "\n";
-    
-    file.seekg(0, std::ios::end);
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
 
-    std::size_t numelements = size / sizeof(int32_t);
-    std::vector<int32_t> audioData(numelements);
-
-    if ( !file.read(reinterpret_cast<char*>(audioData.data()), size) )
-    {
-        std::cerr << "Error reading WAV data." << "\n";
+    int format = sampleFormat(source.header());
+    if (format == SAMPLE_UNSUPPORTED) {
+        std::cerr << "Unsupported WAV sample format." << "\n";
         return {};
     }
-
+    std::vector<int32_t> audioData(source.dataSize() / sampleWidth(format));
+    toCanonical(source.samples(), format, audioData.size(), audioData.data());
     return audioData;
 }
 
@@ -39,7 +46,8 @@ string audioDataToString(const int32_t* audioData, size_t size = 256) {
     return dataString;
 }
 
-int sendData(shared_ptr<WsServer::Connection> connection, string data){
+// fin_rsv_opcode 129 sends a text frame, 130 a binary one
+int sendData(shared_ptr<WsServer::Connection> connection, const string &data, unsigned char fin_rsv_opcode = 129){
     // std::cout << "Sending using sendPacket " << std::endl;
     connection->send(data, [](const SimpleWeb::error_code &ec) {
         if(ec) {
@@ -48,61 +56,158 @@ int sendData(shared_ptr<WsServer::Connection> connection, string data){
                 "Error: " << ec << ", error message: " << ec.message() << std::endl;
         }
     std::this_thread::sleep_for(std::chrono::milliseconds(2));
-  });
+  }, fin_rsv_opcode);
   return sizeof(data);
 }
 
-int sendFile(shared_ptr<WsServer::Connection> connection){
-    std::ifstream file = getFile();
+// the text mode: canonical samples as comma separated decimal, then "-1"
+bool buildText(const ChunkSource &source, EncodedStream &stream){
+    std::vector<int32_t> audioData = getAllAudio(source);
+    if (audioData.empty()) {
+        std::cerr << "No audio data in file." << std::endl;
+        return false;
+    }
+    std::cout << "The audio data size is " << audioData.size() << std::endl;
+    for (size_t i = 0; i < audioData.size(); i += TEXT_SAMPLES_PER_MESSAGE) {
+        size_t chunk_size = std::min<size_t>(TEXT_SAMPLES_PER_MESSAGE, audioData.size() - i);
+        stream.messages.push_back(audioDataToString(audioData.data() + i, chunk_size));
+    }
+    stream.messages.push_back("-1");
+    stream.opcode = 129;
+    return true;
+}
 
-    if(file.peek() == std::ifstream::traits_type::eof()) {
-        std::cerr << "WAV file is empty." << "\n";
-        return 1;
+// the binary modes (wsframe.h): the file's own samples, or CODEC_LPC blocks of
+// them from the shared encode-once cache, one frame per chunk
+bool buildFrames(std::shared_ptr<const ChunkSource> source, int mode, EncodedStream &stream){
+    const WavHeader &header = source->header();
+    WsFrameHeader hdr;
+    hdr.format = sampleFormat(header);
+    hdr.channels = header.num_channels;
+    hdr.sample_rate = header.sample_rate;
+    if (hdr.format == SAMPLE_UNSUPPORTED) {
+        std::cerr << "Unsupported WAV sample format." << std::endl;
+        return false;
+    }
+    std::shared_ptr<const CodedChunks> coded;
+    if (mode == WS_MODE_CODED && codecSupports(header)) {
+        coded = CodedChunks::open(source, CODEC_MAX_BLOCK_BYTES);
+    }
+    size_t frame = header.block_align;
+    size_t chunk_bytes = coded ? coded->chunkBytes() : std::max(frame, WS_FRAME_BYTES / frame * frame);
+    size_t count = (source->dataSize() + chunk_bytes - 1) / chunk_bytes;
+    stream.messages.reserve(count + 1);
+
+    for (size_t i = 0; i <= count; i++) {
+        size_t pcm_len = 0, len = 0;
+        const uint8_t *payload = nullptr;
+        if (i == count) {
+            hdr.payload = WS_PAYLOAD_END;
+        } else if (coded) {
+            hdr.payload = WS_PAYLOAD_CODED;
+            payload = coded->block(i, len);
+            coded->raw(i, pcm_len);
+        } else {
+            hdr.payload = WS_PAYLOAD_RAW;
+            pcm_len = std::min(chunk_bytes, source->dataSize() - i * chunk_bytes);
+            payload = source->samples() + i * chunk_bytes;
+            len = pcm_len;
+        }
+        hdr.seq = i;
+        hdr.timestamp = std::min(i * chunk_bytes, source->dataSize()) / frame;
+        hdr.pcm_bytes = pcm_len;
+        string message(WS_FRAME_HEADER_SIZE + len, '\0');
+        encodeWsFrameHeader(reinterpret_cast<uint8_t*>(&message[0]), hdr);
+        if (len > 0) {
+            memcpy(&message[WS_FRAME_HEADER_SIZE], payload, len);
+        }
+        stream.messages.push_back(std::move(message));
+    }
+    stream.opcode = 130;
+    std::cout << "Framed " << count << (coded ? " coded" : " raw") << " frames" << std::endl;
+    return true;
+}
+
+std::shared_ptr<const EncodedStream> buildStream(const std::string &path, int mode){
+    std::shared_ptr<const ChunkSource> source = ChunkSource::open(path);
+    if (!source) {
+        return nullptr;
     }
-    WavHeader header = getHeader(file);
+    const WavHeader &header = source->header();
 
     std::cout << "WAV file information:" << "\n";
     std::cout << "  Format: " << header.riff << "\n";
     std::cout << "  Channels: " << header.num_channels << "\n";
     std::cout << "  Sample Rate: " << header.sample_rate << "\n";
     std::cout << "  Bits per Sample: " << header.bits_per_sample << "\n";
+    std::cout << "  Sample Format: " << sampleFormatName(sampleFormat(header)) << "\n";
     std::cout << "  Data Size: " << header.data_size << "\n";
 
-    std::vector<int32_t> audioData = getAllAudio(file);
-    
-    if (audioData.empty()) {
-        std::cerr << "No audio data in file." << std::endl;
-        return 1;
+    auto stream = std::make_shared<EncodedStream>();
+    bool built = mode == WS_MODE_TEXT ? buildText(*source, *stream) : buildFrames(source, mode, *stream);
+    if (!built) {
+        return nullptr;
     }
-    std::cout << "The audio data size is " << audioData.size() << std::endl;
-    file.close();
-
-
-    for (int i = 0; i < audioData.size(); i += 256) {
-    
-        int32_t chunk[256];
-        size_t chunk_size = std::min(static_cast<size_t>(256), audioData.size() - i);
-        std::copy(audioData.begin() + i, audioData.begin() + i + chunk_size, chunk);
-        // integer array to string
-        string audio_data_string = audioDataToString(chunk, chunk_size);
+    for (const string &message : stream->messages) {
+        stream->bytes += message.size();
+    }
+    std::cout << "Encoded " << stream->messages.size() << " messages, " << stream->bytes << " bytes for "
+              << source->dataSize() << " bytes of PCM" << std::endl;
+    return stream;
+}
 
-        ssize_t sent_len = sendData(connection, audio_data_string);
+int sendFile(shared_ptr<WsServer::Connection> connection){
+    int mode = WS_MODE_TEXT;
+    auto query = SimpleWeb::QueryString::parse(connection->query_string);
+    auto it = query.find("mode");
+    if (it != query.end()) {
+        mode = wsMode(it->second);
+    }
+    std::shared_ptr<const EncodedStream> stream =
+        frame_cache.get(AUDIO_FILE, mode, [mode] { return buildStream(AUDIO_FILE, mode); });
+    if (!stream) {
+        return 1;
+    }
 
+    for (const string &message : stream->messages) {
+        ssize_t sent_len = sendData(connection, message, stream->opcode);
         if (sent_len < 0) {
             std::cerr << "Error sending datagram" << std::endl;
             return 1;
         }
     }
-
-    std::cout << "Sending: -1, end of transmission" << std::endl;
-    ssize_t sent_len = sendData(connection, "-1");
-    if (sent_len < 0) {
-        std::cerr << "Error sending datagram -1" << std::endl;
-        return 1;
-    }
+    std::cout << "Sent " << stream->messages.size() << " messages, end of transmission" << std::endl;
     return 0;
 }
 
+std::tuple<std::string, std::string> getstats(RequestContext /*request_context*/) {
+  FrameCacheStats cache = frame_cache.stats();
+  std::string response = "";
+  response += "Frame Cache Hits: " + std::to_string(cache.hits) + "\n";
+  response += "Frame Cache Misses: " + std::to_string(cache.misses) + "\n";
+  response += "Frame Cache Hit Ratio: " + std::to_string(cache.hitRatio() * 100) + "%\n";
+  response += "Frame Cache Streams: " + std::to_string(cache.entries) + "\n";
+  response += "Frame Cache Evictions: " + std::to_string(cache.evictions) + "\n";
+  response += "Frame Cache Memory: " + std::to_string(cache.bytes) + " of " + std::to_string(cache.max_bytes) + " bytes\n";
+  std::tuple<std::string, std::string> result(response, "text/html");
+  return result;
+}
+
+// the same TinyAPI stats page relay.cpp serves, on its own port
+int initTinyAPI() {
+  std::cout << "Initializing TinyAPI on port " << STATS_PORT << std::endl;
+  std::string localhost = "127.0.0.1";
+  size_t timeout = 1450000; // 14.5s
+  TinyAPI *new_api = new TinyAPI(STATS_PORT, 1024, 5, localhost, timeout);
+  if (new_api->initialize_server() == 1) {
+    return 1;
+  }
+  new_api->getMethods["/"] = getstats;
+  new_api->enable_listener();
+  delete new_api;
+  return 0;
+}
+
 int run_server(){
     WsServer server;
     server.config.port = 8081;
@@ -179,6 +284,8 @@ int main() {
 
     // WebSocket (WS)-server at port 8080 using 1 thread
       
+    std::thread tinyapi_thread(initTinyAPI);
+    tinyapi_thread.detach();
     run_server();
     
     return 0;
@@ -0,0 +1,210 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <netinet/in.h>
+#include "dgram.h"
+#include "chunk_source.h"
+#include "fec.h"
+#include "sack.h"
+#include "udp_io.h"
+
+// One transfer of the audio file to one client. Sessions are keyed by the
+// client's address and the stream id from its PKT_REQUEST and carry their own
+// window, scoreboard and timers; they never block, a worker asks them to make
+// progress and gets back the time they next need attention.
+
+#define MAX_IDLE_TIMEOUTS 10
+#define SESSION_IDLE_TIMEOUT_MS 10000
+
+struct SessionKey {
+    uint32_t addr;
+    uint16_t port;
+    uint32_t stream_id;
+
+    bool operator==(const SessionKey &other) const {
+        return addr == other.addr && port == other.port && stream_id == other.stream_id;
+    }
+};
+
+struct SessionKeyHash {
+    size_t operator()(const SessionKey &key) const {
+        uint64_t h = ((uint64_t)key.addr << 16 | key.port) * 0x9E3779B97F4A7C15ULL;
+        return h ^ key.stream_id;
+    }
+};
+
+inline SessionKey sessionKey(const sockaddr_in &addr, uint32_t stream_id) {
+    SessionKey key;
+    key.addr = addr.sin_addr.s_addr;
+    key.port = addr.sin_port;
+    key.stream_id = stream_id;
+    return key;
+}
+
+struct Session {
+    sockaddr_in peer;
+    uint32_t stream_id;
+    std::shared_ptr<const ChunkSource> source;
+    std::shared_ptr<const CodedChunks> coded;   // set when the client took the codec
+    SackScoreboard sb;
+    CongestionController cc;
+    int fec_k;
+    int fec_m;
+    long parity_sent = 0;
+
+    uint8_t info_packet[PACKET_HEADER_SIZE + STREAM_INFO_SIZE];
+    size_t info_len;
+    uint8_t end_packet[PACKET_HEADER_SIZE];
+    size_t end_len;
+    bool client_has_info = false;
+    bool end_sent = false;
+    bool failed = false;
+    int idle_timeouts = 0;
+
+    cc_time started = ccNow();
+    cc_time last_heard = ccNow();
+
+    Session(const sockaddr_in &peer, uint32_t stream_id, std::shared_ptr<const ChunkSource> source, int fec_k = 0, int fec_m = 0,
+            std::shared_ptr<const CodedChunks> coded = nullptr)
+        : peer(peer), stream_id(stream_id), source(std::move(source)), coded(std::move(coded)),
+          sb(this->coded ? this->coded->chunkCount() : this->source->chunkCount()),
+          fec_k(fec_m > 0 ? fec_k : 0), fec_m(fec_m) {
+        sb.fec_k = this->fec_k;
+        // the WAV header travels once, ahead of the data, and is repeated on
+        // timeouts until an ACK says it arrived
+        StreamInfo info;
+        info.header = this->source->header();
+        info.chunk_bytes = chunkBytes();
+        info.chunk_count = sb.size();
+        info.codec = this->coded ? CODEC_LPC : CODEC_NONE;
+        info.fec_k = this->fec_k;
+        info.fec_m = this->fec_m;
+        uint8_t payload[STREAM_INFO_SIZE];
+        info_len = encodePacket(info_packet, PKT_STREAM_INFO, 0, stream_id, 0, payload, encodeStreamInfo(payload, info));
+        // the end marker carries the chunk count so the receiver knows when it is done
+        end_len = encodePacket(end_packet, PKT_END, 0, stream_id, sb.size(), nullptr, 0);
+    }
+
+    size_t chunkBytes() const {
+        return coded ? coded->chunkBytes() : source->chunkBytes();
+    }
+
+    bool finished() const {
+        return sb.done() || failed;
+    }
+
+    void start(UdpBatch &tx) {
+        queueControl(tx, info_packet, info_len);
+    }
+
+    void queueControl(UdpBatch &tx, const uint8_t *packet, size_t len) {
+        memcpy(tx.next(), packet, len);
+        tx.push(len, peer);
+    }
+
+    void onAck(const PacketHeader &hdr, const uint8_t *payload) {
+        ackgram ack;
+        if (!decodeAck(payload, hdr.payload_len, ack)) {
+            return;
+        }
+        // anyone can send us a datagram: an ACK for ids outside this transfer,
+        // or whose highest id is below what its cumulative point covers
+        // (cumulative - 1 when everything arrived in order), is not believed
+        if (ack.cumulative < 0 || ack.cumulative > sb.size() || ack.highest < ack.cumulative - 1) {
+            return;
+        }
+        last_heard = ccNow();
+        if (hdr.flags & PKT_FLAG_HAVE_INFO) {
+            client_has_info = true;
+        }
+        if (sb.onAck(ack, cc) > 0) {
+            idle_timeouts = 0;
+        }
+    }
+
+    // send whatever the window and pacer allow right now and return when
+    // this session next needs to run
+    cc_time service(UdpBatch &tx, cc_time now) {
+        if (finished()) {
+            return cc_time::max();
+        }
+        if (cc.timedOut(now)) {
+            if (++idle_timeouts > MAX_IDLE_TIMEOUTS) {
+                std::cerr << "Stream " << stream_id << ": client stopped responding, giving up." << std::endl;
+                failed = true;
+                return cc_time::max();
+            }
+            sb.onTimeout();
+            cc.onTimeout(sb.next_fresh);
+            if (!client_has_info) {
+                queueControl(tx, info_packet, info_len);
+            }
+            if (end_sent) {
+                queueControl(tx, end_packet, end_len);
+            }
+        }
+
+        while (cc.canSend(sb.inflight)) {
+            if (!cc.due(now)) {
+                return std::min(cc.next_send, cc.rtoDeadline());
+            }
+            int id = sb.next();
+            if (id < 0) {
+                break;
+            }
+            // the payload goes out straight from the mapped file (or the shared coded blocks)
+            size_t payload_len;
+            const uint8_t *payload = coded ? coded->block(id, payload_len) : source->chunk(id, payload_len);
+            size_t header_len = encodeHeader(tx.next(), PKT_DATA, 0, stream_id, id, payload_len);
+            bool fresh = sb.state[id] == SACK_UNSENT;
+            sb.onSent(id);
+            cc.onPaced(now);
+            tx.pushGather(header_len, payload, payload_len, peer);
+            // parity follows the first transmission of a group's last chunk
+            if (fec_m > 0 && fresh && (id % fec_k == fec_k - 1 || id == sb.size() - 1)) {
+                queueParity(tx, id / fec_k, now);
+            }
+        }
+        if (sb.allSent() && !end_sent) {
+            queueControl(tx, end_packet, end_len);
+            end_sent = true;
+        }
+        // window full or nothing left to send: wait for the receiver
+        return cc.rtoDeadline();
+    }
+
+    void queueParity(UdpBatch &tx, int group, cc_time now) {
+        const uint8_t *payloads[FEC_MAX_SHARDS];
+        size_t lens[FEC_MAX_SHARDS];
+        int first = group * fec_k;
+        int count = std::min(fec_k, sb.size() - first);
+        // parity protects the PCM, which is what the receiver has on disk to
+        // recover from
+        for (int i = 0; i < count; i++) {
+            payloads[i] = coded ? coded->raw(first + i, lens[i]) : source->chunk(first + i, lens[i]);
+        }
+        size_t symbol_size = fecSymbolSize(chunkBytes());
+        for (int j = 0; j < fec_m; j++) {
+            uint8_t *slot = tx.next();
+            size_t header_len = encodeHeader(slot, PKT_FEC, 0, stream_id, (uint64_t)group * fec_m + j, symbol_size);
+            fecEncodeParity(slot + header_len, symbol_size, payloads, lens, count, j, fec_m);
+            // parity is not windowed, but it does use up pacing budget
+            cc.onPaced(now);
+            parity_sent++;
+            tx.push(header_len + symbol_size, peer);
+        }
+    }
+
+    void report() const {
+        double elapsed_ms = std::chrono::duration<double, std::milli>(ccNow() - started).count();
+        std::cout << "Stream " << stream_id << (failed ? " abandoned" : " done") << ": "
+                  << sb.cumulative << "/" << sb.size() << (coded ? " coded" : "") << " datagrams in " << elapsed_ms << " ms"
+                  << " (cwnd " << cc.cwnd << ", srtt " << cc.srtt_us << " us, "
+                  << sb.retransmissions << " retransmissions, " << parity_sent << " parity, "
+                  << cc.loss_events << " loss events, " << cc.timeouts << " timeouts)" << std::endl;
+    }
+};
+
+typedef std::unordered_map<SessionKey, std::unique_ptr<Session>, SessionKeyHash> SessionTable;
@@ -0,0 +1,222 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <endian.h>
+
+// Simulcast for relay rooms. A sender may publish the same stream as several
+// quality layers, for example Opus at 16, 32 and 64 kbit/s, each binary
+// message prefixed with an 8 byte header, little-endian:
+//
+//   0  magic    u8[2]  "SL"
+//   2  layer    u8     0 is the lowest quality, below SIMULCAST_MAX_LAYERS
+//   3  flags    u8     SIMULCAST_SWITCH_POINT: a listener can start this layer here
+//   4  bitrate  u32    the layer's nominal bits per second
+//
+// The relay strips the header and sends each listener only one layer of each
+// sender: the highest one whose bitrate fits the listener's goodput (from its
+// send queue, listener_queue.h), dropping down a layer as soon as the queue
+// backs up or loses frames and climbing back only after it has been healthy
+// for a while. Changes happen at the new layer's next switch point, so a
+// listener always gets whole, decodable runs of one layer. Messages without
+// the header go to everyone as before.
+//
+// Not thread safe: the relay only touches a room's simulcast state, and the
+// subscribers of its members, from the worker the room is pinned to.
+
+#define SIMULCAST_HEADER_SIZE 8
+#define SIMULCAST_MAX_LAYERS 8
+#define SIMULCAST_SWITCH_POINT 1
+
+#define SIMULCAST_HEADROOM 1.25          // goodput needed per bit of a layer
+#define SIMULCAST_MAX_BACKLOG_MS 500     // queued data past this much of the current layer means step down
+#define SIMULCAST_UP_HOLD_MS 2000        // no step up this soon after a switch or a step down
+#define SIMULCAST_LAYER_TIMEOUT_MS 2000  // layers not heard from this long are gone
+
+struct SimulcastHeader {
+    uint8_t layer = 0;
+    uint8_t flags = 0;
+    uint32_t bitrate = 0;
+};
+
+inline size_t encodeSimulcastHeader(uint8_t *buf, const SimulcastHeader &hdr) {
+    uint32_t le32 = htole32(hdr.bitrate);
+    buf[0] = 'S';
+    buf[1] = 'L';
+    buf[2] = hdr.layer;
+    buf[3] = hdr.flags;
+    memcpy(buf + 4, &le32, 4);
+    return SIMULCAST_HEADER_SIZE;
+}
+
+// false for anything that is not a simulcast message
+inline bool decodeSimulcastHeader(const uint8_t *buf, size_t len, SimulcastHeader &hdr) {
+    uint32_t le32;
+    if (len < SIMULCAST_HEADER_SIZE || buf[0] != 'S' || buf[1] != 'L' || buf[2] >= SIMULCAST_MAX_LAYERS) {
+        return false;
+    }
+    hdr.layer = buf[2];
+    hdr.flags = buf[3];
+    memcpy(&le32, buf + 4, 4);
+    hdr.bitrate = le32toh(le32);
+    return true;
+}
+
+// a listener's link as its send queue sees it when a message is fanned out
+struct SimulcastLink {
+    double goodput_bps = 0;  // 0 until measured
+    size_t queued_bytes = 0;
+    long dropped = 0;        // frames dropped from its queue so far
+};
+
+enum SimulcastDecision { SIMULCAST_SKIP, SIMULCAST_FORWARD, SIMULCAST_SWITCH };
+
+// the layer one listener gets from each sender
+class SimulcastSubscriber {
+    friend class SimulcastRoom;
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    struct Choice {
+        int layer = -1;     // forwarded now, -1 until the first switch point or the catch-up
+        int cap = SIMULCAST_MAX_LAYERS;  // ceiling after congestion
+        time_point last_switch;
+        time_point capped_at;
+        long dropped_seen = 0;
+    };
+
+    std::map<const void *, Choice> choices;
+};
+
+class SimulcastRoom {
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    // a layered message from sender, before it is fanned out
+    void publish(const void *sender, const SimulcastHeader &hdr, time_point now) {
+        Layer &layer = senders[sender].layers[hdr.layer];
+        layer.bitrate = hdr.bitrate;
+        layer.last_seen = now;
+        if (now - last_prune > std::chrono::milliseconds(SIMULCAST_LAYER_TIMEOUT_MS)) {
+            prune(now);
+        }
+    }
+
+    // whether subscriber gets this message of sender's, and whether that
+    // starts a different layer for it
+    SimulcastDecision forward(SimulcastSubscriber &subscriber, const void *sender, const SimulcastHeader &hdr, const SimulcastLink &link, time_point now) {
+        auto found = senders.find(sender);
+        if (found == senders.end()) {
+            return SIMULCAST_SKIP;
+        }
+        const Sender &s = found->second;
+        if (subscriber.choices.size() > senders.size()) {
+            // senders that have gone since
+            for (auto it = subscriber.choices.begin(); it != subscriber.choices.end();) {
+                it = senders.count(it->first) ? std::next(it) : subscriber.choices.erase(it);
+            }
+        }
+        SimulcastSubscriber::Choice &choice = subscriber.choices[sender];
+        if (choice.layer >= 0 && !fresh(s.layers[choice.layer], now)) {
+            // the sender stopped publishing it; take the next switch point
+            choice.layer = -1;
+        }
+
+        if (choice.layer >= 0) {
+            double backlog_bits = (double)s.layers[choice.layer].bitrate * SIMULCAST_MAX_BACKLOG_MS / 1000;
+            if (link.dropped > choice.dropped_seen || link.queued_bytes * 8.0 > backlog_bits) {
+                choice.cap = below(s, choice.layer, now);
+                choice.capped_at = now;
+            } else if (now - choice.capped_at > std::chrono::milliseconds(SIMULCAST_UP_HOLD_MS)) {
+                choice.cap = SIMULCAST_MAX_LAYERS;
+            }
+        }
+        choice.dropped_seen = link.dropped;
+
+        int target = fit(s, link.goodput_bps, now);
+        target = std::min(target, std::max(choice.cap, lowest(s, now)));
+        if (choice.layer >= 0 && target > choice.layer && now - choice.last_switch < std::chrono::milliseconds(SIMULCAST_UP_HOLD_MS)) {
+            target = choice.layer;
+        }
+
+        if (hdr.layer == target && target != choice.layer && (hdr.flags & SIMULCAST_SWITCH_POINT)) {
+            choice.layer = target;
+            choice.last_switch = now;
+            return SIMULCAST_SWITCH;
+        }
+        return hdr.layer == choice.layer ? SIMULCAST_FORWARD : SIMULCAST_SKIP;
+    }
+
+    // subscriber has just been caught up from the room's history, which only
+    // keeps layer 0: it carries on with that layer from the next message
+    // instead of waiting for a switch point, which would leave a gap
+    void seed(SimulcastSubscriber &subscriber, time_point now) {
+        for (const auto &entry : senders) {
+            if (fresh(entry.second.layers[0], now)) {
+                SimulcastSubscriber::Choice &choice = subscriber.choices[entry.first];
+                choice.layer = 0;
+                choice.last_switch = now;
+            }
+        }
+    }
+
+private:
+    struct Layer {
+        uint32_t bitrate = 0;
+        time_point last_seen;
+    };
+
+    struct Sender {
+        Layer layers[SIMULCAST_MAX_LAYERS];
+    };
+
+    static bool fresh(const Layer &layer, time_point now) {
+        return layer.last_seen != time_point() && now - layer.last_seen <= std::chrono::milliseconds(SIMULCAST_LAYER_TIMEOUT_MS);
+    }
+
+    static int lowest(const Sender &s, time_point now) {
+        for (int l = 0; l < SIMULCAST_MAX_LAYERS; l++) {
+            if (fresh(s.layers[l], now)) {
+                return l;
+            }
+        }
+        return 0;
+    }
+
+    // the next live layer below layer, or layer itself if it is the lowest
+    static int below(const Sender &s, int layer, time_point now) {
+        for (int l = layer - 1; l >= 0; l--) {
+            if (fresh(s.layers[l], now)) {
+                return l;
+            }
+        }
+        return layer;
+    }
+
+    // the highest live layer the goodput carries with headroom, else the lowest
+    static int fit(const Sender &s, double goodput_bps, time_point now) {
+        int best = -1;
+        for (int l = 0; l < SIMULCAST_MAX_LAYERS; l++) {
+            if (fresh(s.layers[l], now) && s.layers[l].bitrate * SIMULCAST_HEADROOM <= goodput_bps) {
+                best = l;
+            }
+        }
+        return best >= 0 ? best : lowest(s, now);
+    }
+
+    void prune(time_point now) {
+        last_prune = now;
+        for (auto it = senders.begin(); it != senders.end();) {
+            bool live = false;
+            for (const Layer &layer : it->second.layers) {
+                live = live || fresh(layer, now);
+            }
+            it = live ? std::next(it) : senders.erase(it);
+        }
+    }
+
+    std::map<const void *, Sender> senders;
+    time_point last_prune;
+};
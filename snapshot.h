@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+// A set that is written rarely and read on every message (relay.cpp's
+// connection registry and room members). Writers serialise on a mutex, apply
+// the change and publish a fresh immutable vector of the members. load() is
+// std::atomic_load of a shared_ptr, which libstdc++ implements with a lock
+// from a global pool, so the message path reads through a Reader instead: it
+// keeps the last snapshot it loaded and only goes back to the shared pointer
+// when the version has moved, so between membership changes a read is one
+// acquire load: no lock, no copy, no refcount traffic.
+
+template <typename T>
+class SnapshotSet {
+public:
+    using Snapshot = std::vector<T>;
+
+    SnapshotSet() : current(std::make_shared<const Snapshot>()) {}
+
+    SnapshotSet(const SnapshotSet &) = delete;
+    SnapshotSet &operator=(const SnapshotSet &) = delete;
+
+    // false if item was already a member, nothing is republished then
+    bool insert(const T &item) {
+        std::lock_guard<std::mutex> lock(writer_mtx);
+        if (!members.insert(item).second) {
+            return false;
+        }
+        publish();
+        return true;
+    }
+
+    // false if item was not a member
+    bool erase(const T &item) {
+        std::lock_guard<std::mutex> lock(writer_mtx);
+        if (members.erase(item) == 0) {
+            return false;
+        }
+        publish();
+        return true;
+    }
+
+    // the current members; holding the pointer keeps them alive however the
+    // set changes afterwards
+    std::shared_ptr<const Snapshot> load() const {
+        return std::atomic_load_explicit(&current, std::memory_order_acquire);
+    }
+
+    size_t size() const {
+        return load()->size();
+    }
+
+    // Per thread view of a set. Not shareable between threads; give each
+    // reading thread its own (a thread_local works well).
+    class Reader {
+    public:
+        explicit Reader(const SnapshotSet &set) : set(set) {}
+
+        const Snapshot &get() {
+            uint64_t seen = set.version.load(std::memory_order_acquire);
+            if (!cached || seen != cached_version) {
+                // the pointer is published before the version is bumped, so
+                // this is at least as new as seen; if it is newer we only
+                // reload once more next time
+                cached = set.load();
+                cached_version = seen;
+            }
+            return *cached;
+        }
+
+    private:
+        const SnapshotSet &set;
+        std::shared_ptr<const Snapshot> cached;
+        uint64_t cached_version = 0;
+    };
+
+private:
+    // writer_mtx held
+    void publish() {
+        std::shared_ptr<const Snapshot> next = std::make_shared<const Snapshot>(members.begin(), members.end());
+        std::atomic_store_explicit(&current, next, std::memory_order_release);
+        version.fetch_add(1, std::memory_order_release);
+    }
+
+    std::mutex writer_mtx;
+    std::set<T> members;
+    std::shared_ptr<const Snapshot> current;
+    std::atomic<uint64_t> version{1};
+};
@@ -0,0 +1,203 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Stats endpoints served from a snapshot. A background thread collects the
+// metrics every interval and renders the text page, the JSON object and the
+// Prometheus exposition once; requests only load the current snapshot, so
+// however often something scrapes, it never reaches the counters the hot
+// paths write.
+
+struct StatField {
+    std::string name;     // JSON key, also what fields= selects
+    double value = 0;
+    bool integer = true;
+    std::string family;   // Prometheus metric name
+    std::string labels;   // Prometheus labels without braces, may be empty
+    std::string type;     // counter, gauge or summary; empty for a family's _sum/_count lines
+    std::string help;
+};
+
+inline std::string formatStatValue(const StatField &field) {
+    char buf[64];
+    if (field.integer) {
+        snprintf(buf, sizeof(buf), "%lld", (long long)field.value);
+    } else {
+        snprintf(buf, sizeof(buf), "%.3f", field.value);
+    }
+    return buf;
+}
+
+struct StatsSnapshot {
+    long long taken_ms = 0;  // unix time the snapshot was collected
+    std::vector<StatField> fields;
+    std::string text;        // the human readable page
+    std::string json;        // every field
+    std::string prometheus;
+
+    // a JSON object with only the named fields, in snapshot order; unknown
+    // names are ignored and an empty list means all of them
+    std::string selectJson(const std::set<std::string> &names) const {
+        if (names.empty()) {
+            return json;
+        }
+        return renderJson(&names);
+    }
+
+    void render() {
+        json = renderJson(nullptr);
+        prometheus.clear();
+        std::string family;
+        for (const StatField &field : fields) {
+            if (field.family != family && !field.type.empty()) {
+                family = field.family;
+                prometheus += "# HELP " + field.family + " " + field.help + "\n";
+                prometheus += "# TYPE " + field.family + " " + field.type + "\n";
+            }
+            prometheus += field.family;
+            if (!field.labels.empty()) {
+                prometheus += "{" + field.labels + "}";
+            }
+            prometheus += " " + formatStatValue(field) + "\n";
+        }
+    }
+
+private:
+    std::string renderJson(const std::set<std::string> *names) const {
+        std::string out = "{\"taken_ms\":" + std::to_string(taken_ms);
+        for (const StatField &field : fields) {
+            if (names && !names->count(field.name)) {
+                continue;
+            }
+            out += ",\"" + field.name + "\":" + formatStatValue(field);
+        }
+        out += "}";
+        return out;
+    }
+};
+
+// a request target split at the first '?'; routes match path alone
+struct RequestTarget {
+    std::string path;   // "/stats"
+    std::string query;  // "fields=a,b", without the '?'
+};
+
+inline RequestTarget splitRequestTarget(const std::string &target) {
+    RequestTarget out;
+    size_t fragment = target.find('#');
+    std::string rest = target.substr(0, fragment);
+    size_t question = rest.find('?');
+    out.path = rest.substr(0, question);
+    if (question != std::string::npos) {
+        out.query = rest.substr(question + 1);
+    }
+    return out;
+}
+
+// %XX escapes decoded, '+' read as a space; malformed escapes are kept as is
+inline std::string decodeQueryValue(const std::string &value) {
+    std::string out;
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value[i] == '+') {
+            out += ' ';
+        } else if (value[i] == '%' && i + 2 < value.size() && isxdigit((unsigned char)value[i + 1]) && isxdigit((unsigned char)value[i + 2])) {
+            out += (char)std::stoi(value.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        } else {
+            out += value[i];
+        }
+    }
+    return out;
+}
+
+// "fields=a,b&x=y" -> {a, b}; several fields= parameters add up. Takes the
+// query only: a path that happens to contain "fields=" selects nothing.
+inline std::set<std::string> parseStatFields(const std::string &query) {
+    std::set<std::string> names;
+    size_t pos = 0;
+    while (pos <= query.size()) {
+        size_t amp = query.find('&', pos);
+        if (amp == std::string::npos) {
+            amp = query.size();
+        }
+        std::string param = query.substr(pos, amp - pos);
+        pos = amp + 1;
+        if (param.compare(0, 7, "fields=") != 0) {
+            continue;
+        }
+        std::string list = decodeQueryValue(param.substr(7));
+        size_t begin = 0;
+        while (begin <= list.size()) {
+            size_t comma = list.find(',', begin);
+            if (comma == std::string::npos) {
+                comma = list.size();
+            }
+            if (comma > begin) {
+                names.insert(list.substr(begin, comma - begin));
+            }
+            begin = comma + 1;
+        }
+    }
+    return names;
+}
+
+class StatsPublisher {
+public:
+    // collect fills in fields and text; it runs on the publisher's thread only
+    StatsPublisher(std::function<void(StatsSnapshot &)> collect, int interval_ms)
+        : collect(std::move(collect)), interval(std::max(10, interval_ms)) {
+        refresh();
+        thread = std::thread([this] { run(); });
+    }
+
+    ~StatsPublisher() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+    std::shared_ptr<const StatsSnapshot> load() const {
+        return std::atomic_load_explicit(&current, std::memory_order_acquire);
+    }
+
+private:
+    void refresh() {
+        std::shared_ptr<StatsSnapshot> next = std::make_shared<StatsSnapshot>();
+        next->taken_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        collect(*next);
+        next->render();
+        std::atomic_store_explicit(&current, std::shared_ptr<const StatsSnapshot>(std::move(next)), std::memory_order_release);
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!cv.wait_for(lock, interval, [this] { return stopping; })) {
+            lock.unlock();
+            refresh();
+            lock.lock();
+        }
+    }
+
+    std::function<void(StatsSnapshot &)> collect;
+    std::chrono::milliseconds interval;
+    std::shared_ptr<const StatsSnapshot> current;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread thread;
+};
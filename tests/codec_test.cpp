@@ -0,0 +1,204 @@
+// CodecEncoder/CodecDecoder: every block must come back byte for byte, for
+// each sample width and channel count, with trailing bytes that do not make
+// a whole frame; each stereo mode, wasted bits and the verbatim fallback get
+// picked where they should; corrupt blocks are refused without reading or
+// writing out of bounds.
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include "../codec.h"
+
+#define FRAMES 1000      // not a multiple of CODEC_PARTITION
+#define SINE_PERIOD 1000.0
+
+static WavHeader header(int width, int channels) {
+    WavHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.audio_format = 1;
+    hdr.num_channels = channels;
+    hdr.sample_rate = 48000;
+    hdr.block_align = channels * width;
+    hdr.byte_rate = hdr.sample_rate * hdr.block_align;
+    hdr.bits_per_sample = width * 8;
+    return hdr;
+}
+
+// uniform in [-amplitude, amplitude]
+static int64_t noise(int64_t amplitude) {
+    return amplitude == 0 ? 0 : rand() % (2 * amplitude + 1) - amplitude;
+}
+
+static int64_t sine(size_t i, int64_t amplitude, double phase = 0) {
+    return (int64_t)std::lround(amplitude * std::sin(2 * M_PI * i / SINE_PERIOD + phase));
+}
+
+static std::vector<uint8_t> roundTrip(const std::vector<uint8_t> &raw, const WavHeader &hdr) {
+    CodecEncoder enc;
+    CodecDecoder dec;
+    std::vector<uint8_t> block(raw.size() + 1);
+    size_t n = enc.encode(raw.data(), raw.size(), hdr, block.data(), block.size());
+    assert(n > 0 && n <= raw.size() + 1);
+    block.resize(n);
+    std::vector<uint8_t> back(raw.size());
+    assert(dec.decode(block.data(), block.size(), hdr, back.data(), back.size()));
+    assert(back == raw);
+    return block;
+}
+
+// a loud sine with a little noise per channel, plus tail odd bytes
+static void widthsAndChannels() {
+    for (int width = 1; width <= 4; width++) {
+        int64_t top = (1LL << (8 * width - 1)) - 1;
+        for (int channels = 1; channels <= 3; channels++) {
+            WavHeader hdr = header(width, channels);
+            for (size_t frames : {(size_t)1, (size_t)7, (size_t)FRAMES}) {
+                for (int tail = 0; tail < hdr.block_align; tail++) {
+                    std::vector<uint8_t> raw(frames * hdr.block_align + tail);
+                    for (size_t i = 0; i < frames; i++) {
+                        for (int c = 0; c < channels; c++) {
+                            int64_t v = sine(i, top / 2, c) + noise(top / 64);
+                            storeSample(&raw[i * hdr.block_align + c * width], width, v);
+                        }
+                    }
+                    for (int t = 0; t < tail; t++) {
+                        raw[frames * hdr.block_align + t] = rand();
+                    }
+                    std::vector<uint8_t> block = roundTrip(raw, hdr);
+                    if (frames == FRAMES) {
+                        assert(block[0] == CODEC_BLOCK_CODED);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void stereo(int expected, int64_t (*left)(size_t, int64_t), int64_t (*right)(size_t, int64_t)) {
+    WavHeader hdr = header(2, 2);
+    std::vector<uint8_t> raw(FRAMES * 4);
+    for (size_t i = 0; i < FRAMES; i++) {
+        int64_t n = noise(1000);
+        storeSample(&raw[4 * i], 2, left(i, n));
+        storeSample(&raw[4 * i + 2], 2, right(i, n));
+    }
+    std::vector<uint8_t> block = roundTrip(raw, hdr);
+    assert(block[0] == CODEC_BLOCK_CODED && block[1] == expected);
+}
+
+// n is the noise shared by both channels of a frame; a clean sine is nearly
+// free, so whichever pair of lanes avoids carrying the noise twice wins
+static void stereoModes() {
+    // left clean, right noise of its own: side costs more than right
+    stereo(CODEC_STEREO_INDEPENDENT,
+           [](size_t i, int64_t) { return sine(i, 10000); },
+           [](size_t, int64_t) { return noise(1000); });
+    stereo(CODEC_STEREO_LEFT_SIDE,
+           [](size_t i, int64_t) { return sine(i, 10000); },
+           [](size_t i, int64_t n) { return sine(i, 10000) - n; });
+    stereo(CODEC_STEREO_SIDE_RIGHT,
+           [](size_t i, int64_t n) { return sine(i, 10000) + n; },
+           [](size_t i, int64_t) { return sine(i, 10000); });
+    stereo(CODEC_STEREO_MID_SIDE,
+           [](size_t i, int64_t n) { return sine(i, 10000) + n; },
+           [](size_t i, int64_t n) { return sine(i, 10000) - n; });
+}
+
+// 16 bit audio in a 32 bit container: the low 16 bits are never sent
+static void wastedBits() {
+    WavHeader hdr = header(4, 1);
+    std::vector<uint8_t> raw(FRAMES * 4);
+    for (size_t i = 0; i < FRAMES; i++) {
+        storeSample(&raw[4 * i], 4, (sine(i, 10000) + noise(100)) * 65536);
+    }
+    std::vector<uint8_t> block = roundTrip(raw, hdr);
+    assert(block[0] == CODEC_BLOCK_CODED);
+    int wasted = (block[2] << 8 | block[3]) >> 7 & 0x3f;  // after the 3 bit order
+    assert(wasted == 16);
+    assert(block.size() < raw.size() / 3);
+}
+
+static void verbatim() {
+    // full scale noise does not get smaller
+    WavHeader hdr = header(2, 2);
+    std::vector<uint8_t> raw(FRAMES * 4 + 3);
+    for (uint8_t &b : raw) {
+        b = rand();
+    }
+    std::vector<uint8_t> block = roundTrip(raw, hdr);
+    assert(block[0] == CODEC_BLOCK_VERBATIM && block.size() == raw.size() + 1);
+
+    // float PCM is not coded at all
+    WavHeader fhdr = header(4, 1);
+    fhdr.audio_format = 3;
+    std::vector<uint8_t> silence(FRAMES * 4);
+    block = roundTrip(silence, fhdr);
+    assert(block[0] == CODEC_BLOCK_VERBATIM);
+
+    // no room even for that
+    CodecEncoder enc;
+    std::vector<uint8_t> out(raw.size());
+    assert(enc.encode(raw.data(), raw.size(), hdr, out.data(), out.size()) == 0);
+}
+
+static void corrupt() {
+    WavHeader hdr = header(2, 2);
+    std::vector<uint8_t> raw(FRAMES * 4 + 1);
+    for (size_t i = 0; i < FRAMES; i++) {
+        storeSample(&raw[4 * i], 2, sine(i, 10000) + noise(100));
+        storeSample(&raw[4 * i + 2], 2, sine(i, 10000, 1) + noise(100));
+    }
+    const std::vector<uint8_t> good = roundTrip(raw, hdr);
+    assert(good[0] == CODEC_BLOCK_CODED);
+    CodecDecoder dec;
+    std::vector<uint8_t> back(raw.size());
+
+    auto refused = [&](std::vector<uint8_t> block, const WavHeader &h) {
+        return !dec.decode(block.data(), block.size(), h, back.data(), back.size());
+    };
+    std::vector<uint8_t> bad = good;
+    bad.pop_back();
+    bad.pop_back();
+    assert(refused(bad, hdr));                     // cut short
+    bad = good;
+    bad.push_back(0);
+    assert(refused(bad, hdr));                     // trailing garbage
+    assert(refused(std::vector<uint8_t>(), hdr));  // empty
+    bad = good;
+    bad[0] = 2;
+    assert(refused(bad, hdr));                     // unknown block mode
+    bad = good;
+    bad[1] = CODEC_STEREO_MID_SIDE + 1;
+    assert(refused(bad, hdr));                     // unknown stereo mode
+    bad = good;
+    bad[1] = CODEC_STEREO_LEFT_SIDE;
+    WavHeader mono = header(4, 1);
+    assert(refused(bad, mono));                    // stereo mode on a mono stream
+    bad = good;
+    bad[2] |= 0xe0;
+    assert(refused(bad, hdr));                     // predictor order 7
+    bad = good;
+    bad[0] = CODEC_BLOCK_VERBATIM;
+    assert(refused(bad, hdr));                     // verbatim of the wrong length
+
+    // anything else flipped may decode to other samples or be refused, but
+    // never touches memory it should not (the sanitizers are watching)
+    for (int round = 0; round < 2000; round++) {
+        bad = good;
+        for (int flips = 1 + rand() % 4; flips > 0; flips--) {
+            bad[2 + rand() % (bad.size() - 2)] ^= 1 << (rand() % 8);
+        }
+        dec.decode(bad.data(), bad.size(), hdr, back.data(), back.size());
+    }
+}
+
+int main() {
+    srand(11);
+    widthsAndChannels();
+    stereoModes();
+    wastedBits();
+    verbatim();
+    corrupt();
+    printf("codec_test: ok\n");
+    return 0;
+}
\ No newline at end of file
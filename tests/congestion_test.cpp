@@ -0,0 +1,132 @@
+// CongestionController arithmetic: slow start and congestion avoidance
+// growth, one window cut per loss event, the timeout reset and RTO backoff,
+// and RFC 6298 smoothing within the RTO bounds.
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include "../congestion.h"
+
+static bool near(double a, double b) {
+    return std::fabs(a - b) < 1e-9;
+}
+
+static void growth() {
+    CongestionController cc;
+    assert(cc.cwnd == CC_INITIAL_WINDOW && cc.canSend(CC_INITIAL_WINDOW - 1) && !cc.canSend(CC_INITIAL_WINDOW));
+
+    // slow start: one packet per packet acked
+    cc.onAck(10);
+    assert(cc.cwnd == 20);
+    // no progress, no growth
+    cc.onAck(0);
+    cc.onAck(-3);
+    assert(cc.cwnd == 20);
+
+    // congestion avoidance: about one packet per window acked
+    cc.ssthresh = 20;
+    for (int i = 0; i < 20; i++) {
+        cc.onAck(1);
+    }
+    assert(cc.cwnd > 20.9 && cc.cwnd < 21);
+
+    // never past the cap
+    cc.ssthresh = CC_MAX_WINDOW;
+    cc.onAck(CC_MAX_WINDOW * 2);
+    assert(cc.cwnd == CC_MAX_WINDOW);
+}
+
+static void loss() {
+    CongestionController cc;
+    cc.cwnd = 40;
+    cc.onLoss(100, 140);
+    assert(cc.cwnd == 20 && cc.ssthresh == 20 && cc.loss_events == 1);
+
+    // more losses from the same window are the same event
+    cc.onLoss(120, 150);
+    cc.onLoss(139, 150);
+    assert(cc.cwnd == 20 && cc.loss_events == 1);
+
+    // one sent after the cut is a new one
+    cc.onLoss(140, 160);
+    assert(cc.cwnd == 10 && cc.loss_events == 2);
+
+    // never below the floor
+    for (int id = 200; id < 300; id += 10) {
+        cc.onLoss(id, id + 10);
+    }
+    assert(cc.cwnd == CC_MIN_WINDOW && cc.ssthresh == CC_MIN_WINDOW);
+
+    // growth after a cut is linear
+    cc.onAck(1);
+    assert(near(cc.cwnd, CC_MIN_WINDOW + 1.0 / CC_MIN_WINDOW));
+}
+
+static void timeout() {
+    CongestionController cc;
+    cc.onRttSample(10000);
+    double rto = cc.rto_us;
+    cc.cwnd = 64;
+    cc.onTimeout(500);
+    assert(cc.cwnd == CC_MIN_WINDOW && cc.ssthresh == 32 && cc.timeouts == 1);
+    assert(near(cc.rto_us, 2 * rto));
+    // losses from before the timeout are already dealt with
+    cc.onLoss(499, 510);
+    assert(cc.loss_events == 0);
+
+    // exponential backoff up to the cap
+    for (int i = 0; i < 20; i++) {
+        cc.onTimeout(500);
+    }
+    assert(cc.rto_us == CC_MAX_RTO_US && cc.ssthresh == CC_MIN_WINDOW);
+
+    // a fresh sample brings it back down
+    cc.onRttSample(10000);
+    assert(cc.rto_us < CC_MAX_RTO_US);
+
+    // the deadline runs from the last ACK with progress
+    cc.last_ack = ccNow() - std::chrono::microseconds((long)cc.rto_us) - std::chrono::milliseconds(1);
+    assert(cc.timedOut(ccNow()));
+    cc.onAck(0);
+    assert(cc.timedOut(ccNow()));
+    cc.onAck(1);
+    assert(!cc.timedOut(ccNow()));
+}
+
+static void rtt() {
+    CongestionController cc;
+    assert(cc.interval().count() == 0);  // nothing to pace with yet
+
+    // first sample: srtt = r, rttvar = r / 2, rto = 3r
+    cc.onRttSample(20000);
+    assert(cc.srtt_us == 20000 && cc.rttvar_us == 10000 && cc.rto_us == 60000);
+
+    cc.onRttSample(28000);
+    assert(near(cc.rttvar_us, 0.75 * 10000 + 0.25 * 8000));
+    assert(near(cc.srtt_us, 0.875 * 20000 + 0.125 * 28000));
+    assert(near(cc.rto_us, cc.srtt_us + 4 * cc.rttvar_us));
+
+    // clamped at both ends
+    CongestionController fast;
+    fast.onRttSample(100);
+    assert(fast.rto_us == CC_MIN_RTO_US);
+    CongestionController slow;
+    slow.onRttSample(2e6);
+    assert(slow.rto_us == CC_MAX_RTO_US);
+
+    // the window goes out over one srtt, faster while in slow start
+    cc.cwnd = 10;
+    double ns = cc.srtt_us * 1000 / 10;
+    assert(std::llabs(cc.interval().count() - (long long)(ns / 2.0)) <= 1);
+    cc.ssthresh = 10;
+    assert(std::llabs(cc.interval().count() - (long long)(ns / 1.2)) <= 1);
+}
+
+int main() {
+    growth();
+    loss();
+    timeout();
+    rtt();
+    printf("congestion_test: ok\n");
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+// The vector conversions must agree with the scalar ones sample for sample,
+// including float input that is out of range or NaN.
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+#include "../convert.h"
+
+#define SAMPLES 67  // a vector body and an odd scalar tail
+
+static void matchesScalar(int format, const std::vector<uint8_t> &src) {
+    size_t count = src.size() / sampleWidth(format);
+    std::vector<int32_t> fast(count), slow(count);
+    toCanonical(src.data(), format, count, fast.data());
+    toCanonicalScalar(src.data(), format, count, slow.data());
+    assert(fast == slow);
+}
+
+static void floats() {
+    const float specials[] = {0.0f, -0.0f, 0.5f, -0.5f, 1.0f, -1.0f, 1.5f, -1.5f,
+                              std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
+                              std::numeric_limits<float>::quiet_NaN(), -std::numeric_limits<float>::quiet_NaN()};
+    size_t n = sizeof(specials) / sizeof(specials[0]);
+    std::vector<uint8_t> src(SAMPLES * 4);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        float v = specials[i % n];
+        memcpy(&src[4 * i], &v, 4);
+    }
+    matchesScalar(SAMPLE_F32, src);
+
+    std::vector<int32_t> out(SAMPLES);
+    toCanonical(src.data(), SAMPLE_F32, SAMPLES, out.data());
+    for (size_t i = 0; i < SAMPLES; i++) {
+        float v = specials[i % n];
+        if (std::isnan(v) || v <= -1.0f) {
+            assert(out[i] == INT32_MIN);
+        } else if (v >= 1.0f) {
+            assert(out[i] == 2147483520);
+        }
+    }
+}
+
+int main() {
+    srand(7);
+    for (int format : {SAMPLE_U8, SAMPLE_S16, SAMPLE_S24}) {
+        std::vector<uint8_t> src(SAMPLES * sampleWidth(format));
+        for (uint8_t &b : src) {
+            b = rand();
+        }
+        matchesScalar(format, src);
+    }
+    floats();
+    printf("convert_test: ok (level %d)\n", convertLevel());
+    return 0;
+}
\ No newline at end of file
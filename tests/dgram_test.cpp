@@ -0,0 +1,114 @@
+// The wire format of dgram.h: headers and payloads come back as they were
+// sent, the bytes sit where the layout says, and packets that are short, of
+// another version or claim more payload than they carry are dropped.
+#include <cassert>
+#include <cstdio>
+#include "../dgram.h"
+
+static void header() {
+    uint8_t buf[MAX_PACKET_SIZE];
+    const char payload[] = "payload";
+    size_t len = encodePacket(buf, PKT_DATA, 0x0102, 0x03040506, 0x0708090a0b0c0d0eULL, payload, sizeof(payload));
+    assert(len == PACKET_HEADER_SIZE + sizeof(payload));
+
+    // little-endian, at the offsets of the layout
+    const uint8_t expected[PACKET_HEADER_SIZE] = {WIRE_VERSION, PKT_DATA, 0x02, 0x01, 0x06, 0x05, 0x04, 0x03,
+                                                  0x0e, 0x0d, 0x0c, 0x0b, 0x0a, 0x09, 0x08, 0x07, sizeof(payload), 0};
+    assert(memcmp(buf, expected, PACKET_HEADER_SIZE) == 0);
+
+    PacketHeader hdr;
+    const uint8_t *body = nullptr;
+    assert(decodePacket(buf, len, hdr, body));
+    assert(hdr.version == WIRE_VERSION && hdr.type == PKT_DATA && hdr.flags == 0x0102);
+    assert(hdr.stream_id == 0x03040506 && hdr.seq == 0x0708090a0b0c0d0eULL && hdr.payload_len == sizeof(payload));
+    assert(body == buf + PACKET_HEADER_SIZE && memcmp(body, payload, sizeof(payload)) == 0);
+
+    // trailing bytes past payload_len are tolerated
+    assert(decodePacket(buf, len + 5, hdr, body));
+
+    // header only, as sent ahead of a gathered payload
+    assert(encodeHeader(buf, PKT_END, 0, 7, 42, 0) == PACKET_HEADER_SIZE);
+    assert(decodePacket(buf, PACKET_HEADER_SIZE, hdr, body));
+    assert(hdr.type == PKT_END && hdr.seq == 42 && hdr.payload_len == 0);
+}
+
+static void rejected() {
+    uint8_t buf[MAX_PACKET_SIZE];
+    uint8_t payload[100] = {};
+    size_t len = encodePacket(buf, PKT_ACK, 0, 1, 2, payload, sizeof(payload));
+    PacketHeader hdr;
+    const uint8_t *body;
+
+    for (size_t short_len = 0; short_len < PACKET_HEADER_SIZE; short_len++) {
+        assert(!decodePacket(buf, short_len, hdr, body));
+    }
+    // payload cut short
+    assert(!decodePacket(buf, len - 1, hdr, body));
+    assert(!decodePacket(buf, PACKET_HEADER_SIZE, hdr, body));
+
+    for (int version : {0, WIRE_VERSION + 1, 0xff}) {
+        buf[0] = version;
+        assert(!decodePacket(buf, len, hdr, body));
+    }
+    buf[0] = WIRE_VERSION;
+
+    // unknown types and flags still decode, the receiver decides
+    buf[1] = 0xee;
+    buf[2] = buf[3] = 0xff;
+    assert(decodePacket(buf, len, hdr, body) && hdr.type == 0xee && hdr.flags == 0xffff);
+}
+
+static void streamInfo() {
+    StreamInfo info;
+    memset(&info.header, 0, sizeof(info.header));
+    memcpy(info.header.riff, "RIFF", 4);
+    info.header.num_channels = 2;
+    info.header.data_size = 123456;
+    info.chunk_bytes = 1000;
+    info.chunk_count = 124;
+    info.fec_k = 10;
+    info.fec_m = 2;
+    info.codec = 1;
+    uint8_t buf[STREAM_INFO_SIZE];
+    assert(encodeStreamInfo(buf, info) == STREAM_INFO_SIZE);
+
+    StreamInfo back;
+    assert(decodeStreamInfo(buf, sizeof(buf), back));
+    assert(memcmp(&back.header, &info.header, sizeof(WavHeader)) == 0);
+    assert(back.chunk_bytes == 1000 && back.chunk_count == 124);
+    assert(back.fec_k == 10 && back.fec_m == 2 && back.codec == 1);
+    assert(!decodeStreamInfo(buf, sizeof(buf) - 1, back));
+}
+
+static void ack() {
+    ackgram ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.cumulative = 1000;
+    ack.highest = 1000 + 130;
+    ack.received = 1100;
+    ack.bitmap[0] = 0x8000000000000001ULL;
+    ack.bitmap[2] = 3;
+    ack.bitmap[3] = 0xff;  // past highest, not sent
+    uint8_t buf[ACK_FIXED_SIZE + SACK_BITS / 8];
+    uint16_t len = encodeAck(buf, ack);
+    assert(len == ACK_FIXED_SIZE + 3 * 8);
+
+    ackgram back;
+    assert(decodeAck(buf, len, back));
+    assert(back.cumulative == 1000 && back.highest == 1130 && back.received == 1100);
+    assert(back.bitmap[0] == ack.bitmap[0] && back.bitmap[1] == 0 && back.bitmap[2] == 3 && back.bitmap[3] == 0);
+
+    // nothing beyond the cumulative point: no bitmap at all
+    ack.highest = ack.cumulative - 1;
+    assert(encodeAck(buf, ack) == ACK_FIXED_SIZE);
+    assert(!decodeAck(buf, ACK_FIXED_SIZE - 1, back));
+}
+
+int main() {
+    header();
+    rejected();
+    streamInfo();
+    ack();
+    printf("dgram_test: ok\n");
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,154 @@
+// FecDecoder against parity from fecEncodeParity: with up to M chunks of a
+// K,M group erased (and parity lost on top, as long as enough is left) the
+// rebuilt file must match the original byte for byte, for XOR (M == 1) and
+// Reed-Solomon (M > 1) alike, including a short last chunk and group.
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "../fec.h"
+
+#define TEST_CHUNK_BYTES 100  // not a multiple of the SIMD width
+
+struct Transfer {
+    StreamInfo info;
+    std::vector<uint8_t> data;
+    std::vector<std::vector<uint8_t>> parity;  // by seq, m per group
+    std::string path;
+
+    Transfer(int k, int m, size_t data_size) {
+        memset(&info.header, 0, sizeof(info.header));
+        info.header.data_size = data_size;
+        info.chunk_bytes = TEST_CHUNK_BYTES;
+        info.chunk_count = (data_size + TEST_CHUNK_BYTES - 1) / TEST_CHUNK_BYTES;
+        info.fec_k = k;
+        info.fec_m = m;
+        data.resize(data_size);
+        for (uint8_t &b : data) {
+            b = rand();
+        }
+        path = "/tmp/fec_test_" + std::to_string(getpid()) + ".wav";
+
+        int64_t groups = (info.chunk_count + k - 1) / k;
+        for (int64_t g = 0; g < groups; g++) {
+            const uint8_t *payloads[FEC_MAX_SHARDS];
+            size_t lens[FEC_MAX_SHARDS];
+            int count = 0;
+            for (int64_t id = g * k; id < (int64_t)info.chunk_count && id < (g + 1) * k; id++, count++) {
+                payloads[count] = &data[id * TEST_CHUNK_BYTES];
+                lens[count] = std::min<size_t>(TEST_CHUNK_BYTES, data_size - id * TEST_CHUNK_BYTES);
+            }
+            for (int j = 0; j < m; j++) {
+                std::vector<uint8_t> p(fecSymbolSize(TEST_CHUNK_BYTES));
+                fecEncodeParity(p.data(), p.size(), payloads, lens, count, j, m);
+                parity.push_back(p);
+            }
+        }
+    }
+
+    ~Transfer() {
+        unlink(path.c_str());
+    }
+
+    // deliver everything but the erased chunks and lost parity, let FEC fill
+    // the holes; returns the chunks it rebuilt
+    int run(const std::vector<bool> &erased, const std::vector<bool> &lost) {
+        ChunkWriter output;
+        FecDecoder fec;
+        assert(output.open(path, info) && fec.configure(info));
+        for (uint64_t id = 0; id < info.chunk_count; id++) {
+            if (!erased[id]) {
+                assert(output.write(id, &data[id * TEST_CHUNK_BYTES], output.chunkLength(id)));
+            }
+        }
+        int rebuilt = 0;
+        for (size_t seq = 0; seq < parity.size(); seq++) {
+            if (lost[seq]) {
+                continue;
+            }
+            int64_t group = fec.addParity(seq, parity[seq].data(), parity[seq].size(), output);
+            if (group >= 0) {
+                rebuilt += fec.recover(group, output);
+            }
+        }
+        if (output.complete()) {
+            std::vector<uint8_t> back(data.size());
+            FILE *f = fopen(path.c_str(), "rb");
+            assert(f && fseek(f, sizeof(WavHeader), SEEK_SET) == 0);
+            assert(fread(back.data(), 1, back.size(), f) == back.size());
+            fclose(f);
+            assert(back == data);
+        }
+        return rebuilt;
+    }
+};
+
+// every erasure pattern of one full group, with parity lost where it can be spared
+static void everyPattern(int k, int m) {
+    Transfer t(k, m, k * TEST_CHUNK_BYTES);
+    for (int mask = 0; mask < (1 << k); mask++) {
+        int e = __builtin_popcount(mask);
+        std::vector<bool> erased(k);
+        for (int i = 0; i < k; i++) {
+            erased[i] = mask >> i & 1;
+        }
+        for (int lose = 0; lose <= m; lose++) {
+            std::vector<bool> lost(m);
+            for (int j = 0; j < lose; j++) {
+                lost[(mask + j) % m] = true;
+            }
+            int rebuilt = t.run(erased, lost);
+            if (e <= m - lose) {
+                assert(rebuilt == e);
+            } else {
+                assert(rebuilt == 0);
+            }
+        }
+    }
+}
+
+// many groups, each with its own random erasures of up to m chunks, the
+// last chunk short and the last group missing members
+static void stream(int k, int m) {
+    int groups = 20;
+    Transfer t(k, m, (groups * k - k / 2) * TEST_CHUNK_BYTES - 37);
+    std::vector<bool> erased(t.info.chunk_count), lost(t.parity.size());
+    int expected = 0;
+    for (int g = 0; g < groups; g++) {
+        int first = g * k;
+        int count = std::min<int>(k, t.info.chunk_count - first);
+        int e = std::min(g % (m + 1), count);
+        for (int n = 0; n < e;) {
+            int i = first + rand() % count;
+            if (!erased[i]) {
+                erased[i] = true;
+                n++;
+            }
+        }
+        for (int n = 0; n < m - e;) {
+            int j = g * m + rand() % m;
+            if (!lost[j]) {
+                lost[j] = true;
+                n++;
+            }
+            n += rand() % 2;  // sometimes leave spare parity
+        }
+        expected += e;
+    }
+    assert(t.run(erased, lost) == expected);
+}
+
+int main() {
+    srand(5);
+    everyPattern(6, 1);
+    everyPattern(6, 3);
+    everyPattern(4, 4);
+    stream(4, 1);
+    stream(10, 1);
+    stream(8, 2);
+    stream(10, 4);
+    stream(16, 16);
+    stream(100, 8);
+    printf("fec_test: ok\n");
+    return 0;
+}
\ No newline at end of file
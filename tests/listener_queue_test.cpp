@@ -0,0 +1,185 @@
+// ListenerQueue against a fake connection whose sends complete when the test
+// says so: the gate, drop-oldest, eviction after the grace period, recovery
+// without a full drain and the goodput estimate.
+#include <cassert>
+#include <cstdio>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "../listener_queue.h"
+
+struct FakeServer {
+    struct OutMessage {
+        int n;
+    };
+
+    struct Connection {
+        struct Send {
+            int n;
+            std::function<void(const std::error_code &)> done;
+        };
+        std::vector<Send> sends;  // in the order they were started
+        size_t completed = 0;
+        bool closed = false;
+
+        void send(const std::shared_ptr<OutMessage> &message, std::function<void(const std::error_code &)> done, unsigned char) {
+            sends.push_back(Send{message->n, std::move(done)});
+        }
+
+        // finish the oldest send still in flight
+        void complete() {
+            assert(completed < sends.size());
+            auto done = sends[completed++].done;
+            done(std::error_code());
+        }
+
+        void close() {
+            closed = true;
+        }
+    };
+};
+
+typedef ListenerQueue<FakeServer> Queue;
+
+static std::shared_ptr<FakeServer::OutMessage> message(int n) {
+    return std::make_shared<FakeServer::OutMessage>(FakeServer::OutMessage{n});
+}
+
+static std::shared_ptr<Queue> makeQueue(const std::shared_ptr<FakeServer::Connection> &conn, const SendQueueLimits &limits, bool gated = false) {
+    return std::make_shared<Queue>(conn, limits, 1, [](const std::string &, std::chrono::steady_clock::duration) {}, gated);
+}
+
+static void gate() {
+    auto conn = std::make_shared<FakeServer::Connection>();
+    auto queue = makeQueue(conn, SendQueueLimits(), true);
+    queue->push(message(1), 10, 130);
+    assert(conn->sends.empty() && queue->stats().queued_messages == 0);
+    queue->open();
+    queue->push(message(2), 10, 130);
+    assert(conn->sends.size() == 1 && conn->sends[0].n == 2);
+}
+
+static void dropOldest() {
+    auto conn = std::make_shared<FakeServer::Connection>();
+    SendQueueLimits limits;
+    limits.max_messages = 3;
+    limits.max_bytes = 1000;
+    auto queue = makeQueue(conn, limits);
+
+    queue->push(message(0), 10, 130);  // in flight at once
+    int dropped = 0;
+    for (int n = 1; n <= 5; n++) {
+        dropped += queue->push(message(n), 10, 130).dropped;
+    }
+    assert(dropped == 2);
+    ListenerQueueStats stats = queue->stats();
+    assert(stats.queued_messages == 3 && stats.queued_bytes == 30 && stats.dropped == 2 && !stats.evicted);
+
+    // a frame over the byte budget pushes the older ones out, but never itself
+    assert(queue->push(message(6), 995, 130).dropped == 3);
+    assert(queue->stats().queued_messages == 1 && queue->stats().queued_bytes == 995);
+
+    conn->complete();
+    conn->complete();
+    assert(conn->sends.size() == 2 && conn->sends[0].n == 0 && conn->sends[1].n == 6);
+    assert(queue->stats().queued_messages == 0);
+
+    // drained: the next push goes straight out
+    queue->push(message(7), 10, 130);
+    assert(conn->sends.size() == 3 && conn->sends[2].n == 7);
+}
+
+static void eviction() {
+    auto conn = std::make_shared<FakeServer::Connection>();
+    SendQueueLimits limits;
+    limits.max_messages = 1;
+    limits.grace = std::chrono::milliseconds(20);
+    auto queue = makeQueue(conn, limits);
+
+    queue->push(message(0), 10, 130);
+    queue->push(message(1), 10, 130);
+    assert(queue->push(message(2), 10, 130).dropped == 1);  // behind from here
+
+    // catching up in time clears it
+    conn->complete();
+    conn->complete();
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    queue->push(message(3), 10, 130);
+    assert(!queue->push(message(4), 10, 130).evicted);
+    assert(!queue->push(message(5), 10, 130).evicted);
+    assert(!conn->closed);
+
+    // staying behind past the grace period does not
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    Queue::PushResult result = queue->push(message(6), 10, 130);
+    assert(result.evicted && conn->closed);
+    ListenerQueueStats stats = queue->stats();
+    assert(stats.evicted && stats.queued_messages == 0 && stats.queued_bytes == 0);
+
+    size_t sent = conn->sends.size();
+    queue->push(message(7), 10, 130);
+    conn->complete();
+    assert(conn->sends.size() == sent);
+}
+
+// a listener keeping up again with a frame or two always queued is no longer
+// behind, so a lone drop much later starts a new grace period
+static void recovery() {
+    auto conn = std::make_shared<FakeServer::Connection>();
+    SendQueueLimits limits;
+    limits.max_messages = 4;
+    limits.grace = std::chrono::milliseconds(20);
+    auto queue = makeQueue(conn, limits);
+
+    for (int n = 0; n < 5; n++) {
+        queue->push(message(n), 10, 130);
+    }
+    assert(queue->push(message(5), 10, 130).dropped == 1);
+    conn->complete();
+    conn->complete();
+    conn->complete();
+
+    // one send completing per frame pushed, the queue never empty
+    int n = 6;
+    for (int round = 0; round < 10; round++) {
+        assert(queue->push(message(n++), 10, 130).dropped == 0);
+        conn->complete();
+        assert(queue->stats().queued_messages == 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    Queue::PushResult result;
+    while (result.dropped == 0) {
+        result = queue->push(message(n++), 10, 130);
+    }
+    assert(!result.evicted && !conn->closed);
+}
+
+static void goodput() {
+    auto conn = std::make_shared<FakeServer::Connection>();
+    auto queue = makeQueue(conn, SendQueueLimits());
+    assert(queue->stats().goodput_bps == 0);
+
+    // 25000 bytes taking a little over GOODPUT_WINDOW_MS: just under 1 Mbit/s
+    queue->push(message(0), 25000, 130);
+    std::this_thread::sleep_for(std::chrono::milliseconds(GOODPUT_WINDOW_MS + 10));
+    conn->complete();
+    double bps = queue->stats().goodput_bps;
+    assert(bps > 0.5e6 && bps < 1e6);
+
+    // idle time between sends is not counted against the listener
+    std::this_thread::sleep_for(std::chrono::milliseconds(GOODPUT_WINDOW_MS));
+    queue->push(message(1), 10, 130);
+    conn->complete();
+    assert(queue->stats().goodput_bps == bps);
+}
+
+int main() {
+    gate();
+    dropOldest();
+    eviction();
+    recovery();
+    goodput();
+    printf("listener_queue_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,86 @@
+// The histogram's bucket math and percentiles, and counters summed across
+// threads.
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "../metrics.h"
+
+static void buckets() {
+    // small values are exact
+    for (int64_t v = 0; v < 2 * HIST_SUB_BUCKETS; v++) {
+        assert(histBucket(v) == (size_t)v && histBucketValue(v) == v);
+    }
+    assert(histBucket(-5) == 0);
+
+    // buckets tile the range: each one starts right after the previous ends
+    for (size_t i = 0; i + 1 < HIST_BUCKETS; i++) {
+        int64_t end = histBucketValue(i);
+        assert(histBucket(end) == i);
+        assert(histBucket(end + 1) == i + 1);
+    }
+    assert(histBucket((1LL << HIST_MAX_BITS) - 1) == HIST_BUCKETS - 1);
+    assert(histBucket(INT64_MAX) == HIST_BUCKETS - 1);
+
+    // a value is reported as its bucket's end, within 1/HIST_SUB_BUCKETS
+    for (int64_t v = 1; v < (1LL << HIST_MAX_BITS); v = v * 3 / 2 + 1) {
+        int64_t reported = histBucketValue(histBucket(v));
+        assert(reported >= v);
+        assert(reported - v <= v / HIST_SUB_BUCKETS);
+    }
+}
+
+static void percentiles() {
+    LatencyHistogram empty;
+    assert(empty.summary().count == 0 && empty.summary().p99 == 0);
+
+    LatencyHistogram h;
+    for (int64_t v = 1; v <= 10000; v++) {
+        h.record(v);
+    }
+    LatencyHistogram::Summary s = h.summary();
+    assert(s.count == 10000);
+    assert(s.sum == 10000LL * 10001 / 2);
+    assert(s.last == 10000);
+    auto near = [](int64_t got, int64_t want) {
+        return got >= want && got - want <= want / HIST_SUB_BUCKETS;
+    };
+    assert(near(s.p50, 5000));
+    assert(near(s.p90, 9000));
+    assert(near(s.p99, 9900));
+    assert(near(s.p999, 9990));
+    assert(near(s.max, 10000));
+
+    LatencyHistogram one;
+    one.record(std::chrono::milliseconds(3));
+    s = one.summary();
+    assert(s.count == 1 && s.p50 == s.max && near(s.max, 3000));
+}
+
+static void counters() {
+    ShardedCounter counter;
+    LatencyHistogram h;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < METRIC_SHARDS + 3; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 10000; i++) {
+                counter.add();
+                h.record(7);
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    assert(counter.value() == (METRIC_SHARDS + 3) * 10000);
+    LatencyHistogram::Summary s = h.summary();
+    assert(s.count == (METRIC_SHARDS + 3) * 10000 && s.p50 == 7 && s.max == 7);
+}
+
+int main() {
+    buckets();
+    percentiles();
+    counters();
+    printf("metrics_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,110 @@
+// AudioMixer: formats off the wire are bounded before they size anything,
+// the room's format is freed once its last speaker times out, and the mix
+// and mix-minus-one come out right.
+#include <cassert>
+#include <cstdio>
+#include "../mixer.h"
+
+typedef std::chrono::steady_clock clk;
+
+// one frame of constant s16 samples
+static std::string pcm(uint32_t rate, int channels, uint64_t timestamp, size_t frames, int16_t value) {
+    WsFrameHeader hdr;
+    hdr.format = SAMPLE_S16;
+    hdr.channels = (uint8_t)channels;
+    hdr.payload = WS_PAYLOAD_RAW;
+    hdr.seq = 0;
+    hdr.sample_rate = rate;
+    hdr.timestamp = timestamp;
+    hdr.pcm_bytes = (uint32_t)(frames * channels * 2);
+    std::string msg(WS_FRAME_HEADER_SIZE + hdr.pcm_bytes, '\0');
+    encodeWsFrameHeader((uint8_t *)&msg[0], hdr);
+    int16_t *samples = (int16_t *)&msg[WS_FRAME_HEADER_SIZE];
+    for (size_t i = 0; i < frames * channels; i++) {
+        samples[i] = value;
+    }
+    return msg;
+}
+
+static bool push(AudioMixer &mixer, const void *speaker, const std::string &msg, clk::time_point now) {
+    return mixer.push(speaker, (const uint8_t *)msg.data(), msg.size(), now);
+}
+
+static int16_t sampleAt(const std::string &frame, size_t i) {
+    return ((const int16_t *)&frame[WS_FRAME_HEADER_SIZE])[i];
+}
+
+static void bounds() {
+    AudioMixer mixer;
+    AudioMixer::Output out;
+    auto now = clk::now();
+    int a;
+    // each of these would have sized the room and every speaker's ring
+    assert(!push(mixer, &a, pcm(4000000000u, 2, 0, 10, 1), now));
+    assert(!push(mixer, &a, pcm(MIX_MAX_RATE + 1, 1, 0, 10, 1), now));
+    assert(!push(mixer, &a, pcm(MIX_MIN_RATE - 1, 1, 0, 10, 1), now));
+    assert(!push(mixer, &a, pcm(48000, MIX_MAX_CHANNELS + 1, 0, 10, 1), now));
+    assert(!push(mixer, &a, pcm(48000, 255, 0, 10, 1), now));
+    assert(!push(mixer, &a, pcm(48000, 0, 0, 10, 1), now));
+    assert(mixer.rejected == 6 && mixer.speakerCount() == 0);
+    assert(!mixer.mix(out, now));
+
+    assert(push(mixer, &a, pcm(MIX_MAX_RATE, MIX_MAX_CHANNELS, 0, 10, 1), now));
+    assert(push(mixer, &a, pcm(MIX_MIN_RATE, 1, 0, 10, 1), now) == false);  // not the room's format
+}
+
+static void mixing() {
+    AudioMixer mixer;
+    AudioMixer::Output out;
+    auto now = clk::now();
+    const size_t frame_len = 48000 * MIX_FRAME_MS / 1000;
+    int a, b;
+    assert(push(mixer, &a, pcm(48000, 2, 0, frame_len, 1000), now));
+    assert(push(mixer, &b, pcm(48000, 2, 0, frame_len, 300), now));
+    // new speakers are placed MIX_DELAY_FRAMES ticks behind the clock
+    for (int tick = 0; tick < MIX_DELAY_FRAMES; tick++) {
+        assert(mixer.mix(out, now));
+        assert(sampleAt(out.everyone, 0) == 0);
+    }
+    assert(mixer.mix(out, now));
+    assert(out.everyone.size() == WS_FRAME_HEADER_SIZE + frame_len * 2 * 2);
+    assert(sampleAt(out.everyone, 0) == 1300 && sampleAt(out.everyone, frame_len * 2 - 1) == 1300);
+    assert(out.minus_one.size() == 2);
+    for (auto &entry : out.minus_one) {
+        int16_t expected = entry.first == &a ? 300 : 1000;
+        assert(sampleAt(entry.second, 0) == expected);
+    }
+    // consumed: the next tick is silence
+    assert(mixer.mix(out, now) && sampleAt(out.everyone, 0) == 0);
+}
+
+static void formatReset() {
+    AudioMixer mixer;
+    AudioMixer::Output out;
+    auto now = clk::now();
+    int a, b;
+    assert(push(mixer, &a, pcm(48000, 2, 0, 960, 5), now));
+    assert(!push(mixer, &b, pcm(16000, 1, 0, 320, 5), now));
+
+    // a's last frame is too old: the room forgets it and its format
+    auto later = now + std::chrono::milliseconds(MIX_SPEAKER_TIMEOUT_MS + 1);
+    assert(!mixer.mix(out, later));
+    assert(mixer.speakerCount() == 0);
+    assert(push(mixer, &b, pcm(16000, 1, 0, 320, 7), later));
+    for (int tick = 0; tick < MIX_DELAY_FRAMES; tick++) {
+        assert(mixer.mix(out, later));
+    }
+    assert(mixer.mix(out, later));
+    WsFrameHeader hdr;
+    assert(decodeWsFrameHeader((const uint8_t *)out.everyone.data(), out.everyone.size(), hdr));
+    assert(hdr.sample_rate == 16000 && hdr.channels == 1 && hdr.pcm_bytes == 320 * 2);
+    assert(sampleAt(out.everyone, 0) == 7);
+}
+
+int main() {
+    bounds();
+    mixing();
+    formatReset();
+    printf("mixer_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,106 @@
+// MpscRing: fills and drains in order, refuses pushes when full or closed,
+// and loses nothing with several producers against a sleeping consumer.
+// ShardedWorkers keeps one key's items in submission order.
+#include <cassert>
+#include <cstdio>
+#include <mutex>
+#include "../mpsc.h"
+
+#define PRODUCERS 4
+#define PER_PRODUCER 100000
+
+static void singleThreaded() {
+    MpscRing<int> ring(5);  // rounded up to 8
+    for (int i = 0; i < 8; i++) {
+        int v = i;
+        assert(ring.push(v));
+    }
+    int extra = 8;
+    assert(!ring.push(extra));
+    assert(extra == 8);  // a refused item is left alone
+
+    int v;
+    for (int i = 0; i < 8; i++) {
+        assert(ring.tryPop(v) && v == i);
+    }
+    assert(!ring.tryPop(v));
+
+    // wrap around several times
+    for (int i = 0; i < 100; i++) {
+        int in = i;
+        assert(ring.push(in));
+        assert(ring.tryPop(v) && v == i);
+    }
+
+    ring.close();
+    int late = 1;
+    assert(!ring.push(late));
+    assert(!ring.pop(v));
+}
+
+static void producers() {
+    MpscRing<uint64_t> ring(64);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < PRODUCERS; p++) {
+        threads.emplace_back([&ring, p] {
+            for (uint64_t i = 0; i < PER_PRODUCER; i++) {
+                uint64_t item = ((uint64_t)p << 32) | i;
+                while (!ring.push(item)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    std::thread closer([&] {
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        ring.close();
+    });
+
+    uint64_t next[PRODUCERS] = {};
+    uint64_t item;
+    size_t got = 0;
+    while (ring.pop(item)) {
+        int p = (int)(item >> 32);
+        assert(p < PRODUCERS);
+        assert((item & 0xFFFFFFFF) == next[p]);  // each producer's items in order
+        next[p]++;
+        got++;
+    }
+    closer.join();
+    assert(got == (size_t)PRODUCERS * PER_PRODUCER);
+}
+
+static void workers() {
+    std::mutex mtx;
+    std::vector<int> seen[3];
+    {
+        ShardedWorkers<std::pair<int, int>> pool(2, 16, [&](std::pair<int, int> &item) {
+            std::lock_guard<std::mutex> lock(mtx);
+            seen[item.first].push_back(item.second);
+        });
+        for (int i = 0; i < 1000; i++) {
+            for (int key = 0; key < 3; key++) {
+                std::pair<int, int> item(key, i);
+                while (!pool.submit(key, item)) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }  // the destructor drains and joins
+    for (int key = 0; key < 3; key++) {
+        assert(seen[key].size() == 1000);
+        for (int i = 0; i < 1000; i++) {
+            assert(seen[key][i] == i);
+        }
+    }
+}
+
+int main() {
+    singleThreaded();
+    producers();
+    workers();
+    printf("mpsc_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,121 @@
+// Readers of room members and room lookups follow joins and leaves, the
+// per thread Readers let go of rooms and members that have gone, and readers
+// on other threads stay consistent while membership changes.
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include "../rooms.h"
+
+typedef RoomRegistry<int> Registry;
+
+static void reader() {
+    SnapshotSet<int> set;
+    SnapshotSet<int>::Reader r(set);
+    assert(r.get().empty());
+    set.insert(2);
+    set.insert(1);
+    const std::vector<int> &first = r.get();
+    assert(first == std::vector<int>({1, 2}));
+    assert(&r.get() == &first);  // unchanged: the same snapshot
+    set.erase(2);
+    assert(r.get() == std::vector<int>({1}));
+    assert(!set.erase(2) && !set.insert(1));
+}
+
+static void registry() {
+    Registry rooms(2);
+    assert(!rooms.find("a"));
+    Registry::RoomPtr a = rooms.join("a", 1);
+    assert(rooms.find("a") == a && a->worker == 0);
+    Registry::RoomPtr b = rooms.join("b", 2);
+    assert(rooms.find("b") == b && b->worker == 1);
+
+    assert(roomMembers(*a) == std::vector<int>({1}));
+    rooms.join("a", 3);
+    assert(roomMembers(*a) == std::vector<int>({1, 3}));
+    rooms.leave("a", 1);
+    assert(roomMembers(*a) == std::vector<int>({3}));
+
+    // the Reader does not hold its room: it goes with the last reference
+    std::weak_ptr<Room<int>> gone = a;
+    rooms.leave("a", 3);
+    assert(!rooms.find("a"));
+    a.reset();
+    assert(gone.expired());
+    Registry::RoomPtr c = rooms.join("c", 4);
+    assert(roomMembers(*c) == std::vector<int>({4}));
+
+    // a second registry on the same thread does not see the first one's map
+    Registry other;
+    assert(!other.find("b"));
+    assert(rooms.find("b") == b);
+}
+
+// the members a thread last read of a room that is gone are let go by its
+// next read of any room, not only of a room it has not seen before
+static void pruned() {
+    RoomRegistry<std::shared_ptr<int>> rooms;
+    std::shared_ptr<int> member = std::make_shared<int>(1);
+    std::shared_ptr<int> other = std::make_shared<int>(2);
+    auto kept = rooms.join("kept", other);
+    auto room = rooms.join("gone", member);
+    assert(roomMembers(*kept).size() == 1);
+    assert(roomMembers(*room).size() == 1);
+    rooms.leave("gone", member);
+    room.reset();
+    assert(member.use_count() == 2);  // the snapshot in this thread's Reader
+    assert(roomMembers(*kept).size() == 1);
+    assert(member.use_count() == 1);
+
+    // a new room where the old one was is read afresh
+    for (int i = 0; i < 100; i++) {
+        auto again = rooms.join("again", member);
+        assert(roomMembers(*again).size() == 1 && roomMembers(*again).front() == member);
+        rooms.leave("again", member);
+    }
+}
+
+static void concurrent() {
+    Registry rooms(4);
+    rooms.join("fixed", 0);
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+        for (int i = 1; i <= 2000; i++) {
+            rooms.join("fixed", i);
+            rooms.join("churn" + std::to_string(i % 7), i);
+            rooms.leave("fixed", i);
+            rooms.leave("churn" + std::to_string(i % 7), i);
+        }
+        done = true;
+    });
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; t++) {
+        readers.emplace_back([&] {
+            while (!done) {
+                Registry::RoomPtr fixed = rooms.find("fixed");
+                assert(fixed);
+                const std::vector<int> &members = roomMembers(*fixed);
+                assert(!members.empty() && members.front() == 0 && members.size() <= 2);
+                for (int k = 0; k < 7; k++) {
+                    if (Registry::RoomPtr churn = rooms.find("churn" + std::to_string(k))) {
+                        assert(roomMembers(*churn).size() <= 1);
+                    }
+                }
+            }
+        });
+    }
+    writer.join();
+    for (std::thread &t : readers) {
+        t.join();
+    }
+    assert(roomMembers(*rooms.find("fixed")) == std::vector<int>({0}));
+}
+
+int main() {
+    reader();
+    registry();
+    pruned();
+    concurrent();
+    printf("rooms_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,118 @@
+// SackScoreboard and Session::onAck against ACKs a peer could forge: a
+// cumulative point outside the transfer must not touch the scoreboard.
+#include <cassert>
+#include <cstdio>
+#include <climits>
+#include <unistd.h>
+#include "../session.h"
+
+#define CHUNKS 100
+
+static ackgram allOnes(int64_t cumulative, int64_t highest) {
+    ackgram ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.cumulative = cumulative;
+    ack.highest = highest;
+    memset(ack.bitmap, 0xFF, sizeof(ack.bitmap));
+    return ack;
+}
+
+static void sendAll(SackScoreboard &sb) {
+    for (int id = sb.next(); id >= 0; id = sb.next()) {
+        sb.onSent(id);
+    }
+}
+
+static void scoreboard() {
+    SackScoreboard sb(CHUNKS);
+    CongestionController cc;
+    sendAll(sb);
+    assert(sb.inflight == CHUNKS);
+
+    int64_t forged[] = {-600, -1, CHUNKS + 1, INT64_MAX, INT64_MIN, INT64_MAX - SACK_BITS};
+    for (int64_t cumulative : forged) {
+        assert(sb.onAck(allOnes(cumulative, cumulative), cc) == 0);
+        assert(sb.cumulative == 0 && sb.inflight == CHUNKS);
+    }
+
+    // 0..9 arrived, then 12
+    ackgram ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.cumulative = 10;
+    ack.highest = 12;
+    ack.bitmap[0] = 1ULL << 1;
+    assert(sb.onAck(ack, cc) == 11);
+    assert(sb.cumulative == 10 && sb.inflight == CHUNKS - 11);
+
+    // everything, bitmap running past the end
+    assert(sb.onAck(allOnes(CHUNKS, CHUNKS - 1), cc) == CHUNKS - 11);
+    assert(sb.done() && sb.inflight == 0);
+}
+
+static std::string writeWav() {
+    std::string path = "/tmp/sack_test_" + std::to_string(getpid()) + ".wav";
+    WavHeader hdr;
+    memcpy(hdr.riff, "RIFF", 4);
+    memcpy(hdr.wave, "WAVE", 4);
+    memcpy(hdr.fmt, "fmt ", 4);
+    hdr.fmt_size = 16;
+    hdr.audio_format = 1;
+    hdr.num_channels = 1;
+    hdr.sample_rate = 8000;
+    hdr.byte_rate = 16000;
+    hdr.block_align = 2;
+    hdr.bits_per_sample = 16;
+    memcpy(hdr.data, "data", 4);
+    hdr.data_size = CHUNKS * 100;
+    hdr.overall_size = sizeof(hdr) - 8 + hdr.data_size;
+    std::vector<char> samples(hdr.data_size);
+    FILE *f = fopen(path.c_str(), "wb");
+    assert(f);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(samples.data(), samples.size(), 1, f);
+    fclose(f);
+    return path;
+}
+
+static void session() {
+    std::string path = writeWav();
+    std::shared_ptr<const ChunkSource> source = ChunkSource::open(path, 100);
+    assert(source && source->chunkCount() == CHUNKS);
+    sockaddr_in peer;
+    memset(&peer, 0, sizeof(peer));
+    Session s(peer, 1, source);
+    sendAll(s.sb);
+
+    auto deliver = [&](const ackgram &ack) {
+        uint8_t payload[ACK_FIXED_SIZE + SACK_BITS / 8];
+        PacketHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.payload_len = encodeAck(payload, ack);
+        s.onAck(hdr, payload);
+    };
+
+    // the crash this guards against: one forged ACK with a negative cumulative
+    deliver(allOnes(-600, 1000));
+    assert(s.sb.cumulative == 0 && s.sb.inflight == CHUNKS);
+    deliver(allOnes(CHUNKS + 5, CHUNKS + 10));
+    assert(s.sb.cumulative == 0 && s.sb.inflight == CHUNKS);
+    // highest below what the cumulative point already covers
+    deliver(allOnes(50, 10));
+    assert(s.sb.cumulative == 0 && s.sb.inflight == CHUNKS);
+
+    // in order delivery reports highest == cumulative - 1 and is believed
+    ackgram ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.cumulative = 20;
+    ack.highest = 19;
+    deliver(ack);
+    assert(s.sb.cumulative == 20 && s.sb.inflight == CHUNKS - 20);
+    unlink(path.c_str());
+}
+
+int main() {
+    scoreboard();
+    session();
+    printf("sack_test: ok\n");
+    return 0;
+}
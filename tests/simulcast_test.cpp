@@ -0,0 +1,144 @@
+// SimulcastRoom's choice of layer per listener: it fits the goodput, steps
+// down at once when the queue backs up or drops, steps up only after a
+// hold, changes only at switch points, and a caught-up joiner carries on
+// with layer 0 straight away.
+#include <cassert>
+#include <cstdio>
+#include "../simulcast.h"
+
+typedef std::chrono::steady_clock clk;
+typedef std::chrono::milliseconds ms;
+
+static const uint32_t bitrates[] = {16000, 32000, 64000};
+
+static SimulcastHeader header(int layer, bool switch_point) {
+    SimulcastHeader hdr;
+    hdr.layer = (uint8_t)layer;
+    hdr.flags = switch_point ? SIMULCAST_SWITCH_POINT : 0;
+    hdr.bitrate = bitrates[layer];
+    return hdr;
+}
+
+static SimulcastLink link(double goodput_bps, size_t queued = 0, long dropped = 0) {
+    SimulcastLink l;
+    l.goodput_bps = goodput_bps;
+    l.queued_bytes = queued;
+    l.dropped = dropped;
+    return l;
+}
+
+// one slice from sender on every layer; returns the last layer the
+// subscriber got, which is the one it is on afterwards
+static int slice(SimulcastRoom &room, SimulcastSubscriber &sub, const void *sender, const SimulcastLink &l, clk::time_point now, bool switch_point = true) {
+    int got = -1;
+    for (int layer = 0; layer < 3; layer++) {
+        SimulcastHeader hdr = header(layer, switch_point);
+        room.publish(sender, hdr, now);
+        if (room.forward(sub, sender, hdr, l, now) != SIMULCAST_SKIP) {
+            got = layer;
+        }
+    }
+    return got;
+}
+
+static void headers() {
+    uint8_t buf[SIMULCAST_HEADER_SIZE];
+    SimulcastHeader in = header(2, true), out;
+    assert(encodeSimulcastHeader(buf, in) == SIMULCAST_HEADER_SIZE);
+    assert(decodeSimulcastHeader(buf, sizeof(buf), out));
+    assert(out.layer == 2 && out.flags == SIMULCAST_SWITCH_POINT && out.bitrate == 64000);
+    assert(!decodeSimulcastHeader(buf, sizeof(buf) - 1, out));
+    buf[2] = SIMULCAST_MAX_LAYERS;
+    assert(!decodeSimulcastHeader(buf, sizeof(buf), out));
+    assert(!decodeSimulcastHeader((const uint8_t *)"\x1A\x45\xDF\xA3....", 8, out));
+}
+
+// slices every 100 ms for a while under one link; the layer it ends on
+static int run(SimulcastRoom &room, SimulcastSubscriber &sub, const void *sender, const SimulcastLink &l, clk::time_point &now, int duration_ms) {
+    int got = -1;
+    for (int t = 0; t < duration_ms; t += 100) {
+        now += ms(100);
+        got = slice(room, sub, sender, l, now);
+    }
+    return got;
+}
+
+static void selection() {
+    SimulcastRoom room;
+    SimulcastSubscriber sub;
+    int sender;
+    auto now = clk::now();
+
+    // unmeasured links start on the lowest layer; enough goodput for 64k
+    // with headroom gets the top one, but only once the hold is over
+    assert(slice(room, sub, &sender, link(0), now) == 0);
+    assert(run(room, sub, &sender, link(64000 * SIMULCAST_HEADROOM), now, SIMULCAST_UP_HOLD_MS / 2) == 0);
+    assert(run(room, sub, &sender, link(64000 * SIMULCAST_HEADROOM), now, SIMULCAST_UP_HOLD_MS) == 2);
+
+    // without the headroom it comes down, but only at a switch point
+    now += ms(100);
+    assert(slice(room, sub, &sender, link(64000), now, false) == 2);
+    assert(slice(room, sub, &sender, link(64000), now) == 1);
+
+    // drops step down a layer at once, whatever the goodput, and stepping
+    // back up waits for the hold
+    assert(run(room, sub, &sender, link(1e6), now, SIMULCAST_UP_HOLD_MS + 100) == 2);
+    now += ms(100);
+    assert(slice(room, sub, &sender, link(1e6, 0, 3), now) == 1);
+    assert(run(room, sub, &sender, link(1e6, 0, 3), now, SIMULCAST_UP_HOLD_MS / 2) == 1);
+    assert(run(room, sub, &sender, link(1e6, 0, 3), now, SIMULCAST_UP_HOLD_MS) == 2);
+
+    // so does a backlog past SIMULCAST_MAX_BACKLOG_MS of the current layer
+    size_t backlog = 64000 / 8 * SIMULCAST_MAX_BACKLOG_MS / 1000 + 1;
+    now += ms(100);
+    assert(slice(room, sub, &sender, link(1e6, backlog, 3), now) == 1);
+}
+
+static void layerTimeout() {
+    SimulcastRoom room;
+    SimulcastSubscriber sub;
+    int sender;
+    auto now = clk::now();
+    assert(run(room, sub, &sender, link(1e6), now, SIMULCAST_UP_HOLD_MS + 100) == 2);
+
+    // the sender stops publishing its top layer; the listener moves to what
+    // is left once it has timed out
+    int got = -1;
+    for (int t = 0; t <= SIMULCAST_LAYER_TIMEOUT_MS + 100; t += 100) {
+        now += ms(100);
+        for (int layer = 0; layer < 2; layer++) {
+            SimulcastHeader hdr = header(layer, true);
+            room.publish(&sender, hdr, now);
+            if (room.forward(sub, &sender, hdr, link(1e6), now) != SIMULCAST_SKIP) {
+                got = layer;
+            }
+        }
+    }
+    assert(got == 1);
+}
+
+static void seeded() {
+    SimulcastRoom room;
+    SimulcastSubscriber old_hand, joiner, unseeded;
+    int sender;
+    auto now = clk::now();
+    slice(room, old_hand, &sender, link(0), now);
+
+    // mid-run, between switch points: a joiner caught up on layer 0 gets the
+    // next layer 0 message; one left unseeded would get nothing
+    room.seed(joiner, now);
+    assert(slice(room, joiner, &sender, link(0), now, false) == 0);
+    assert(slice(room, unseeded, &sender, link(0), now, false) == -1);
+
+    // and moves up like anyone else once the hold is over
+    assert(run(room, joiner, &sender, link(1e6), now, SIMULCAST_UP_HOLD_MS + 100) == 2);
+}
+
+int main() {
+    headers();
+    selection();
+    layerTimeout();
+    seeded();
+    printf("simulcast_test: ok\n");
+    return 0;
+}
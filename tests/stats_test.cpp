@@ -0,0 +1,60 @@
+// Request targets are split into path and query before anything is matched,
+// and fields= is read from the query only.
+#include <cassert>
+#include <cstdio>
+#include "../stats.h"
+
+typedef std::set<std::string> Names;
+
+static void split() {
+    RequestTarget t = splitRequestTarget("/stats?fields=a,b");
+    assert(t.path == "/stats" && t.query == "fields=a,b");
+    t = splitRequestTarget("/stats");
+    assert(t.path == "/stats" && t.query.empty());
+    t = splitRequestTarget("/stats?");
+    assert(t.path == "/stats" && t.query.empty());
+    t = splitRequestTarget("/stats?fields=a?b#frag");
+    assert(t.path == "/stats" && t.query == "fields=a?b");
+    t = splitRequestTarget("/metrics#x?fields=a");
+    assert(t.path == "/metrics" && t.query.empty());
+    t = splitRequestTarget("");
+    assert(t.path.empty() && t.query.empty());
+}
+
+static void fields() {
+    assert(parseStatFields("fields=a,b") == Names({"a", "b"}));
+    assert(parseStatFields("x=1&fields=a&y=2") == Names({"a"}));
+    assert(parseStatFields("fields=a&fields=b,c") == Names({"a", "b", "c"}));
+    assert(parseStatFields("fields=a,,b,") == Names({"a", "b"}));
+    assert(parseStatFields("fields=a%2Cb") == Names({"a", "b"}));
+    assert(parseStatFields("fields=a%2") == Names({"a%2"}));
+    assert(parseStatFields("myfields=a").empty());
+    assert(parseStatFields("fields=").empty());
+    assert(parseStatFields("").empty());
+
+    // a path that looks like a query selects nothing once split
+    RequestTarget t = splitRequestTarget("/x&fields=a");
+    assert(t.path == "/x&fields=a" && parseStatFields(t.query).empty());
+}
+
+static void select() {
+    StatsSnapshot snapshot;
+    StatField a, b;
+    a.name = "a";
+    a.value = 1;
+    b.name = "b";
+    b.value = 2.5;
+    b.integer = false;
+    snapshot.fields = {a, b};
+    snapshot.render();
+    assert(snapshot.selectJson({}) == "{\"taken_ms\":0,\"a\":1,\"b\":2.500}");
+    assert(snapshot.selectJson(parseStatFields(splitRequestTarget("/stats?fields=b,zz").query)) == "{\"taken_ms\":0,\"b\":2.500}");
+}
+
+int main() {
+    split();
+    fields();
+    select();
+    printf("stats_test: ok\n");
+    return 0;
+}
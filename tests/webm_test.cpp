@@ -0,0 +1,234 @@
+// WebmParser and StreamHistory on a synthetic stream: the init segment and
+// Cluster boundaries are found however the bytes are split, joiners get the
+// init segment and the latest Cluster, reconnects get what they missed, and a
+// sender's parser outlives its messages leaving the ring.
+#include <cassert>
+#include <cstdio>
+#include "../webm.h"
+#include "../simulcast.h"
+
+typedef StreamHistory::Bytes Bytes;
+
+static std::string id(uint32_t v) {
+    std::string out;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        if (out.empty() && (v >> shift) == 0) {
+            continue;
+        }
+        out += (char)((v >> shift) & 0xFF);
+    }
+    return out;
+}
+
+// an element with a known size, written as a 4 byte vint
+static std::string element(uint32_t element_id, const std::string &body) {
+    uint32_t size = (uint32_t)body.size();
+    std::string out = id(element_id);
+    out += (char)(0x10 | (size >> 24));
+    out += (char)(size >> 16);
+    out += (char)(size >> 8);
+    out += (char)size;
+    return out + body;
+}
+
+static std::string unknownSize(uint32_t element_id) {
+    return id(element_id) + std::string("\x01\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 8);
+}
+
+static const std::string header = element(EBML_ID_HEADER, "webm");
+static const std::string info = element(EBML_ID_INFO, "info");
+static const std::string tracks = element(EBML_ID_TRACKS, "opus");
+
+static std::string cluster(int n, size_t block = 16) {
+    return unknownSize(EBML_ID_CLUSTER) + element(0xE7, std::string(1, (char)n)) + element(0xA3, std::string(block, (char)n));
+}
+
+static std::string expectedInit() {
+    return header + unknownSize(EBML_ID_SEGMENT) + info + tracks;
+}
+
+static Bytes bytes(const std::string &s) {
+    return Bytes(s);
+}
+
+static std::string str(const Bytes &b) {
+    return std::string(b.data, b.size);
+}
+
+static void parser() {
+    std::string stream = header + unknownSize(EBML_ID_SEGMENT) + element(0x114D9B74, "seek") + info + tracks;
+    size_t first_cluster = stream.size();
+    stream += cluster(1);
+    size_t second_cluster = stream.size();
+    stream += cluster(2);
+
+    WebmParser whole;
+    whole.feed((const uint8_t *)stream.data(), stream.size());
+    assert(!whole.isBroken());
+    assert(whole.init() == expectedInit());  // SeekHead left out
+    assert(whole.clusterStart() == (int64_t)second_cluster);
+    assert(whole.position() == stream.size());
+
+    WebmParser bytewise;
+    for (size_t i = 0; i < stream.size(); i++) {
+        bytewise.feed((const uint8_t *)stream.data() + i, 1);
+        if (i + 1 == first_cluster + 4) {
+            assert(bytewise.clusterStart() == -1);
+        }
+    }
+    assert(bytewise.init() == whole.init() && bytewise.clusterStart() == whole.clusterStart());
+
+    WebmParser garbage;
+    garbage.feed((const uint8_t *)"\x00\x00\x00", 3);
+    assert(garbage.isBroken() && garbage.init().empty());
+}
+
+static void catchUp() {
+    StreamHistory history;
+    int a;
+    bool resumed;
+    assert(history.catchUp(-1, resumed).empty() && !resumed);
+
+    history.add(&a, bytes(header + unknownSize(EBML_ID_SEGMENT) + info));
+    history.add(&a, bytes(tracks + cluster(1)));
+    std::string second = cluster(2);
+    history.add(&a, bytes(second.substr(0, 5)));
+    history.add(&a, bytes(second.substr(5)));
+    assert(history.lastSeq() == 4);
+
+    std::vector<Bytes> fast = history.catchUp(-1, resumed);
+    assert(!resumed && fast.size() == 1);
+    assert(str(fast[0]) == expectedInit() + second);
+
+    std::vector<Bytes> missed = history.catchUp(2, resumed);
+    assert(resumed && missed.size() == 2);
+    assert(str(missed[0]) + str(missed[1]) == second);
+    assert(history.catchUp(4, resumed).empty() && resumed);
+
+    // a sequence number from the future or long gone gets a fast start
+    assert(history.catchUp(99, resumed).size() == 1 && !resumed);
+}
+
+static void parserOutlivesRing() {
+    StreamHistory history;
+    int a, b;
+    history.add(&a, bytes(header + unknownSize(EBML_ID_SEGMENT) + info + tracks + cluster(1)));
+
+    // b floods the room until a's messages, even its latest Cluster, are gone
+    std::string noise((size_t)WEBM_MAX_CLUSTER_BYTES / WEBM_HISTORY_MESSAGES * 2, 'x');
+    for (int i = 0; i < WEBM_HISTORY_MESSAGES; i++) {
+        history.add(&b, bytes(noise));
+    }
+    bool resumed;
+    assert(history.catchUp(-1, resumed).empty());
+    history.catchUp(1, resumed);
+    assert(!resumed);
+
+    // a carries on; its next Cluster is only readable with the state kept
+    std::string next = cluster(2);
+    history.add(&a, bytes(next));
+    std::vector<Bytes> fast = history.catchUp(-1, resumed);
+    assert(!resumed && fast.size() == 1);
+    assert(str(fast[0]) == expectedInit() + next);
+
+    // gone for good: a new connection at the same address starts afresh
+    history.forget(&a);
+    assert(history.catchUp(-1, resumed).empty());
+    history.add(&a, bytes(cluster(3)));
+    assert(history.catchUp(-1, resumed).empty());
+}
+
+static void shared() {
+    // the history keeps a view of the caller's buffer, not a copy
+    auto owner = std::make_shared<std::string>(header + unknownSize(EBML_ID_SEGMENT) + info + tracks + cluster(1));
+    std::weak_ptr<std::string> watch = owner;
+    {
+        StreamHistory history;
+        int a;
+        bool resumed;
+        history.add(&a, Bytes(owner, owner->data(), owner->size()));
+        owner.reset();
+        assert(!watch.expired());
+        std::vector<Bytes> missed = history.catchUp(0, resumed);
+        assert(resumed && missed.size() == 1 && missed[0].data == watch.lock()->data());
+    }
+    assert(watch.expired());
+}
+
+static void cursor() {
+    StreamCursor c;
+    assert(c.next(5) == STREAM_CURSOR_RESYNC);  // never told anything
+    c.told(5);
+    assert(c.next(6) == STREAM_CURSOR_NONE && c.next(7) == STREAM_CURSOR_NONE);
+    assert(c.next(9) == STREAM_CURSOR_RESYNC);  // 8 went to someone else
+    assert(c.next(10) == STREAM_CURSOR_NONE);
+    c.lost();
+    assert(c.next(11) == STREAM_CURSOR_RESYNC);  // counted one that never arrived
+    assert(c.next(12) == STREAM_CURSOR_NONE);
+
+    // unkept messages: told once that there is no number, then nothing
+    assert(c.next(0) == STREAM_CURSOR_UNKNOWN);
+    for (int i = 0; i < 10; i++) {
+        assert(c.next(0) == STREAM_CURSOR_NONE);
+    }
+    // mixed with kept ones it stays that way
+    for (uint64_t seq = 13; seq < 23; seq++) {
+        assert(c.next(seq) == STREAM_CURSOR_NONE);
+        assert(c.next(0) == STREAM_CURSOR_NONE);
+    }
+    // two kept messages in a row and it has a number again
+    assert(c.next(23) == STREAM_CURSOR_NONE);
+    assert(c.next(24) == STREAM_CURSOR_RESYNC);
+    assert(c.next(25) == STREAM_CURSOR_NONE);
+}
+
+// the relay's worker loop for one layered sender and listeners on each
+// layer: no listener is sent anything extra once it has settled
+static void layeredSteadyState() {
+    typedef std::chrono::steady_clock clk;
+    StreamHistory history;
+    SimulcastRoom room;
+    SimulcastSubscriber subs[3];
+    StreamCursor cursors[3];
+    const double goodput[3] = {0, 40000, 1e6};  // fits layer 0, 1, 2
+    int extra[3] = {0, 0, 0};
+    int got[3] = {-1, -1, -1};
+    int sender;
+    auto now = clk::now();
+    for (int i = 0; i < 100; i++) {
+        now += std::chrono::milliseconds(100);
+        for (int layer = 0; layer < 3; layer++) {
+            SimulcastHeader hdr;
+            hdr.layer = (uint8_t)layer;
+            hdr.flags = SIMULCAST_SWITCH_POINT;
+            hdr.bitrate = 16000u << layer;
+            room.publish(&sender, hdr, now);
+            uint64_t seq = layer == 0 ? history.add(&sender, bytes(cluster(i))) : 0;
+            for (int l = 0; l < 3; l++) {
+                SimulcastLink link;
+                link.goodput_bps = goodput[l];
+                if (room.forward(subs[l], &sender, hdr, link, now) == SIMULCAST_SKIP) {
+                    continue;
+                }
+                got[l] = layer;
+                if (cursors[l].next(seq) != STREAM_CURSOR_NONE && i >= 50) {
+                    extra[l]++;
+                }
+            }
+        }
+    }
+    for (int l = 0; l < 3; l++) {
+        assert(got[l] == l && extra[l] == 0);
+    }
+}
+
+int main() {
+    cursor();
+    layeredSteadyState();
+    parser();
+    catchUp();
+    parserOutlivesRing();
+    shared();
+    printf("webm_test: ok\n");
+    return 0;
+}
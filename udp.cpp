@@ -4,182 +4,356 @@
 #include <arpa/inet.h>  // For sockaddr_in and inet_addr
 #include <unistd.h>     // For close()
 #include <algorithm>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "audio.h"
+#include "udp_io.h"
+#include "session.h"
 
-int sendFile( std::vector<int32_t*> &audioStream, int sockfd, sockaddr_in &client_addr, socklen_t &client_len){
-    std::ifstream file = getFile();
+#define SERVER_PORT 5523
+#define MAX_SESSIONS_PER_WORKER 4096
 
-    if(file.peek() == std::ifstream::traits_type::eof()) {
-        std::cerr << "WAV file is empty." << "\n";
-        return 1;
-    }
-    WavHeader header = getHeader(file);
+#define AUDIO_FILE "SampleWav.wav"
 
+void printSourceInfo(const ChunkSource &source){
+    const WavHeader &header = source.header();
     std::cout << "WAV file information:" << "\n";
-    std::cout << "  Format: " << header.riff << "\n";
+    std::cout << "  Format: " << std::string(header.riff, 4) << "\n";
     std::cout << "  Channels: " << header.num_channels << "\n";
     std::cout << "  Sample Rate: " << header.sample_rate << "\n";
     std::cout << "  Bits per Sample: " << header.bits_per_sample << "\n";
+    std::cout << "  Sample Format: " << sampleFormatName(sampleFormat(header)) << "\n";
     std::cout << "  Data Size: " << header.data_size << "\n";
+    std::cout << "The audio stream size is " << source.chunkCount() << " chunks" << std::endl;
+}
 
-    std::vector<int32_t> audioData = getAudio(header, file);
-    
-    if (audioData.empty()) {
-        std::cerr << "No audio data in file." << std::endl;
-        return 1;
+// every worker binds its own socket to the server port; SO_REUSEPORT has the
+// kernel spread clients across them by address, so a client always lands on
+// the same worker and sessions never cross threads
+int openServerSocket(int port){
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        std::cerr << "Error creating socket" << std::endl;
+        return -1;
+    }
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    int bufsize = 4 * 1024 * 1024;
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    // server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    server_addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        std::cerr << "Error binding socket to port " << port << std::endl;
+        close(sockfd);
+        return -1;
     }
-    std::cout << "The audio data size is" << audioData.size() << std::endl;
-    file.close();
-    int defcount = 0;
-    for(size_t i = 0; i < audioData.size(); i++){
-        if (audioData[i] != 0) {
-            defcount++;
+    return sockfd;
+}
+
+long threadCpuNs(){
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// one reactor per thread, on one of two backends: epoll over the worker's
+// socket and a timerfd for the earliest session deadline, or an io_uring with
+// a multishot receive that is waited on with that deadline as the timeout.
+// Sessions are serviced in between either way.
+struct Worker {
+    int index;
+    int sockfd;
+    int epfd;
+    int timerfd;
+    int fec_k;
+    int fec_m;
+    bool codec;
+    bool use_uring;
+    UdpBatch tx;
+    UdpReceiver rx;
+    UringUdp uring;
+    SessionTable sessions;
+
+    // cost of the current busy period (first session in to last one out)
+    long busy_cpu_ns = 0;
+    long busy_packets = 0;
+    long busy_syscalls = 0;
+    long loop_syscalls = 0;               // epoll_wait, timerfd reads and re-arms
+    std::vector<double> wakeup_late_us;   // how far past a session deadline we ran
+
+    Worker(int index, int sockfd, int batch_depth, bool offload, int fec_k, int fec_m, bool codec, bool want_uring)
+        : index(index), sockfd(sockfd), fec_k(fec_k), fec_m(fec_m), codec(codec), use_uring(want_uring), tx(sockfd, batch_depth, offload),
+          // ACKs are small and sparse, GRO buys nothing on this side
+          rx(sockfd, batch_depth, false) {
+        if (use_uring) {
+            use_uring = uring.init(sockfd, false);
+            if (use_uring) {
+                tx.uring = &uring;
+                uring.registerSendBuffer(tx.storage.data(), tx.storage.size());
+            } else {
+                std::cerr << "Worker " << index << ": falling back to epoll" << std::endl;
+            }
+        }
+        if (use_uring) {
+            epfd = timerfd = -1;
+            return;
         }
+        epfd = epoll_create1(0);
+        timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = sockfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+        ev.data.fd = timerfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
     }
-    std::cout << "Number of non-zero samples: " << defcount << " % " << static_cast<float>(defcount) / audioData.size() * 100 << std::endl;
-    std::cout << std::endl;
-    audioStream = getAudioStream(audioData);
-    std::cout << "The audio stream size is" << audioStream.size() << std::endl;
-
-    for (int i = 0; i < audioStream.size(); i++) {
-        datagram dg;
-        dg.id = i;
-        snprintf(dg.message, sizeof(dg.message), "Hello from datagram %d", i);
-        
-        dg.header = header;
-    
-        if (audioStream[i] != nullptr) {
-            memcpy(dg.data, audioStream[i], 256 * sizeof(int32_t));
-        } else {
-            std::cerr << "Warning: Audio chunk " << i << " is null" << std::endl;
-            return 1;
+
+    void run() {
+        std::cout << "Worker " << index << " listening on fd " << sockfd
+                  << (use_uring ? " (io_uring)" : " (epoll)") << std::endl;
+        if (use_uring) {
+            runUring();
+            return;
+        }
+        epoll_event events[2];
+        cc_time next = cc_time::max();
+        while (true) {
+            int n = epoll_wait(epfd, events, 2, -1);
+            loop_syscalls++;
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Worker " << index << ": epoll_wait failed" << std::endl;
+                return;
+            }
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.fd == timerfd) {
+                    uint64_t expirations;
+                    read(timerfd, &expirations, sizeof(expirations));
+                    loop_syscalls++;
+                }
+            }
+            noteWakeup(next);
+            while (true) {
+                int n = rx.receive(MSG_DONTWAIT);
+                if (n <= 0) {
+                    break;
+                }
+                handlePackets(rx.received);
+                if (n < rx.depth) {
+                    break;
+                }
+            }
+            next = serviceSessions(ccNow());
+            tx.flush();
+            armTimer(next);
         }
+    }
 
-        ssize_t sent_len = sendPacket(sockfd, dg, client_addr, client_len);
-        
-        if (sent_len < 0) {
-            std::cerr << "Error sending datagram" << std::to_string(dg.id)<< std::endl;
-            return 1;
+    // the deadline is the wait timeout, so one io_uring_enter per round both
+    // submits the sends and sleeps until a packet or the deadline arrives
+    void runUring() {
+        cc_time next = cc_time::max();
+        while (true) {
+            long timeout_ns = -1;
+            if (next != cc_time::max()) {
+                timeout_ns = std::max(0L, (long)std::chrono::duration_cast<std::chrono::nanoseconds>(next - ccNow()).count());
+            }
+            if (uring.receive(timeout_ns) < 0) {
+                std::cerr << "Worker " << index << ": io_uring wait failed: " << strerror(errno) << std::endl;
+                return;
+            }
+            noteWakeup(next);
+            handlePackets(uring.received);
+            next = serviceSessions(ccNow());
+            tx.flush();
         }
     }
-    datagram dg;
-    dg.id = -1;
-    // dg.header.data_size = audioData.size();
-    snprintf(dg.message, sizeof(dg.message), "Hello from datagram %d", dg.id);
-    
-    std::cout << "Sending: " << dg.message << std::endl;
-    ssize_t sent_len = sendPacket(sockfd, dg, client_addr, client_len);
-    if (sent_len < 0) {
-        std::cerr << "Error sending datagram" << std::to_string(dg.id)<< std::endl;
-        return 1;
+
+    long syscalls() const {
+        return use_uring ? uring.ring.syscalls : tx.syscalls + rx.syscalls + loop_syscalls;
     }
-    return 0;
-}
 
-int sendRetry(datagram &client_dg, std::vector<int32_t*> &audioStream, int sockfd, sockaddr_in &client_addr, socklen_t &client_len, std::vector<int32_t> &chunks_to_resend, datagram &reply){
-    if (client_dg.id == -2){
-        // add chunk id to a buffer of chunk ids
-        for (int32_t chunk : client_dg.data) {
-            if (chunk < 0 || chunk >= audioStream.size()){
-                std::cout << "INVALID CHUNK: " << chunk << std::endl;
-            } // end of valid chunk ids
+    long packets() const {
+        return tx.packets + (use_uring ? uring.packets : rx.packets);
+    }
 
-            chunks_to_resend.push_back(chunk);
-            
+    void noteWakeup(cc_time deadline) {
+        cc_time now = ccNow();
+        if (!sessions.empty() && deadline != cc_time::max() && now >= deadline) {
+            wakeup_late_us.push_back(std::chrono::duration<double, std::micro>(now - deadline).count());
         }
-        std::cout << "num chunks to resend: " << chunks_to_resend.size() << std::endl;
-    }else if (client_dg.id == -3){
-        // resend all chunks
-        std::cout << "Resending missing chunks..." << std::endl;
-        for (int32_t chunk : chunks_to_resend) {
-            reply.id = chunk;
-            memcpy(reply.data, audioStream[chunk], 256 * sizeof(int32_t));
-            ssize_t sent_len = sendPacket(sockfd, reply, client_addr, client_len);
-            if (sent_len < 0) {
-                std::cerr << "Error sending datagram" << std::to_string(reply.id)<< std::endl;
+    }
+
+    void beginBusy() {
+        busy_cpu_ns = threadCpuNs();
+        busy_packets = packets();
+        busy_syscalls = syscalls();
+        wakeup_late_us.clear();
+    }
+
+    // CPU and syscalls per packet sent or received while sessions were active
+    void reportBusy() {
+        long pkts = std::max(1L, packets() - busy_packets);
+        double cpu_ns = threadCpuNs() - busy_cpu_ns;
+        std::sort(wakeup_late_us.begin(), wakeup_late_us.end());
+        auto pct = [&](double q) {
+            return wakeup_late_us.empty() ? 0.0 : wakeup_late_us[(size_t)(q * (wakeup_late_us.size() - 1))];
+        };
+        std::cout << "Worker " << index << " (" << (use_uring ? "io_uring" : "epoll") << "): "
+                  << pkts << " packets, " << cpu_ns / pkts << " ns CPU/packet, "
+                  << (double)(syscalls() - busy_syscalls) / pkts << " syscalls/packet, wakeup lateness p50 "
+                  << pct(0.5) << " us p99 " << pct(0.99) << " us max " << pct(1.0) << " us" << std::endl;
+    }
+
+    void handlePackets(const std::vector<ReceivedPacket> &received) {
+        for (const ReceivedPacket &pkt : received) {
+            PacketHeader hdr;
+            const uint8_t *payload;
+            if (!decodePacket(pkt.data, pkt.len, hdr, payload)) {
+                std::cerr << "Dropping malformed or unsupported packet" << std::endl;
+                continue;
+            }
+            SessionKey key = sessionKey(pkt.addr, hdr.stream_id);
+            auto it = sessions.find(key);
+            if (hdr.type == PKT_REQUEST) {
+                if (it != sessions.end()) {
+                    continue; // retransmitted request, already being served
+                }
+                if (sessions.size() >= MAX_SESSIONS_PER_WORKER) {
+                    std::cerr << "Worker " << index << ": session table full, ignoring stream " << hdr.stream_id << std::endl;
+                    continue;
+                }
+                // every session on every worker shares one mapping of the file
+                std::shared_ptr<const ChunkSource> source = ChunkSource::open(AUDIO_FILE);
+                if (!source) {
+                    continue;
+                }
+                std::cout << "Worker " << index << ": new stream " << hdr.stream_id << " for "
+                          << inet_ntoa(pkt.addr.sin_addr) << ":" << ntohs(pkt.addr.sin_port) << std::endl;
+                if (sessions.empty()) {
+                    beginBusy();
+                }
+                // compressed if the client can decode it; with FEC the chunks stay small
+                // enough for a parity packet to cover them
+                std::shared_ptr<const CodedChunks> coded;
+                if (codec && (hdr.flags & PKT_FLAG_CODEC) && codecSupports(source->header())) {
+                    coded = CodedChunks::open(source, fec_m > 0 ? CHUNK_BYTES : CODEC_MAX_BLOCK_BYTES);
+                }
+                auto session = std::make_unique<Session>(pkt.addr, hdr.stream_id, std::move(source), fec_k, fec_m, std::move(coded));
+                session->start(tx);
+                sessions.emplace(key, std::move(session));
+            } else if (hdr.type == PKT_ACK && it != sessions.end()) {
+                it->second->onAck(hdr, payload);
             }
-            
+            // anything else is late feedback for a finished stream
         }
-        chunks_to_resend.clear();
-        // send end of retry message
-        std::cout << "Sending end of retry." << std::endl;
+    }
 
-        datagram dg;
-        dg.id = -1;
-        snprintf(dg.message, sizeof(dg.message), "Hello from datagram %d", dg.id);
-        
-        std::cout << "Sending: " << dg.message << std::endl;
-        ssize_t sent_len = sendPacket(sockfd, dg, client_addr, client_len);
-        if (sent_len < 0) {
-            std::cerr << "Error sending datagram" << std::to_string(dg.id)<< std::endl;
-        }    
+    // let every session make progress, reap the finished and the idle, and
+    // return the earliest time one of them needs to run again
+    cc_time serviceSessions(cc_time now) {
+        cc_time next = cc_time::max();
+        auto idle_limit = std::chrono::milliseconds(SESSION_IDLE_TIMEOUT_MS);
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            Session &session = *it->second;
+            if (!session.finished() && now - session.last_heard > idle_limit) {
+                session.failed = true;
+            }
+            cc_time deadline = session.service(tx, now);
+            if (session.finished()) {
+                session.report();
+                it = sessions.erase(it);
+                if (sessions.empty()) {
+                    reportBusy();
+                }
+                continue;
+            }
+            next = std::min(next, deadline);
+            ++it;
+        }
+        return next;
+    }
 
+    void armTimer(cc_time deadline) {
+        itimerspec its;
+        memset(&its, 0, sizeof(its));
+        if (deadline != cc_time::max()) {
+            long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+            ns = std::max(ns, 1L);
+            its.it_value.tv_sec = ns / 1000000000;
+            its.it_value.tv_nsec = ns % 1000000000;
+        }
+        timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, nullptr);
+        loop_syscalls++;
     }
-    return 0;
-}
+};
 
-int main(){
+int main(int argc, char *argv[]){
+    int batch_depth = DEFAULT_BATCH_DEPTH;
+    bool offload = true;
+    int worker_count = std::max(1u, std::thread::hardware_concurrency());
+    int fec_k = 0;
+    int fec_m = 0;
+    bool codec = true;
+    bool want_uring = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-gso") == 0) {
+            offload = false;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "uring") == 0 || strcmp(argv[i + 1], "epoll") == 0)) {
+            want_uring = strcmp(argv[++i], "uring") == 0;
+        } else if (strcmp(argv[i], "--fec") == 0 && i + 1 < argc &&
+                   sscanf(argv[++i], "%d,%d", &fec_k, &fec_m) == 2 && fec_k >= 1 && fec_m >= 1 &&
+                   fec_m <= FEC_MAX_M && fec_k + fec_m <= FEC_MAX_SHARDS) {
+            std::cout << "FEC: " << fec_m << " parity per " << fec_k << " chunks" << std::endl;
+        } else if (strcmp(argv[i], "--no-codec") == 0) {
+            codec = false;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--batch N] [--no-gso] [--workers N] [--fec K,M] [--no-codec] [--backend uring|epoll]" << std::endl;
+            return 1;
+        }
+    }
     std::cout << "Hello, UDP!" << std::endl;
 
-    //open port 5523 for communication
-    int port = 5523;
-    // bind socket to port
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        std::cerr << "Error creating socket" << std::endl;
+    // validate the file up front; the mapping is dropped again until a client
+    // asks for it
+    std::shared_ptr<const ChunkSource> source = ChunkSource::open(AUDIO_FILE);
+    if (!source) {
         return 1;
     }
+    printSourceInfo(*source);
+    source.reset();
 
-    sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    // server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-    server_addr.sin_port = htons(port);
-
-    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Error binding socket to port " << port << std::endl;
-        close(sockfd);
-        return 1;
+    //open port 5523 for communication
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < worker_count; i++) {
+        int sockfd = openServerSocket(SERVER_PORT);
+        if (sockfd < 0) {
+            return 1;
+        }
+        workers.push_back(std::make_unique<Worker>(i, sockfd, batch_depth, offload, fec_k, fec_m, codec, want_uring));
     }
+    std::cout << worker_count << " workers bound to port " << SERVER_PORT << ". Waiting for connection..." << std::endl;
 
-    std::cout << "Socket bound to fd " << sockfd << ". Waiting for connection..." << std::endl;
-
-    datagram dg;
-    datagram client_dg;
-    std::vector<int32_t*> audioStream;
-    sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    datagram reply;
-    std::vector<int32_t> chunks_to_resend;
-    // listen for incoming datagrams
-    while (true) {
-
-        ssize_t recv_len = recvfrom(sockfd, &client_dg, sizeof(client_dg), 0, (struct sockaddr*)&client_addr, &client_len);
-        std::cout << "Received datagram with id " << client_dg.id << std::endl;
-        if (recv_len < 0) {
-            std::cerr << "Error receiving datagram" << std::endl;
-            continue;
-        } else {
-            std::cout << "Received: " << client_dg.message << std::endl;
-            if (client_dg.id >= 0 && audioStream.empty()) {
-                // resend the requested chunk
-                sendFile(audioStream, sockfd, client_addr, client_len);
-            }else if (client_dg.id < 0 && !audioStream.empty()) {
-                
-                sendRetry(client_dg, audioStream, sockfd, client_addr, client_len, chunks_to_resend, reply);
-            }
-            else {
-                std::cerr << "Invalid datagram ID or audio stream not initialized." << client_dg.id << " " << client_dg.message << std::endl;
-                // break;
-                // return 1;
-            }
-        
-        }
+    std::vector<std::thread> threads;
+    for (auto &worker : workers) {
+        threads.emplace_back(&Worker::run, worker.get());
+    }
+    for (std::thread &t : threads) {
+        t.join();
     }
-    // for(int32_t* chunk : audioStream) {
-    //     delete[] chunk;
-    // }
-    // close(sockfd);
     return 0;
 }
@@ -0,0 +1,629 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include "dgram.h"
+#include "uring.h"
+
+// Batched datagram I/O for udp.cpp and udpclient.cpp.
+// Outgoing packets are staged in UdpBatch and leave in one sendmmsg call per
+// flush; runs of equal sized packets to the same peer are additionally glued
+// into a single UDP_SEGMENT (GSO) message so the kernel splits them. A packet
+// may also be a header in its slot plus a payload that stays where it lives
+// (e.g. a mapped file), gathered by the kernel without a copy here. Incoming
+// packets are pulled with recvmmsg, and with UDP_GRO enabled one buffer may
+// hold several coalesced datagrams which are split again here. Whenever the
+// kernel refuses GSO or GRO the plain one-datagram-per-message path is used.
+// UringUdp is the io_uring alternative to both: a multishot receive into a
+// provided buffer ring, and the same messages submitted as SENDMSG sqes.
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define DEFAULT_BATCH_DEPTH 32
+#define MAX_BATCH_DEPTH 256
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
+#define GRO_BUFFER_SIZE 65536
+
+inline bool sameAddr(const sockaddr_in &a, const sockaddr_in &b) {
+    return a.sin_port == b.sin_port && a.sin_addr.s_addr == b.sin_addr.s_addr;
+}
+
+struct ReceivedPacket {
+    const uint8_t *data;
+    size_t len;
+    sockaddr_in addr;
+};
+
+// GRO splits one coalesced buffer back into datagrams of seg bytes
+inline void splitDatagrams(std::vector<ReceivedPacket> &out, const uint8_t *data, size_t len, size_t seg, const sockaddr_in &addr) {
+    for (size_t off = 0; off < len; off += seg) {
+        ReceivedPacket pkt;
+        pkt.data = data + off;
+        pkt.len = std::min(seg, len - off);
+        pkt.addr = addr;
+        out.push_back(pkt);
+    }
+}
+
+inline size_t groSegment(msghdr &mh, size_t len) {
+    for (cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm != nullptr; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+            if (gso_size > 0) {
+                return gso_size;
+            }
+        }
+    }
+    return len;
+}
+
+#define URING_ENTRIES 256
+#define URING_RECV_BUFFERS 256     // power of two
+#define URING_GRO_RECV_BUFFERS 64  // 64k each with GRO
+#define URING_BUFFER_GROUP 1
+#define URING_BUFFER_ALIGN 16      // provided buffers start on this boundary
+#define URING_MAX_RECV_ERRORS 8    // failed receives in a row before giving up on the ring
+#define URING_TAG_RECV 1
+#define URING_TAG_SEND 2
+#define URING_TAG_SEND_FIXED 3
+
+// io_uring datagram engine for one socket. Receiving never costs a syscall of
+// its own: one multishot RECVMSG keeps filling buffers from a provided buffer
+// ring and the completions are picked up whenever the ring is entered to wait
+// or to submit sends. Sends reference the caller's msghdrs, so payloads can
+// still be gathered from wherever they live (the kernel refuses to register
+// read-only file mappings, so the chunk store is not a fixed buffer). Packets
+// sitting wholly in the registered send buffer go out as fixed-buffer
+// SEND_ZC, which neither copies nor pins their pages per call.
+struct UringUdp {
+    IoUring ring;
+    int sockfd = -1;
+    bool use_gro = false;
+    bool use_fixed = false;
+    size_t buffer_size = 0;
+    unsigned buffer_count = 0;
+
+    std::vector<uint8_t> buffers;
+    // the ring is addressed as plain io_uring_buf entries: the flexible array
+    // in io_uring_buf_ring gets shifted by a C++ compiler; the tail overlays
+    // the first entry's resv field
+    io_uring_buf *buf_ring = nullptr;
+    size_t buf_ring_len = 0;
+    uint16_t buf_tail = 0;
+    msghdr recv_msg;                     // how much room name and control get in each buffer
+    bool armed = false;
+    int recv_error = 0;                  // errno of the last failed receive
+    int recv_errors = 0;                 // failed receives since the last good one
+
+    const uint8_t *fixed_base = nullptr;
+    size_t fixed_len = 0;
+
+    int sends_inflight = 0;
+    int send_error = 0;
+    bool fixed_checked = false;   // the first fixed send doubles as a probe
+    bool fixed_rejected = false;
+
+    // received is what the caller works on; completions reaped meanwhile
+    // (e.g. while waiting for sends) collect in incoming
+    std::vector<ReceivedPacket> received;
+    std::vector<ReceivedPacket> incoming;
+    std::vector<uint16_t> received_bids;
+    std::vector<uint16_t> incoming_bids;
+
+    long packets = 0;
+
+    UringUdp() = default;
+    UringUdp(const UringUdp &) = delete;
+    UringUdp &operator=(const UringUdp &) = delete;
+
+    ~UringUdp() {
+        if (buf_ring != nullptr) {
+            munmap(buf_ring, buf_ring_len);
+        }
+    }
+
+    bool init(int fd, bool gro) {
+        sockfd = fd;
+        if (!ring.init(URING_ENTRIES)) {
+            std::cerr << "io_uring not available: " << strerror(errno) << std::endl;
+            return false;
+        }
+        // the socket as fixed file 0 saves an fd lookup per operation
+        if (ring.registerFiles(&sockfd, 1) < 0) {
+            std::cerr << "io_uring: registering the socket failed" << std::endl;
+            return false;
+        }
+        if (gro) {
+            int on = 1;
+            use_gro = setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+            if (!use_gro) {
+                std::cerr << "UDP GRO not available, receiving one datagram per buffer" << std::endl;
+            }
+        }
+        memset(&recv_msg, 0, sizeof(recv_msg));
+        recv_msg.msg_namelen = sizeof(sockaddr_in);
+        recv_msg.msg_controllen = use_gro ? CMSG_SPACE(sizeof(int)) : 0;
+        buffer_count = use_gro ? URING_GRO_RECV_BUFFERS : URING_RECV_BUFFERS;
+        buffer_size = sizeof(io_uring_recvmsg_out) + recv_msg.msg_namelen + recv_msg.msg_controllen +
+                      (use_gro ? GRO_BUFFER_SIZE : MAX_PACKET_SIZE);
+        // every buffer starts where the header and the cmsgs after it are aligned
+        buffer_size = (buffer_size + URING_BUFFER_ALIGN - 1) / URING_BUFFER_ALIGN * URING_BUFFER_ALIGN;
+        buffers.resize(buffer_count * buffer_size);
+
+        buf_ring_len = buffer_count * sizeof(io_uring_buf);
+        void *mem = mmap(nullptr, buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        buf_ring = static_cast<io_uring_buf *>(mem);
+        if (ring.registerBufferRing(buf_ring, buffer_count, URING_BUFFER_GROUP) < 0) {
+            std::cerr << "io_uring: provided buffer rings not supported" << std::endl;
+            return false;
+        }
+        for (unsigned bid = 0; bid < buffer_count; bid++) {
+            provide(bid);
+        }
+        publish();
+        // multishot RECVMSG is 6.0+ while everything above is older; kernels
+        // without it fail the sqe at submission, so arm it right away and
+        // let the caller fall back to epoll if it bounced
+        arm();
+        ring.submit(0, -1);
+        reap();
+        if (!armed && recv_errors > 0) {
+            std::cerr << "io_uring: multishot recvmsg not supported (" << strerror(recv_error) << ")" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // packets that sit entirely inside [base, base + len) may be sent from a
+    // registered buffer; optional, and dropped at the first sign the kernel
+    // does not take fixed buffers on SEND
+    void registerSendBuffer(const uint8_t *base, size_t len) {
+        iovec iov;
+        iov.iov_base = const_cast<uint8_t *>(base);
+        iov.iov_len = len;
+        if (ring.registerBuffers(&iov, 1) == 0) {
+            fixed_base = base;
+            fixed_len = len;
+            use_fixed = true;
+        }
+    }
+
+    // wait up to timeout_ns (< 0: forever, 0: just look) for datagrams; the
+    // ones found are left in received, valid until the next call
+    int receive(long timeout_ns) {
+        for (uint16_t bid : received_bids) {
+            provide(bid);
+        }
+        if (!received_bids.empty()) {
+            publish();
+        }
+        received.clear();
+        received_bids.clear();
+        if (recv_errors >= URING_MAX_RECV_ERRORS) {
+            // re-arming only to fail again would spin; let the caller stop
+            errno = recv_error;
+            return -1;
+        }
+        if (!armed) {
+            arm();
+        }
+        if (incoming.empty() && ring.peek() == nullptr && timeout_ns != 0) {
+            int ret = ring.submit(1, timeout_ns);
+            if (ret < 0 && ret != -ETIME) {
+                errno = -ret;
+                return -1;
+            }
+        } else if (ring.queued > 0) {
+            ring.submit(0, -1);
+        }
+        reap();
+        received.swap(incoming);
+        received_bids.swap(incoming_bids);
+        packets += received.size();
+        return received.size();
+    }
+
+    // send msgs in order and wait until the kernel is done with them; 0 or
+    // the errno of the first failure
+    int sendMessages(mmsghdr *msgs, int count) {
+        send_error = 0;
+        for (int i = 0; i < count; i++) {
+            msghdr &mh = msgs[i].msg_hdr;
+            if (use_fixed && !fixed_checked && fitsFixed(mh)) {
+                // try it alone so that falling back keeps the packet order
+                waitSends();
+                queueSend(mh);
+                waitSends();
+                fixed_checked = true;
+                if (fixed_rejected) {
+                    queueSend(mh);
+                }
+                continue;
+            }
+            queueSend(mh);
+        }
+        waitSends();
+        return send_error;
+    }
+
+private:
+    uint8_t *bufferAt(unsigned bid) {
+        return &buffers[bid * buffer_size];
+    }
+
+    void provide(uint16_t bid) {
+        io_uring_buf *buf = &buf_ring[buf_tail & (buffer_count - 1)];
+        buf->addr = (uint64_t)bufferAt(bid);
+        buf->len = buffer_size;
+        buf->bid = bid;
+        buf_tail++;
+    }
+
+    void publish() {
+        __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+    }
+
+    void arm() {
+        io_uring_sqe *sqe = ring.getSqe();
+        if (sqe == nullptr) {
+            return;
+        }
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->addr = (uint64_t)&recv_msg;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = URING_TAG_RECV;
+        armed = true;
+    }
+
+    bool fitsFixed(const msghdr &mh) const {
+        const uint8_t *base = static_cast<const uint8_t *>(mh.msg_iov[0].iov_base);
+        return mh.msg_iovlen == 1 && mh.msg_controllen == 0 &&
+               base >= fixed_base && base + mh.msg_iov[0].iov_len <= fixed_base + fixed_len;
+    }
+
+    void queueSend(msghdr &mh) {
+        io_uring_sqe *sqe = ring.getSqe();
+        if (sqe == nullptr) {
+            send_error = EAGAIN;
+            return;
+        }
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+        if (use_fixed && fitsFixed(mh)) {
+            sqe->opcode = IORING_OP_SEND_ZC;
+            sqe->addr = (uint64_t)mh.msg_iov[0].iov_base;
+            sqe->len = mh.msg_iov[0].iov_len;
+            sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+            sqe->buf_index = 0;
+            sqe->addr2 = (uint64_t)mh.msg_name;
+            sqe->addr_len = mh.msg_namelen;
+            sqe->user_data = URING_TAG_SEND_FIXED;
+        } else {
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (uint64_t)&mh;
+            sqe->user_data = URING_TAG_SEND;
+        }
+        sends_inflight++;
+    }
+
+    void waitSends() {
+        ring.submit(0, -1);
+        reap();
+        while (sends_inflight > 0) {
+            ring.submit(1, -1);
+            reap();
+        }
+    }
+
+    void reap() {
+        io_uring_cqe *cqe;
+        while ((cqe = ring.peek()) != nullptr) {
+            int tag = cqe->user_data & 0xff;
+            if (tag == URING_TAG_RECV) {
+                onReceive(cqe);
+            } else if (cqe->flags & IORING_CQE_F_NOTIF) {
+                sends_inflight--;  // zero-copy send: the kernel let go of the buffer
+            } else {
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    sends_inflight--;
+                }
+                if (cqe->res < 0) {
+                    int err = -cqe->res;
+                    if (tag == URING_TAG_SEND_FIXED && !fixed_checked) {
+                        std::cerr << "io_uring fixed-buffer send unsupported (" << strerror(err) << "), using SENDMSG" << std::endl;
+                        use_fixed = false;
+                        fixed_rejected = true;
+                    } else if (send_error == 0) {
+                        send_error = err;
+                    }
+                }
+            }
+            ring.advance();
+        }
+    }
+
+    void onReceive(io_uring_cqe *cqe) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            armed = false;  // out of buffers or an error ended the multishot
+        }
+        if (cqe->res < 0) {
+            if (cqe->res != -ENOBUFS) {
+                std::cerr << "io_uring receive failed: " << strerror(-cqe->res) << std::endl;
+                recv_error = -cqe->res;
+                recv_errors++;
+            }
+            return;
+        }
+        recv_errors = 0;
+        if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+            return;
+        }
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        incoming_bids.push_back(bid);
+        uint8_t *buf = bufferAt(bid);
+        io_uring_recvmsg_out out;
+        memcpy(&out, buf, sizeof(out));
+        if (out.flags & MSG_TRUNC) {
+            return;
+        }
+        uint8_t *name = buf + sizeof(io_uring_recvmsg_out);
+        uint8_t *control = name + recv_msg.msg_namelen;
+        uint8_t *payload = control + recv_msg.msg_controllen;
+        sockaddr_in addr;
+        memcpy(&addr, name, sizeof(addr));
+        size_t seg = out.payloadlen;
+        if (use_gro) {
+            msghdr mh;
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_control = control;
+            mh.msg_controllen = out.controllen;
+            seg = groSegment(mh, out.payloadlen);
+        }
+        splitDatagrams(incoming, payload, out.payloadlen, seg, addr);
+    }
+};
+
+struct UdpBatch {
+    int sockfd;
+    int depth;
+    bool use_gso;
+    int count = 0;
+
+    long packets = 0;
+    long syscalls = 0;
+    UringUdp *uring = nullptr;   // submit through io_uring instead of sendmmsg
+
+    std::vector<uint8_t> storage;
+    std::vector<size_t> lengths;
+    std::vector<size_t> slot_lengths;
+    std::vector<const uint8_t*> payloads;
+    std::vector<sockaddr_in> addrs;
+    std::vector<iovec> iovs;
+    std::vector<mmsghdr> msgs;
+    std::vector<uint8_t> control;
+
+    UdpBatch(int sockfd, int depth, bool gso)
+        : sockfd(sockfd), depth(std::clamp(depth, 1, MAX_BATCH_DEPTH)), use_gso(gso),
+          storage(this->depth * MAX_PACKET_SIZE), lengths(this->depth), slot_lengths(this->depth),
+          payloads(this->depth), addrs(this->depth), iovs(2 * this->depth), msgs(this->depth), control(this->depth * CMSG_SPACE(sizeof(uint16_t))) {
+        if (use_gso) {
+            // probe: kernels without UDP GSO reject the option outright
+            int probe = 0;
+            if (setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &probe, sizeof(probe)) < 0) {
+                std::cerr << "UDP GSO not available, sending one datagram per message" << std::endl;
+                use_gso = false;
+            }
+        }
+    }
+
+    // slot to encode the next packet into, hand it over with push()
+    uint8_t *next() {
+        return &storage[count * MAX_PACKET_SIZE];
+    }
+
+    int push(size_t len, const sockaddr_in &addr) {
+        return pushGather(len, nullptr, 0, addr);
+    }
+
+    // the slot holds only the first header_len bytes, the rest of the packet
+    // is sent from payload, which must stay valid until the next flush
+    int pushGather(size_t header_len, const uint8_t *payload, size_t payload_len, const sockaddr_in &addr) {
+        lengths[count] = header_len + payload_len;
+        slot_lengths[count] = header_len;
+        payloads[count] = payload;
+        addrs[count] = addr;
+        count++;
+        if (count == depth) {
+            return flush();
+        }
+        return 0;
+    }
+
+    int flush() {
+        if (count == 0) {
+            return 0;
+        }
+        int nmsgs = buildMessages();
+        if (uring != nullptr) {
+            int err = uring->sendMessages(msgs.data(), nmsgs);
+            if (err != 0 && use_gso && (err == EIO || err == EINVAL || err == EOPNOTSUPP)) {
+                std::cerr << "UDP GSO send failed, falling back to plain messages" << std::endl;
+                use_gso = false;
+                err = uring->sendMessages(msgs.data(), buildMessages());
+            }
+            if (err != 0) {
+                std::cerr << "Error sending batch: " << strerror(err) << std::endl;
+            }
+            packets += count;
+            count = 0;
+            return err != 0 ? -1 : 0;
+        }
+        int done = 0;
+        while (done < nmsgs) {
+            int sent = sendmmsg(sockfd, &msgs[done], nmsgs - done, 0);
+            syscalls++;
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == ENOBUFS) {
+                    pollfd pfd;
+                    pfd.fd = sockfd;
+                    pfd.events = POLLOUT;
+                    poll(&pfd, 1, 10);
+                    continue;
+                }
+                if (use_gso && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    // device or route can not segment: rebuild without GSO
+                    std::cerr << "UDP GSO send failed, falling back to plain sendmmsg" << std::endl;
+                    use_gso = false;
+                    nmsgs = buildMessages();
+                    done = 0;
+                    continue;
+                }
+                std::cerr << "Error sending batch: " << strerror(errno) << std::endl;
+                count = 0;
+                return -1;
+            }
+            done += sent;
+        }
+        packets += count;
+        count = 0;
+        return 0;
+    }
+
+    // one mmsghdr per message; with GSO a message covers a run of packets to
+    // the same peer where every packet but the last has the run's size
+    int buildMessages() {
+        int nmsgs = 0;
+        int i = 0;
+        while (i < count) {
+            int j = i + 1;
+            if (use_gso) {
+                size_t seg = lengths[i];
+                int max_segments = std::min<int>(GSO_MAX_SEGMENTS, GSO_MAX_BYTES / seg);
+                while (j < count && j - i < max_segments && lengths[j - 1] == seg && lengths[j] <= seg && sameAddr(addrs[j], addrs[i])) {
+                    j++;
+                }
+            }
+            int niov = 0;
+            iovec *iov = &iovs[2 * i];
+            for (int k = i; k < j; k++) {
+                iov[niov].iov_base = &storage[k * MAX_PACKET_SIZE];
+                iov[niov].iov_len = slot_lengths[k];
+                niov++;
+                if (payloads[k] != nullptr && lengths[k] > slot_lengths[k]) {
+                    iov[niov].iov_base = const_cast<uint8_t *>(payloads[k]);
+                    iov[niov].iov_len = lengths[k] - slot_lengths[k];
+                    niov++;
+                }
+            }
+            msghdr &mh = msgs[nmsgs].msg_hdr;
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_name = &addrs[i];
+            mh.msg_namelen = sizeof(sockaddr_in);
+            mh.msg_iov = iov;
+            mh.msg_iovlen = niov;
+            if (j - i > 1) {
+                uint8_t *cbuf = &control[nmsgs * CMSG_SPACE(sizeof(uint16_t))];
+                mh.msg_control = cbuf;
+                mh.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t seg = lengths[i];
+                memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+            }
+            nmsgs++;
+            i = j;
+        }
+        return nmsgs;
+    }
+};
+
+struct UdpReceiver {
+    int sockfd;
+    int depth;
+    bool use_gro;
+    size_t buffer_size;
+
+    long packets = 0;
+    long syscalls = 0;
+
+    std::vector<uint8_t> storage;
+    std::vector<sockaddr_in> addrs;
+    std::vector<iovec> iovs;
+    std::vector<mmsghdr> msgs;
+    std::vector<uint8_t> control;
+    std::vector<ReceivedPacket> received;
+
+    UdpReceiver(int sockfd, int depth, bool gro)
+        : sockfd(sockfd), depth(std::clamp(depth, 1, MAX_BATCH_DEPTH)), use_gro(gro) {
+        if (use_gro) {
+            int on = 1;
+            if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+                std::cerr << "UDP GRO not available, receiving one datagram per buffer" << std::endl;
+                use_gro = false;
+            }
+        }
+        buffer_size = use_gro ? GRO_BUFFER_SIZE : MAX_PACKET_SIZE;
+        storage.resize(this->depth * buffer_size);
+        addrs.resize(this->depth);
+        iovs.resize(this->depth);
+        msgs.resize(this->depth);
+        control.resize(this->depth * CMSG_SPACE(sizeof(int)));
+    }
+
+    // pull up to depth messages (flags as for recvmmsg, e.g. MSG_DONTWAIT);
+    // the datagrams they contain are left in received, valid until the next call
+    int receive(int flags) {
+        received.clear();
+        for (int i = 0; i < depth; i++) {
+            iovs[i].iov_base = &storage[i * buffer_size];
+            iovs[i].iov_len = buffer_size;
+            msghdr &mh = msgs[i].msg_hdr;
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_name = &addrs[i];
+            mh.msg_namelen = sizeof(sockaddr_in);
+            mh.msg_iov = &iovs[i];
+            mh.msg_iovlen = 1;
+            if (use_gro) {
+                mh.msg_control = &control[i * CMSG_SPACE(sizeof(int))];
+                mh.msg_controllen = CMSG_SPACE(sizeof(int));
+            }
+        }
+        int n = recvmmsg(sockfd, msgs.data(), depth, flags, nullptr);
+        syscalls++;
+        if (n < 0) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            msghdr &mh = msgs[i].msg_hdr;
+            const uint8_t *data = &storage[i * buffer_size];
+            size_t len = msgs[i].msg_len;
+            size_t seg = use_gro ? groSegment(mh, len) : len;
+            splitDatagrams(received, data, len, seg, addrs[i]);
+        }
+        packets += received.size();
+        return received.size();
+    }
+};
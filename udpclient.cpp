@@ -3,10 +3,45 @@
 #include <sys/socket.h> // For socket functions
 #include <arpa/inet.h>  // For sockaddr_in and inet_addr
 #include <unistd.h>     // For close()
+#include <cerrno>
+#include <ctime>
 #include "audio.h"
+#include "udp_io.h"
+#include "chunk_writer.h"
+#include "fec.h"
+#include "player.h"
+
+#define ACK_INTERVAL_MS 2
+#define RECEIVE_TIMEOUT_MS 5000
+
+int main(int argc, char *argv[]){
+    int batch_depth = DEFAULT_BATCH_DEPTH;
+    bool offload = true;
+    bool want_uring = true;
+    bool want_codec = true;
+    std::string output_file = "output.wav";
+    std::string play_sink;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-gro") == 0) {
+            offload = false;
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            output_file = argv[++i];
+        } else if (strcmp(argv[i], "--no-codec") == 0) {
+            want_codec = false;
+        } else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+            play_sink = argv[++i];
+        } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "uring") == 0 || strcmp(argv[i + 1], "epoll") == 0)) {
+            want_uring = strcmp(argv[++i], "uring") == 0;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--batch N] [--no-gro] [--out FILE] [--backend uring|epoll]\n"
+                      << "       [--no-codec] [--play portaudio|null|FILE.wav]" << std::endl;
+            return 1;
+        }
+    }
 
-int main(){
-    int port_client = 12345;
     int port_server = 5523;
     int sockfd_client;
     struct sockaddr_in server_addr;
@@ -17,7 +52,11 @@ int main(){
         std::cerr << "Error creating client socket" << std::endl;
         return 1;
     }
-    
+
+    // leave room for a full congestion window in the socket buffer
+    int rcvbuf = 8 * 1024 * 1024;
+    setsockopt(sockfd_client, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
 
     // Prepare server address
     memset(&server_addr, 0, sizeof(server_addr));
@@ -26,11 +65,12 @@ int main(){
     server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
     socklen_t server_len = sizeof(server_addr);
 
-    // Send message
-    datagram dg;
-    dg.id = 0;
-    snprintf(dg.message, sizeof(dg.message), "%d", port_client);
-    ssize_t sent_bytes = sendPacket(sockfd_client, dg, server_addr, server_len);
+    // Ask for the stream
+    uint32_t stream_id = (uint32_t)getpid() ^ (uint32_t)time(nullptr);
+    PlayClock::time_point requested = PlayClock::now();
+    uint8_t request[MAX_PACKET_SIZE];
+    size_t request_len = encodePacket(request, PKT_REQUEST, want_codec ? PKT_FLAG_CODEC : 0, stream_id, 0, nullptr, 0);
+    ssize_t sent_bytes = sendPacket(sockfd_client, request, request_len, server_addr, server_len);
 
     if (sent_bytes < 0) {
         std::cerr << "Error sending message" << std::endl;
@@ -40,87 +80,194 @@ int main(){
 
     std::cout << "Message sent to UDP server" << std::endl;
 
-    std::vector<datagram> audioBuffer;
-    std::unordered_set<int> seenDatagrams;
-    size_t expected_samples = 154990600;
-    WavHeader header;
-    while (true) {
-        datagram server_dg;
+    // chunks go straight to their place in the output file
+    ChunkWriter output;
+    // coded streams are decoded into pcm before they are written
+    StreamInfo stream_info;
+    CodecDecoder decoder;
+    std::vector<uint8_t> pcm;
+    FecDecoder fec;
+    // --play: chunks are also played as they land, see player.h
+    Player player;
+    bool have_info = false;
+    int64_t highest_id = -1;
+    int64_t cumulative = 0;
+    int quiet_periods = 0;
+
+    // wake up periodically so holes keep getting reported while the line is quiet
+    timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = ACK_INTERVAL_MS * 1000;
+    setsockopt(sockfd_client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // io_uring: a multishot receive waited on with the ACK interval as the
+    // timeout; otherwise blocking recvmmsg calls bounded by SO_RCVTIMEO
+    UringUdp uring;
+    bool use_uring = want_uring && uring.init(sockfd_client, offload);
+    std::unique_ptr<UdpReceiver> rx;
+    if (!use_uring) {
+        rx = std::make_unique<UdpReceiver>(sockfd_client, batch_depth, offload);
+    }
+    const std::vector<ReceivedPacket> &packets = use_uring ? uring.received : rx->received;
+    // chunks rebuilt from parity are playable too
+    auto notePlayable = [&](int64_t group) {
+        if (!player.isOpen()) {
+            return;
+        }
+        for (int64_t id = group * fec.k; id <= fec.lastOf(group); id++) {
+            if (output.received.test(id)) {
+                player.onArrival(id);
+            }
+        }
+    };
+    bool complete = false;
+    while (!complete) {
         // sockaddr_in server_addr;
-        ssize_t recv_len = recvfrom(sockfd_client, &server_dg, sizeof(server_dg), 0, 
-                                (struct sockaddr*)&server_addr, &server_len);
-        if (recv_len < 0) {
-            std::cerr << "Error receiving datagram" << std::endl;
-            break;
+        int received = use_uring ? uring.receive(ACK_INTERVAL_MS * 1000000L) : rx->receive(MSG_WAITFORONE);
+        uint16_t ack_flags = have_info ? PKT_FLAG_HAVE_INFO : 0;
+        if (received == 0) {
+            errno = EAGAIN;
+            received = -1;
         }
-        if (recv_len >= 0 && server_dg.id % 1000 == 0) {
-            std::cout << "Received datagram with id " << server_dg.id << std::endl;
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Error receiving datagram" << std::endl;
+                break;
+            }
+            if (++quiet_periods * ACK_INTERVAL_MS > RECEIVE_TIMEOUT_MS) {
+                std::cerr << "Server stopped sending, giving up." << std::endl;
+                break;
+            }
+            if (highest_id >= 0) {
+                ackgram ack = buildAck(output.received, cumulative, highest_id);
+                sendAck(sockfd_client, server_addr, server_len, stream_id, ack_flags, ack);
+            } else if (!have_info && quiet_periods % 100 == 0) {
+                // nothing heard yet, the request itself may have been lost
+                sendPacket(sockfd_client, request, request_len, server_addr, server_len);
+            }
+            continue;
         }
-        // std::cout << "Received: " << server_dg.message << std::endl;
-        if (seenDatagrams.find(server_dg.id) == seenDatagrams.end() && server_dg.id != -1){
-            seenDatagrams.insert(server_dg.id);
-            // std::cout << "Received datagram with id " << server_dg.id << std::endl;
-            if (server_dg.id == 0) {
-                header = server_dg.header;
-            } else if (server_dg.id > 0) {
-                audioBuffer.push_back(server_dg); 
-            }       
-        } else if (server_dg.id == -1) {
-            std::vector<int> missingChunks = verifyAudioBuffer(audioBuffer, header, seenDatagrams);
-            if (!missingChunks.empty()) {
-                std::cerr << "Missing chunks detected" << std::endl;
-                
-                for (size_t i = 0; i < missingChunks.size(); i += 256) {
-                    // audioStream.push_back(std::copy(missingChunks.begin() + i, std::min(missingChunks.begin() + i + 256, missingChunks.end()), new int32_t[256]));
-                    datagram dg;
-                    dg.id = -2;
-                    snprintf(dg.message, sizeof(dg.message), "RETRY");
-                    std::vector<int32_t>::iterator begin = missingChunks.begin() + i;
-                    size_t chunk_size = std::min(static_cast<size_t>(256), missingChunks.size() - i);
-
-                    std::copy(begin, missingChunks.begin() + i + chunk_size, dg.data);
-                    std::fill(dg.data + chunk_size, dg.data + 256, 0);
-                    // memset(dg.data + sizeof(missingChunks.data()), 0, sizeof(dg.data) - sizeof(missingChunks.data()));
-                    // dg.data = reinterpret_cast<int32_t*>(missingChunks.data());
-                    ssize_t sent_bytes = sendPacket(sockfd_client, dg, server_addr, server_len);
-                    if (sent_bytes < 0) {
-                        std::cerr << "Error sending RETRY message" << std::endl;
-                        close(sockfd_client);
+        quiet_periods = 0;
+
+        // one ACK per batch: right away if something arrived out of order,
+        // otherwise once every ACK_EVERY new datagrams
+        bool need_ack = false;
+        for (const ReceivedPacket &pkt : packets) {
+            PacketHeader hdr;
+            const uint8_t *payload;
+            if (!decodePacket(pkt.data, pkt.len, hdr, payload) || hdr.stream_id != stream_id) {
+                continue;
+            }
+            if (hdr.type == PKT_STREAM_INFO) {
+                StreamInfo info;
+                if (!have_info && decodeStreamInfo(payload, hdr.payload_len, info)) {
+                    if (info.codec != CODEC_NONE && (info.codec != CODEC_LPC || !want_codec)) {
+                        std::cerr << "Server sent codec " << (int)info.codec << ", which was not asked for" << std::endl;
                         return 1;
                     }
+                    if (!fec.configure(info) || !output.open(output_file, info) ||
+                        (!play_sink.empty() && !player.open(play_sink, info, output, requested))) {
+                        return 1;
+                    }
+                    have_info = true;
+                    stream_info = info;
+                    pcm.resize(info.chunk_bytes);
+                    ack_flags = PKT_FLAG_HAVE_INFO;
+                    std::cout << "Stream info: " << info.chunk_count << " chunks of " << info.chunk_bytes << " bytes";
+                    if (fec.enabled()) {
+                        std::cout << ", FEC " << fec.k << "," << fec.m;
+                    }
+                    if (info.codec == CODEC_LPC) {
+                        std::cout << ", lossless coded";
+                    }
+                    std::cout << std::endl;
                 }
-
-                datagram end_dg;
-                end_dg.id = -3;
-                snprintf(end_dg.message, sizeof(end_dg.message), "RETRY");
-
-                std::cout << "Sending: " << end_dg.message << " " << end_dg.id << std::endl;
-                // socklen_t server_len = sizeof(server_addr);
-                ssize_t sent_len = sendPacket(sockfd_client, end_dg, server_addr, server_len);
-
-                if (sent_len < 0) {
-                    std::cerr << "Error sending datagram" << std::to_string(end_dg.id)<< std::endl;
-                    close(sockfd_client);
-                    return 1;
+            } else if (hdr.type == PKT_DATA) {
+                int64_t id = hdr.seq;
+                if (id % 1000 == 0) {
+                    std::cout << "Received datagram with id " << id << std::endl;
                 }
-            } else {
-                // expected_samples = server_dg.header.data_size / sizeof(int32_t);
-                break;
+                if (!have_info) {
+                    // nowhere to put it yet; left unacknowledged, it will be resent
+                    continue;
+                }
+                if (stream_info.codec != CODEC_NONE && id >= 0 && id < output.received.bits && !output.received.test(id)) {
+                    // a block that does not decode is dropped like a corrupt packet and resent
+                    size_t len = output.chunkLength(id);
+                    if (!decoder.decode(payload, hdr.payload_len, stream_info.header, pcm.data(), len)) {
+                        std::cerr << "Dropping undecodable block " << id << std::endl;
+                        continue;
+                    }
+                    payload = pcm.data();
+                    hdr.payload_len = len;
+                }
+                if (output.write(id, payload, hdr.payload_len)) {
+                    if (player.isOpen()) {
+                        player.onArrival(id);
+                    }
+                    if (id != highest_id + 1) {
+                        need_ack = true;
+                    }
+                    highest_id = std::max(highest_id, id);
+                    if (output.received.count % ACK_EVERY == 0) {
+                        need_ack = true;
+                    }
+                    if (fec.enabled() && fec.recover(fec.groupOf(id), output) > 0) {
+                        highest_id = std::max(highest_id, fec.lastOf(fec.groupOf(id)));
+                        notePlayable(fec.groupOf(id));
+                        need_ack = true;
+                    }
+                } else {
+                    // duplicate: the sender is retransmitting, make sure it hears from us
+                    need_ack = true;
+                }
+            } else if (hdr.type == PKT_FEC) {
+                // rebuild lost chunks here instead of waiting for a retransmission
+                int64_t group = have_info ? fec.addParity(hdr.seq, payload, hdr.payload_len, output) : -1;
+                if (group >= 0 && fec.recover(group, output) > 0) {
+                    highest_id = std::max(highest_id, fec.lastOf(group));
+                    notePlayable(group);
+                    need_ack = true;
+                }
+            } else if (hdr.type == PKT_END) {
+                need_ack = true;
+            }
+        }
+
+        if (output.complete()) {
+            // the final ACK may be lost, repeat it so the server can finish
+            ackgram ack = buildAck(output.received, cumulative, highest_id);
+            for (int i = 0; i < 3; i++) {
+                sendAck(sockfd_client, server_addr, server_len, stream_id, PKT_FLAG_HAVE_INFO, ack);
             }
+            complete = true;
+        } else if (need_ack) {
+            ackgram ack = buildAck(output.received, cumulative, highest_id);
+            sendAck(sockfd_client, server_addr, server_len, stream_id, ack_flags, ack);
         }
-        
     }
-    // header.data_size = audioBuffer.size() * 256 * sizeof(int32_t);
-    
-    std::cout << "recieved header with size " << header.data_size << std::endl;
-    std::cout << "recieved buffer with size " << audioBuffer.size() << std::endl;
-    std::vector<int32_t> processedAudio = processAudioBuffer(audioBuffer, header);
-    if (processedAudio.size() > expected_samples) {
-        std::cerr << "Warning: Expected " << expected_samples << " samples, but got " << processedAudio.size() << " samples." << std::endl;
-        processedAudio.resize(expected_samples); // Pad with zeros if needed
+    if (use_uring) {
+        std::cout << "Received " << uring.packets << " packets in " << uring.ring.syscalls << " io_uring calls"
+                  << (uring.use_gro ? " with GRO" : "") << std::endl;
+    } else {
+        std::cout << "Received " << rx->packets << " packets in " << rx->syscalls << " receive calls"
+                  << (rx->use_gro ? " with GRO" : "") << std::endl;
     }
-    writeFile(processedAudio, "output.wav", header);
-    
+    if (player.isOpen()) {
+        // the download is usually done long before the audio is
+        player.finish();
+        player.report();
+    }
+    if (!output.complete()) {
+        std::cerr << "Transfer incomplete: " << output.received.count << "/" << output.received.bits << " chunks" << std::endl;
+        return 1;
+    }
+    if (fec.enabled()) {
+        std::cout << "Recovered " << fec.recovered << " chunks from parity" << std::endl;
+    }
+    std::cout << "Wrote " << output.received.bits << " chunks (" << output.header.data_size << " bytes) to " << output_file << std::endl;
+    output.close();
+
     // Close socket
     // close(sockfd_client);
     return 0;
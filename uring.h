@@ -0,0 +1,205 @@
+#pragma once
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Minimal io_uring ring driven through the raw syscalls (no liburing in the
+// build): the shared submission/completion rings, registration helpers and a
+// submit-and-wait with an optional timeout.
+
+inline int ioUringSetup(unsigned entries, io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+inline int ioUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+inline int ioUringRegister(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+struct IoUring {
+    int fd = -1;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    unsigned *sq_flags;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    unsigned queued = 0;   // sqes filled in but not yet submitted
+
+    void *ring_ptr = MAP_FAILED;
+    size_t ring_len = 0;
+    size_t sqes_len = 0;
+
+    long syscalls = 0;
+
+    IoUring() = default;
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    ~IoUring() {
+        if (sqes_len > 0) {
+            munmap(sqes, sqes_len);
+        }
+        if (ring_ptr != MAP_FAILED) {
+            munmap(ring_ptr, ring_len);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // false when the kernel has no (usable) io_uring
+    bool init(unsigned entries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        // no interrupts for task work, it runs when we enter the kernel anyway
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+        p.cq_entries = entries * 4;
+        fd = ioUringSetup(entries, &p);
+        if (fd < 0 && errno == EINVAL) {
+            memset(&p, 0, sizeof(p));
+            p.flags = IORING_SETUP_CQSIZE;
+            p.cq_entries = entries * 4;
+            fd = ioUringSetup(entries, &p);
+        }
+        if (fd < 0) {
+            return false;
+        }
+        // one mapping for both rings and the timeout argument to enter are
+        // needed; both date from 5.11, anything older takes the epoll path
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+            return false;
+        }
+        ring_len = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                            p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+        ring_ptr = mmap(nullptr, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (ring_ptr == MAP_FAILED) {
+            return false;
+        }
+        void *sqes_ptr = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED) {
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe *>(sqes_ptr);
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+
+        uint8_t *ring = static_cast<uint8_t *>(ring_ptr);
+        sq_head = (unsigned *)(ring + p.sq_off.head);
+        sq_tail = (unsigned *)(ring + p.sq_off.tail);
+        sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        sq_array = (unsigned *)(ring + p.sq_off.array);
+        sq_flags = (unsigned *)(ring + p.sq_off.flags);
+        cq_head = (unsigned *)(ring + p.cq_off.head);
+        cq_tail = (unsigned *)(ring + p.cq_off.tail);
+        cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(ring + p.cq_off.cqes);
+        return true;
+    }
+
+    // next free sqe, zeroed; submits what is queued when the ring is full
+    io_uring_sqe *getSqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned tail = *sq_tail + queued;
+        if (tail - head >= sq_entries) {
+            submit(0, -1);
+            head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            tail = *sq_tail + queued;
+            if (tail - head >= sq_entries) {
+                return nullptr;
+            }
+        }
+        unsigned index = tail & sq_mask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        queued++;
+        return sqe;
+    }
+
+    // completions that are ready but only get posted once we enter the kernel
+    // (task work is not run behind our back with COOP_TASKRUN)
+    bool taskRunPending() const {
+        return __atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_TASKRUN;
+    }
+
+    // hand the queued sqes to the kernel and wait for min_complete
+    // completions, at most timeout_ns (< 0: no limit); returns the syscall
+    // result, -ETIME on timeout
+    int submit(unsigned min_complete, long timeout_ns) {
+        unsigned to_submit = queued;
+        __atomic_store_n(sq_tail, *sq_tail + queued, __ATOMIC_RELEASE);
+        queued = 0;
+        if (to_submit == 0 && min_complete == 0 && !taskRunPending()) {
+            return 0;
+        }
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        __kernel_timespec ts;
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        const void *argp = nullptr;
+        size_t argsz = 0;
+        if (min_complete > 0 && timeout_ns >= 0) {
+            ts.tv_sec = timeout_ns / 1000000000;
+            ts.tv_nsec = timeout_ns % 1000000000;
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (uint64_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+        int ret;
+        do {
+            ret = ioUringEnter(fd, to_submit, min_complete, flags, argp, argsz);
+            syscalls++;
+        } while (ret < 0 && errno == EINTR);
+        return ret < 0 ? -errno : ret;
+    }
+
+    io_uring_cqe *peek() {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            return nullptr;
+        }
+        return &cqes[head & cq_mask];
+    }
+
+    void advance() {
+        __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+    }
+
+    int registerFiles(const int *fds, unsigned count) {
+        return ioUringRegister(fd, IORING_REGISTER_FILES, fds, count) < 0 ? -errno : 0;
+    }
+
+    int registerBuffers(const iovec *iovs, unsigned count) {
+        return ioUringRegister(fd, IORING_REGISTER_BUFFERS, iovs, count) < 0 ? -errno : 0;
+    }
+
+    int registerBufferRing(void *ring_addr, unsigned entries, uint16_t group) {
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)ring_addr;
+        reg.ring_entries = entries;
+        reg.bgid = group;
+        return ioUringRegister(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ? -errno : 0;
+    }
+};
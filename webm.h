@@ -0,0 +1,411 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Late joiner fast start for relayed WebM (MediaRecorder audio/webm;codecs=opus).
+// A WebM stream only decodes from its start: the EBML header, the Segment
+// header and Info/Tracks (the init segment) and then whole Clusters. The
+// relay forwards the sender's timeslices as they come, so someone joining
+// mid-stream gets neither. StreamHistory parses just enough EBML, as the
+// bytes go by, to keep each sender's init segment and where its latest
+// Cluster starts, plus a short ring of recent messages. A joiner is sent, per
+// sender, the init segment and everything from the latest Cluster on as one
+// message and then carries on with the live messages; a reconnecting client that knows
+// the last sequence number it got is sent only what it missed.
+//
+// Sequence numbers count a room's relayed binary messages. Not thread safe:
+// the relay only touches a room's history from the worker the room is pinned to.
+//
+// Clients count binary messages from the last "STREAM_SEQ n" they were sent;
+// the relay keeps a StreamCursor per listener and sends the number again
+// wherever that count would be wrong, or "STREAM_SEQ none" when the client
+// is being sent messages the history does not keep.
+//
+// The history does not copy what it keeps: each message is a view of bytes
+// someone else owns (the relay's outgoing message), held alive by the view.
+
+#define WEBM_HISTORY_BYTES (2 * 1024 * 1024)  // ring budget per room
+#define WEBM_HISTORY_MESSAGES 64
+#define WEBM_MAX_CLUSTER_BYTES (8 * 1024 * 1024)  // a Cluster kept for joiners may pin this much
+
+#define EBML_ID_HEADER 0x1A45DFA3
+#define EBML_ID_SEGMENT 0x18538067
+#define EBML_ID_CLUSTER 0x1F43B675
+#define EBML_ID_INFO 0x1549A966
+#define EBML_ID_TRACKS 0x1654AE6B
+#define EBML_UNKNOWN_SIZE UINT64_MAX
+
+// Segment children; any of them ends a Cluster of unknown size
+inline bool ebmlSegmentChild(uint32_t id) {
+    switch (id) {
+    case EBML_ID_CLUSTER:
+    case EBML_ID_INFO:
+    case EBML_ID_TRACKS:
+    case 0x114D9B74:  // SeekHead
+    case 0x1C53BB6B:  // Cues
+    case 0x1254C367:  // Tags
+    case 0x1043A770:  // Chapters
+    case 0x1941A469:  // Attachments
+        return true;
+    }
+    return false;
+}
+
+// length of a variable length integer from its first byte, 0 if invalid
+inline int ebmlVintLength(uint8_t first, int max) {
+    for (int len = 1; len <= max; len++) {
+        if (first & (0x80 >> (len - 1))) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+// Incremental parser for one sender's stream. It never buffers more than an
+// element header; bodies are skipped, or copied when they belong to the init
+// segment.
+class WebmParser {
+public:
+    // feed the next bytes of the stream; clusterStart() and init() reflect them after
+    void feed(const uint8_t *data, size_t len) {
+        size_t pos = 0;
+        while (pos < len && !broken) {
+            if (skip > 0) {
+                size_t n = (size_t)std::min<uint64_t>(skip, len - pos);
+                if (capture) {
+                    init_building.append((const char *)data + pos, n);
+                }
+                pos += n;
+                offset += n;
+                skip -= n;
+                continue;
+            }
+            if (level == LEVEL_CLUSTER && cluster_end != EBML_UNKNOWN_SIZE && offset >= cluster_end) {
+                level = LEVEL_SEGMENT;
+            }
+            // gather one element header, at most 4 id bytes and 8 size bytes
+            header[header_len++] = data[pos++];
+            offset++;
+            int id_len = ebmlVintLength(header[0], 4);
+            if (id_len == 0) {
+                broken = true;
+                break;
+            }
+            if (header_len <= (size_t)id_len) {
+                continue;
+            }
+            int size_len = ebmlVintLength(header[id_len], 8);
+            if (size_len == 0) {
+                broken = true;
+                break;
+            }
+            if (header_len < (size_t)(id_len + size_len)) {
+                continue;
+            }
+            uint32_t id = 0;
+            for (int i = 0; i < id_len; i++) {
+                id = (id << 8) | header[i];
+            }
+            uint64_t size = header[id_len] & (0xFF >> size_len);
+            bool unknown = size == (uint64_t)(0xFF >> size_len);
+            for (int i = 1; i < size_len; i++) {
+                size = (size << 8) | header[id_len + i];
+                unknown = unknown && header[id_len + i] == 0xFF;
+            }
+            element(id, unknown ? EBML_UNKNOWN_SIZE : size, id_len);
+            header_len = 0;
+        }
+    }
+
+    // stream offset of the latest Cluster's first byte, -1 before the first
+    int64_t clusterStart() const {
+        return cluster_start;
+    }
+
+    // the init segment, empty until the first Cluster shows it is complete
+    const std::string &init() const {
+        return init_done;
+    }
+
+    // bytes fed so far
+    uint64_t position() const {
+        return offset;
+    }
+
+    bool isBroken() const {
+        return broken;
+    }
+
+private:
+    enum { LEVEL_TOP, LEVEL_SEGMENT, LEVEL_CLUSTER };
+
+    void element(uint32_t id, uint64_t size, int id_len) {
+        uint64_t start = offset - header_len;
+        if (id == EBML_ID_HEADER) {
+            // a new stream (MediaRecorder restarted); its init replaces the old one
+            init_building.assign((const char *)header, header_len);
+            level = LEVEL_TOP;
+            cluster_start = -1;
+            skipBody(size, true);
+            return;
+        }
+        if (level == LEVEL_CLUSTER && !ebmlSegmentChild(id)) {
+            // SimpleBlock, Timecode, BlockGroup...: part of the cluster, not looked into
+            skipBody(size, false);
+            return;
+        }
+        if (level == LEVEL_CLUSTER) {
+            level = LEVEL_SEGMENT;
+        }
+        if (level == LEVEL_TOP) {
+            if (id == EBML_ID_SEGMENT) {
+                // joiners get the Segment as unknown size; they join a live stream
+                init_building.append((const char *)header, id_len);
+                init_building.append("\x01\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 8);
+                level = LEVEL_SEGMENT;
+            } else {
+                skipBody(size, false);
+            }
+            return;
+        }
+        if (id == EBML_ID_CLUSTER) {
+            if (cluster_start < 0 || init_done.empty()) {
+                init_done = init_building;
+            }
+            cluster_start = (int64_t)start;
+            cluster_end = size == EBML_UNKNOWN_SIZE ? EBML_UNKNOWN_SIZE : offset + size;
+            level = LEVEL_CLUSTER;
+            return;
+        }
+        // Info and Tracks before the first Cluster are the rest of the init
+        // segment; SeekHead and Cues point at offsets a joiner will not have
+        bool keep = cluster_start < 0 && (id == EBML_ID_INFO || id == EBML_ID_TRACKS);
+        if (keep) {
+            init_building.append((const char *)header, header_len);
+        }
+        skipBody(size, keep);
+    }
+
+    void skipBody(uint64_t size, bool keep) {
+        if (size == EBML_UNKNOWN_SIZE) {
+            // only Segment and Cluster are expected to be open ended
+            broken = true;
+            return;
+        }
+        skip = size;
+        capture = keep;
+    }
+
+    uint8_t header[12];
+    size_t header_len = 0;
+    int level = LEVEL_TOP;
+    uint64_t offset = 0;
+    uint64_t skip = 0;
+    bool capture = false;
+    uint64_t cluster_end = EBML_UNKNOWN_SIZE;
+    int64_t cluster_start = -1;
+    std::string init_building;
+    std::string init_done;
+    bool broken = false;
+};
+
+// bytes owner keeps alive; nobody may write them while a view is held
+struct SharedBytes {
+    std::shared_ptr<const void> owner;
+    const char *data = nullptr;
+    size_t size = 0;
+
+    SharedBytes() = default;
+    SharedBytes(std::shared_ptr<const void> owner, const char *data, size_t size) : owner(std::move(owner)), data(data), size(size) {}
+
+    // a string of its own
+    explicit SharedBytes(std::string bytes) {
+        auto str = std::make_shared<const std::string>(std::move(bytes));
+        data = str->data();
+        size = str->size();
+        owner = std::move(str);
+    }
+};
+
+class StreamHistory {
+public:
+    typedef SharedBytes Bytes;
+
+    // a relayed binary message from sender; returns its sequence number
+    uint64_t add(const void *sender, const Bytes &payload) {
+        Sender &s = senders[sender];
+        Entry entry;
+        entry.seq = ++seq;
+        entry.sender = sender;
+        entry.offset = s.parser.position();
+        entry.payload = payload;
+        s.parser.feed((const uint8_t *)payload.data, payload.size);
+        entries.push_back(entry);
+        bytes += payload.size;
+        trim();
+        return entry.seq;
+    }
+
+    // What a listener joining now should be sent before the live messages.
+    // With resume_after set to the last sequence number the client got, and
+    // everything after it still here, that is the messages it missed, as they
+    // were relayed; otherwise one message per sender holding its init segment
+    // and its latest Cluster so far. Empty if there is nothing to catch up on.
+    std::vector<Bytes> catchUp(int64_t resume_after, bool &resumed) const {
+        std::vector<Bytes> out;
+        resumed = false;
+        if (resume_after >= 0 && !entries.empty() && (uint64_t)resume_after + 1 >= entries.front().seq && (uint64_t)resume_after <= seq) {
+            for (const Entry &e : entries) {
+                if (e.seq > (uint64_t)resume_after) {
+                    out.push_back(e.payload);
+                }
+            }
+            resumed = true;
+            return out;
+        }
+        for (const auto &entry : senders) {
+            const Sender &s = entry.second;
+            int64_t start = s.parser.clusterStart();
+            if (s.parser.isBroken() || s.parser.init().empty() || start < 0) {
+                continue;
+            }
+            std::string stream = s.parser.init();
+            bool complete = false;
+            for (const Entry &e : entries) {
+                if (e.sender != entry.first || e.offset + e.payload.size <= (uint64_t)start) {
+                    continue;
+                }
+                if (!complete) {
+                    // the ring must still hold the Cluster's first byte
+                    if (e.offset > (uint64_t)start) {
+                        break;
+                    }
+                    complete = true;
+                    size_t skip = (size_t)((uint64_t)start - e.offset);
+                    stream.append(e.payload.data + skip, e.payload.size - skip);
+                } else {
+                    stream.append(e.payload.data, e.payload.size);
+                }
+            }
+            if (complete) {
+                out.push_back(Bytes(std::move(stream)));
+            }
+        }
+        return out;
+    }
+
+    // sender has gone; until then its parser and init segment are kept
+    // however long ago its messages left the ring, since everything it sends
+    // later is only readable with them
+    void forget(const void *sender) {
+        senders.erase(sender);
+    }
+
+    // the sequence number of the latest message
+    uint64_t lastSeq() const {
+        return seq;
+    }
+
+private:
+    struct Entry {
+        uint64_t seq;
+        const void *sender;
+        uint64_t offset;  // where payload starts in the sender's stream
+        Bytes payload;
+    };
+
+    struct Sender {
+        WebmParser parser;
+    };
+
+    // drop old messages past the budget, keeping those a sender's latest
+    // Cluster still needs unless that Cluster has grown absurdly large. Only
+    // messages go; the senders' parsers stay, see forget().
+    void trim() {
+        while (!entries.empty() && (bytes > WEBM_HISTORY_BYTES || entries.size() > WEBM_HISTORY_MESSAGES)) {
+            const Entry &e = entries.front();
+            auto s = senders.find(e.sender);
+            bool needed = s != senders.end() && s->second.parser.clusterStart() >= 0 &&
+                          e.offset + e.payload.size > (uint64_t)s->second.parser.clusterStart();
+            if (needed && bytes <= WEBM_MAX_CLUSTER_BYTES) {
+                break;
+            }
+            bytes -= e.payload.size;
+            entries.pop_front();
+        }
+    }
+
+    uint64_t seq = 0;
+    size_t bytes = 0;
+    std::deque<Entry> entries;
+    std::map<const void *, Sender> senders;
+};
+
+// Where one listener's client thinks it is in a room's sequence: the last
+// "STREAM_SEQ n" it was sent plus one for every binary message since. That
+// count only means something while every message the client gets is one the
+// history kept. Messages the history does not keep (simulcast layers above 0)
+// have no place in the sequence, so a client being sent them is told
+// "STREAM_SEQ none" once and stops counting; it is told a number again only
+// after two kept messages in a row, so a listener mixing layers is not
+// re-synced on every message. Frames its queue drops also throw the count
+// off and get it re-sent with the next kept message. Only the room's worker
+// touches it.
+enum StreamCursorAction {
+    STREAM_CURSOR_NONE,    // the client's count is right, or it has none
+    STREAM_CURSOR_RESYNC,  // send "STREAM_SEQ seq - 1" first
+    STREAM_CURSOR_UNKNOWN  // send "STREAM_SEQ none" first
+};
+
+class StreamCursor {
+public:
+    // the client is being sent "STREAM_SEQ seq"
+    void told(uint64_t seq) {
+        at = seq;
+        known = true;
+        stale = false;
+        off_history = false;
+    }
+
+    // a message is about to be queued for the client; seq is its sequence
+    // number if the history kept it, 0 if not
+    StreamCursorAction next(uint64_t seq) {
+        if (seq == 0) {
+            off_history = true;
+            if (known) {
+                known = false;
+                return STREAM_CURSOR_UNKNOWN;
+            }
+            return STREAM_CURSOR_NONE;
+        }
+        bool was_off = off_history;
+        off_history = false;
+        if (known && !stale && at + 1 == seq) {
+            at = seq;
+            return STREAM_CURSOR_NONE;
+        }
+        if (was_off) {
+            // still getting unkept layers as well; stay without a number
+            known = false;
+            return STREAM_CURSOR_NONE;
+        }
+        told(seq);
+        return STREAM_CURSOR_RESYNC;
+    }
+
+    // something queued for the client was dropped; its count is off
+    void lost() {
+        stale = true;
+    }
+
+private:
+    uint64_t at = 0;
+    bool known = false;
+    bool stale = false;
+    bool off_history = false;  // sent a message the history did not keep since the last kept one
+};
@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <endian.h>
+
+// Binary WebSocket framing for server.cpp, the alternative to comma separated
+// decimal text. The client picks it in the URL it connects with,
+// /echo?mode=binary for raw samples or /echo?mode=coded for CODEC_LPC blocks
+// (codec.h); without a mode the server stays with text. Every binary message
+// is one frame, a fixed 24 byte header followed by the payload, all fields
+// little-endian:
+//
+//   0  version      u8   WS_FRAME_VERSION
+//   1  format       u8   SAMPLE_* (convert.h) of the samples in the payload
+//   2  channels     u8
+//   3  payload      u8   WS_PAYLOAD_*
+//   4  seq          u32  frame number, from 0
+//   8  sample_rate  u32
+//  12  timestamp    u64  position of the first sample frame in the stream
+//  20  pcm_bytes    u32  bytes of PCM the payload stands for
+//
+// The samples are in the file's own format, so 16 bit audio costs two bytes a
+// sample where text costs around eleven.
+
+#define WS_FRAME_VERSION 1
+#define WS_FRAME_HEADER_SIZE 24
+#define WS_FRAME_BYTES 4096     // PCM bytes per raw frame, rounded down to whole sample frames
+
+#define WS_PAYLOAD_RAW 0        // the PCM itself
+#define WS_PAYLOAD_CODED 1      // one CODEC_LPC block
+#define WS_PAYLOAD_END 2        // no payload, the stream is over
+
+#define WS_MODE_TEXT 0
+#define WS_MODE_BINARY 1
+#define WS_MODE_CODED 2
+
+struct WsFrameHeader {
+    uint8_t format;
+    uint8_t channels;
+    uint8_t payload;
+    uint32_t seq;
+    uint32_t sample_rate;
+    uint64_t timestamp;
+    uint32_t pcm_bytes;
+};
+
+inline size_t encodeWsFrameHeader(uint8_t *buf, const WsFrameHeader &hdr) {
+    uint32_t le32;
+    uint64_t le64;
+    buf[0] = WS_FRAME_VERSION;
+    buf[1] = hdr.format;
+    buf[2] = hdr.channels;
+    buf[3] = hdr.payload;
+    le32 = htole32(hdr.seq);
+    memcpy(buf + 4, &le32, 4);
+    le32 = htole32(hdr.sample_rate);
+    memcpy(buf + 8, &le32, 4);
+    le64 = htole64(hdr.timestamp);
+    memcpy(buf + 12, &le64, 8);
+    le32 = htole32(hdr.pcm_bytes);
+    memcpy(buf + 20, &le32, 4);
+    return WS_FRAME_HEADER_SIZE;
+}
+
+inline bool decodeWsFrameHeader(const uint8_t *buf, size_t len, WsFrameHeader &hdr) {
+    uint32_t le32;
+    uint64_t le64;
+    if (len < WS_FRAME_HEADER_SIZE || buf[0] != WS_FRAME_VERSION) {
+        return false;
+    }
+    hdr.format = buf[1];
+    hdr.channels = buf[2];
+    hdr.payload = buf[3];
+    memcpy(&le32, buf + 4, 4);
+    hdr.seq = le32toh(le32);
+    memcpy(&le32, buf + 8, 4);
+    hdr.sample_rate = le32toh(le32);
+    memcpy(&le64, buf + 12, 8);
+    hdr.timestamp = le64toh(le64);
+    memcpy(&le32, buf + 20, 4);
+    hdr.pcm_bytes = le32toh(le32);
+    return true;
+}
+
+// the mode= value of a connection's query string
+inline int wsMode(const std::string &mode) {
+    if (mode == "binary") {
+        return WS_MODE_BINARY;
+    }
+    if (mode == "coded") {
+        return WS_MODE_CODED;
+    }
+    return WS_MODE_TEXT;
+}